@@ -1,8 +1,38 @@
 #include "frame.h"
 #include "util.h"
+#include "topicTree.h"
+#include "topicSnapshot.h"
+#include "sharedSubscription.h"
+#include "retainStore.h"
+#include "packetID.h"
+#include "inflight.h"
+#include "timer.h"
+#include "logFile.h"
+#include "sessionStore.h"
+#include "offlineQueue.h"
+#include "sessionRegistry.h"
+#include "outbox.h"
+#include "stats.h"
+#include "latency.h"
+#include "metrics.h"
+#include "trace.h"
+#include "loopback.h"
+#include "auth.h"
+#include "acl.h"
+#include "rateLimit.h"
+#include "client.h"
+#include "broker.h"
 #include "gtest/gtest.h"
+#include <algorithm>
+#include <atomic>
 #include <string>
 #include <iostream>
+#include <fstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 TEST(UtilTest, NormalTest) {
     std::string data = "hello world";
@@ -46,6 +76,10 @@ TEST(UtilTest, NormalTest) {
     for (int i = 0; i < 3; i++) {
         EXPECT_TRUE(e_parts[i] == a_parts[i]);
     }
+
+    EXPECT_EQ(NO_ERROR, syncDirectory("/tmp/mqttcc_renamed"));
+    EXPECT_EQ(NO_ERROR, syncDirectory("relative"));
+    EXPECT_EQ(STORE_IO_ERROR, syncDirectory("/mqttcc_missing/renamed"));
 }
 
 TEST(FrameHeaderTest, NormalTest) {
@@ -123,6 +157,1380 @@ TEST(ConnectMessageTead, NormalTest) {
     EXPECT_TRUE(0 == memcmp(e_wire, a_wire, e_len));
 }
 
+TEST(TopicNodeTest, SubscriberTest) {
+    TopicNode* root = new TopicNode("", "");
+    std::vector<SubackCode> codes;
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(3, "a/b", 1, &codes));
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(7, "a/b", 0, &codes));
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(3, "a/b", 2, &codes));
+
+    std::vector<TopicNode*> nodes;
+    EXPECT_EQ(NO_ERROR, root->getTopicNode("a/b", false, &nodes));
+    EXPECT_EQ(1, nodes.size());
+    EXPECT_EQ(2, nodes[0]->subscribers.size());
+    EXPECT_EQ(3, nodes[0]->subscribers[0].session);
+    EXPECT_EQ(2, nodes[0]->subscribers[0].qos);
+
+    EXPECT_EQ(NO_ERROR, root->deleteSubscriber(3, "a/b"));
+    EXPECT_EQ(1, nodes[0]->subscribers.size());
+    EXPECT_EQ(7, nodes[0]->subscribers[0].session);
+    delete root;
+}
+
+TEST(TopicSnapshotTest, NormalTest) {
+    std::string path = "/tmp/mqttcc_snapshot_test.tree";
+    unlink(path.c_str());
+    TopicNode* root = new TopicNode("", "");
+    std::vector<SubackCode> codes;
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(0, "a/b", 1, &codes));
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(1, "a/b", 2, &codes));
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(1, "c/d/e", 0, &codes));
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(5, "c/d/e", 0, &codes));
+    std::vector<TopicNode*> nodes;
+    EXPECT_EQ(NO_ERROR, root->getTopicNode("a/b", false, &nodes));
+    nodes[0]->setSharedSubscriber("g", 0, 1);
+
+    std::vector<SnapshotSession> table(2);
+    table[0].slot = 0;
+    table[0].clientID = "c0";
+    table[0].subscriptions.push_back(std::make_pair(std::string("a/b"), 1));
+    table[1].slot = 1;
+    table[1].clientID = "c1";
+    table[1].subscriptions.push_back(std::make_pair(std::string("a/b"), 2));
+    table[1].subscriptions.push_back(std::make_pair(std::string("c/d/e"), 0));
+    EXPECT_EQ(NO_ERROR, TopicSnapshot::write(path, root, table));
+    delete root;
+
+    TopicSnapshot snapshot;
+    root = NULL;
+    std::vector<SnapshotSession> loaded;
+    EXPECT_EQ(NO_ERROR, snapshot.open(path, &root, &loaded));
+    EXPECT_EQ(2, loaded.size());
+    EXPECT_EQ("c1", loaded[1].clientID);
+    EXPECT_EQ(2, loaded[1].subscriptions.size());
+
+    // levels never walked into are copied from the mapping, filtered the same way
+    std::string copyPath = path + ".copy";
+    std::vector<SnapshotSession> kept(1, table[1]);
+    EXPECT_EQ(NO_ERROR, TopicSnapshot::write(copyPath, root, kept));
+    {
+        TopicSnapshot copy;
+        TopicNode* copied = NULL;
+        std::vector<SnapshotSession> copiedTable;
+        ASSERT_EQ(NO_ERROR, copy.open(copyPath, &copied, &copiedTable));
+        nodes.clear();
+        EXPECT_EQ(NO_ERROR, copied->getTopicNode("a/b", false, &nodes));
+        ASSERT_EQ(1, nodes.size());
+        ASSERT_EQ(1, nodes[0]->subscribers.size());
+        EXPECT_EQ(1, nodes[0]->subscribers[0].session);
+        EXPECT_EQ(0, nodes[0]->sharedGroups.size());
+        delete copied;
+    }
+    unlink(copyPath.c_str());
+
+    nodes.clear();
+    EXPECT_EQ(NO_ERROR, root->getTopicNode("a/b", false, &nodes));
+    EXPECT_EQ(1, nodes.size());
+    EXPECT_EQ(2, nodes[0]->subscribers.size());
+    EXPECT_EQ(1, nodes[0]->sharedGroups["g"]->members.size());
+    nodes.clear();
+    EXPECT_EQ(NO_ERROR, root->getTopicNode("c/d/e", false, &nodes));
+    EXPECT_EQ(1, nodes.size());
+    // slot 5 is not in the session table
+    EXPECT_EQ(1, nodes[0]->subscribers.size());
+    EXPECT_EQ(1, nodes[0]->subscribers[0].session);
+    EXPECT_EQ(NO_ERROR, root->applySubscriber(2, "c/x", 1, &codes));
+    EXPECT_EQ(3, root->dumpTree().size());
+    delete root;
+    unlink(path.c_str());
+}
+
+class FixedLoad : public SessionLoad {
+public:
+    bool isAvailable(uint32_t session) {return session != 2;};
+    uint32_t inflightCount(uint32_t session) {return session == 1 ? 0 : 5;};
+};
+
+TEST(SharedSubscriptionTest, NormalTest) {
+    std::string group, filter;
+    MQTT_ERROR err = NO_ERROR;
+    EXPECT_FALSE(splitSharedTopic("a/b", &group, &filter, err));
+    EXPECT_TRUE(splitSharedTopic("$share/g1/a/+", &group, &filter, err));
+    EXPECT_EQ(NO_ERROR, err);
+    EXPECT_EQ("g1", group);
+    EXPECT_EQ("a/+", filter);
+    EXPECT_TRUE(splitSharedTopic("$share/g1", &group, &filter, err));
+    EXPECT_EQ(MALFORMED_SHARED_SUBSCRIPTION, err);
+
+    SharedGroup g("g1");
+    g.setMember(0, 1);
+    g.setMember(1, 1);
+    g.setMember(2, 1);
+    FixedLoad load;
+    RoundRobinStrategy rr;
+    EXPECT_EQ(0, g.pick("a", &rr, &load)->session);
+    EXPECT_EQ(1, g.pick("a", &rr, &load)->session);
+    EXPECT_EQ(0, g.pick("a", &rr, &load)->session); // 2 is not available
+    LeastInflightStrategy li;
+    EXPECT_EQ(1, g.pick("a", &li, &load)->session);
+    StickyHashStrategy sh;
+    EXPECT_EQ(g.pick("a/b", &sh, &load)->session, g.pick("a/b", &sh, &load)->session);
+}
+
+TEST(RetainStoreTest, NormalTest) {
+    EXPECT_TRUE(topicMatch("a/+/c", "a/b/c"));
+    EXPECT_FALSE(topicMatch("a/+/c", "a/b/d"));
+    EXPECT_TRUE(topicMatch("a/#", "a"));
+    EXPECT_TRUE(topicMatch("a/#", "a/b/c"));
+    EXPECT_FALSE(topicMatch("a/#", "ab"));
+    EXPECT_FALSE(topicMatch("#", "$SYS/broker"));
+    EXPECT_TRUE(topicMatch("$SYS/#", "$SYS/broker"));
+
+    RetainStore store;
+    EXPECT_EQ(NO_ERROR, store.apply("fleet/1/temp", 1, "10"));
+    EXPECT_EQ(NO_ERROR, store.apply("fleet/2/temp", 0, "20"));
+    EXPECT_EQ(NO_ERROR, store.apply("fleet/3/hum", 0, "30"));
+    EXPECT_EQ(NO_ERROR, store.apply("other/1/temp", 0, "40"));
+    EXPECT_EQ(WILDCARD_CHARACTERS_IN_PUBLISH, store.apply("fleet/+", 0, "50"));
+    EXPECT_EQ(4, store.size());
+
+    std::vector<RetainedMatch> matches;
+    EXPECT_FALSE(store.scan("fleet/+/temp", "", 1, &matches));
+    EXPECT_EQ(1, matches.size());
+    EXPECT_EQ("fleet/1/temp", matches[0].topic);
+    EXPECT_TRUE(store.scan("fleet/+/temp", matches[0].topic, 1, &matches));
+    EXPECT_EQ(2, matches.size());
+    EXPECT_EQ("fleet/2/temp", matches[1].topic);
+
+    EXPECT_EQ(NO_ERROR, store.apply("fleet/1/temp", 0, ""));
+    EXPECT_TRUE(store.find("fleet/1/temp") == NULL);
+    EXPECT_EQ("20", store.find("fleet/2/temp")->payload);
+}
+
+TEST(RetainStoreTest, PersistenceTest) {
+    std::string path = "/tmp/mqttcc_retain_test.seg";
+    unlink(path.c_str());
+    {
+        RetainStore store;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.apply("a/1", 1, "one"));
+        EXPECT_EQ(NO_ERROR, store.apply("a/2", 0, "two"));
+        EXPECT_EQ(NO_ERROR, store.apply("a/1", 2, "uno"));
+        EXPECT_EQ(NO_ERROR, store.apply("a/2", 0, ""));
+        EXPECT_EQ(NO_ERROR, store.apply("$SYS/uptime", 0, "5"));
+    }
+    {
+        RetainStore store;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.apply("$SYS/uptime", 0, "1"));
+        EXPECT_EQ(1, store.indexedSize());
+        EXPECT_EQ(2, store.size());
+        EXPECT_EQ("1", store.find("$SYS/uptime")->payload);
+        EXPECT_EQ(NO_ERROR, store.apply("$SYS/uptime", 0, ""));
+        EXPECT_EQ(1, store.size());
+        EXPECT_EQ("uno", store.find("a/1")->payload);
+        EXPECT_EQ(2, store.find("a/1")->qos);
+        EXPECT_EQ(NO_ERROR, store.apply("a/3", 1, "three"));
+        EXPECT_EQ(NO_ERROR, store.apply("$SYS/uptime", 0, "2"));
+        EXPECT_EQ(NO_ERROR, store.compact());
+        EXPECT_EQ("2", store.find("$SYS/uptime")->payload);
+        std::vector<RetainedMatch> matches;
+        EXPECT_TRUE(store.scan("a/#", "", 10, &matches));
+        EXPECT_EQ(2, matches.size());
+        EXPECT_EQ("three", matches[1].payload);
+    }
+    {
+        RetainStore store;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(2, store.size());
+        EXPECT_EQ("three", store.find("a/3")->payload);
+        EXPECT_TRUE(store.find("$SYS/uptime") == NULL);
+    }
+    unlink(path.c_str());
+}
+
+TEST(RetainStoreTest, BackgroundIndexTest) {
+    std::string path = "/tmp/mqttcc_retain_index_test.seg";
+    unlink(path.c_str());
+    {
+        RetainStore store;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.apply("b/1", 0, "one"));
+        EXPECT_EQ(NO_ERROR, store.apply("b/2", 0, "two"));
+        EXPECT_EQ(NO_ERROR, store.apply("b/3", 0, "three"));
+    }
+    {
+        RetainStore store;
+        store.compactThreshold = 0;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        // changes made while the loader runs win over what it reads
+        for (int i = 0; i < 4; i++) {
+            EXPECT_EQ(NO_ERROR, store.apply("b/1", 1, "uno"));
+        }
+        EXPECT_EQ(NO_ERROR, store.apply("b/2", 0, ""));
+        EXPECT_EQ(NO_ERROR, store.apply("b/4", 0, "four"));
+        while (!store.ready()) {
+            usleep(1000);
+        }
+        EXPECT_EQ(3, store.size());
+        EXPECT_EQ("uno", store.find("b/1")->payload);
+        EXPECT_TRUE(store.find("b/2") == NULL);
+        EXPECT_EQ("three", store.find("b/3")->payload);
+        EXPECT_TRUE(store.needsCompaction());
+        EXPECT_EQ(NO_ERROR, store.compact());
+        EXPECT_FALSE(store.needsCompaction());
+    }
+    {
+        RetainStore store;
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(3, store.size());
+        EXPECT_TRUE(store.find("b/2") == NULL);
+        EXPECT_EQ("four", store.find("b/4")->payload);
+    }
+    unlink(path.c_str());
+}
+
+TEST(LogFileTest, GroupCommitTest) {
+    std::string path = "/tmp/mqttcc_log_test.log";
+    unlink(path.c_str());
+    int acked = 0;
+    {
+        LogFile log(1000);
+        EXPECT_EQ(NO_ERROR, log.open(path));
+        log.append("one", [&acked]{acked++;});
+        uint64_t seq = log.append("two", [&acked]{acked++;});
+        log.waitDurable(seq);
+        EXPECT_EQ(2, acked);
+        log.append("three");
+    }
+    std::vector<std::string> records;
+    {
+        // long enough that "four" is still buffered when rewrite runs
+        LogFile log(100000);
+        EXPECT_EQ(NO_ERROR, log.open(path));
+        EXPECT_EQ(NO_ERROR, log.replay([&records](const uint8_t* data, uint32_t len) {
+            records.push_back(std::string((const char*)data, len));
+        }));
+        EXPECT_EQ(3, records.size());
+        EXPECT_EQ("three", records[2]);
+        // buffered records are superseded by the snapshot but still acked
+        log.append("four", [&acked]{acked++;});
+        EXPECT_EQ(NO_ERROR, log.rewrite(std::vector<std::string>(1, "snapshot")));
+        EXPECT_EQ(3, acked);
+    }
+    records.clear();
+    LogFile log(0);
+    EXPECT_EQ(NO_ERROR, log.open(path));
+    EXPECT_EQ(NO_ERROR, log.replay([&records](const uint8_t* data, uint32_t len) {
+        records.push_back(std::string((const char*)data, len));
+    }));
+    EXPECT_EQ(1, records.size());
+    EXPECT_EQ("snapshot", records[0]);
+    log.close();
+    unlink(path.c_str());
+
+    // every write fails with ENOSPC, the record must not be reported durable
+    LogFile full(0);
+    ASSERT_EQ(NO_ERROR, full.open("/dev/full"));
+    full.append("lost", [&acked]{acked++;});
+    usleep(50000);
+    full.close();
+    EXPECT_EQ(3, acked);
+}
+
+TEST(SessionStoreTest, NormalTest) {
+    std::string path = "/tmp/mqttcc_session_test.log";
+    unlink(path.c_str());
+    {
+        SessionStore store(100);
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        store.putSession("c1");
+        store.subscribe("c1", "a/+", 1);
+        store.subscribe("c1", "b", 2);
+        store.unsubscribe("c1", "b");
+        PublishMessage m1(false, 1, false, 1, "a/1", "one");
+        PublishMessage m2(false, 2, false, 2, "a/2", "two");
+        store.storeInflight("c1", 1, &m1);
+        store.storeInflight("c1", 2, &m2);
+        store.removeInflight("c1", 1);
+        // a reused id goes after the ones still inflight
+        store.storeInflight("c1", 1, &m1);
+        PublishMessage p(false, 1, false, 0, "a/3", "three");
+        store.pushPending("c1", &p);
+        store.markReceived("c1", 7);
+        store.markReceived("c1", 9);
+        store.releaseReceived("c1", 7);
+        store.putSession("c2");
+        store.dropSession("c2");
+    }
+    std::unordered_map<std::string, StoredSession> sessions;
+    {
+        SessionStore store(100);
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.load(&sessions));
+        EXPECT_EQ(1, sessions.size());
+        StoredSession& s = sessions["c1"];
+        EXPECT_EQ(1, s.subscriptions.size());
+        EXPECT_EQ(1, s.subscriptions["a/+"]);
+        EXPECT_EQ(2, s.inflight.size());
+        EXPECT_EQ(2, s.inflight[0].id);
+        EXPECT_EQ(1, s.inflight[1].id);
+        MQTT_ERROR err = NO_ERROR;
+        PublishMessage* m = (PublishMessage*)parseStoredMessage(s.inflight[0].wire, err);
+        EXPECT_EQ(NO_ERROR, err);
+        EXPECT_EQ("a/2", m->topicName);
+        EXPECT_EQ("two", m->payload);
+        delete m;
+        EXPECT_EQ(1, s.pending.size());
+        EXPECT_EQ(1, s.received.size());
+        EXPECT_EQ(9, s.received[0]);
+        std::vector<StoredSession> snapshot(1, s);
+        EXPECT_EQ(NO_ERROR, store.compact(snapshot));
+    }
+    {
+        SessionStore store(100);
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        std::unordered_map<std::string, StoredSession> compacted;
+        EXPECT_EQ(NO_ERROR, store.load(&compacted));
+        EXPECT_EQ(1, compacted.size());
+        EXPECT_EQ(2, compacted["c1"].inflight.size());
+        EXPECT_EQ(1, compacted["c1"].pending.size());
+        EXPECT_EQ(1, compacted["c1"].received.size());
+    }
+    unlink(path.c_str());
+}
+
+TEST(OfflineQueueTest, SpillTest) {
+    OfflineQueue q;
+    q.memoryLimit = 30;
+    q.diskLimit = 50;
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(NO_ERROR, q.push(std::string(10, '0' + i)));
+    }
+    EXPECT_EQ(OFFLINE_QUEUE_FULL, q.push(std::string(10, 'x')));
+    EXPECT_EQ(8, q.size());
+    EXPECT_EQ(80, q.bytes());
+
+    std::vector<std::string> all;
+    EXPECT_EQ(NO_ERROR, q.peekAll(&all));
+    EXPECT_EQ(8, all.size());
+    EXPECT_EQ(std::string(10, '7'), all[7]);
+
+    std::vector<std::string> got;
+    EXPECT_EQ(NO_ERROR, q.pop(4, &got));
+    EXPECT_EQ(NO_ERROR, q.push(std::string(10, 'a')));
+    EXPECT_EQ(NO_ERROR, q.pop(100, &got));
+    EXPECT_EQ(9, got.size());
+    for (int i = 0; i < 8; i++) {
+        EXPECT_EQ(std::string(10, '0' + i), got[i]);
+    }
+    EXPECT_EQ(std::string(10, 'a'), got[8]);
+    EXPECT_EQ(0, q.size());
+    EXPECT_EQ(0, q.bytes());
+}
+
+TEST(OfflineQueueTest, CheckpointTest) {
+    std::string path = "/tmp/mqttcc_offline_checkpoint_test.log";
+    unlink(path.c_str());
+    OfflineQueue q;
+    q.memoryLimit = 3000;
+    q.durable = true;
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(NO_ERROR, q.push(std::string(1000, '0' + i % 10)));
+    }
+    std::vector<std::string> got;
+    EXPECT_EQ(NO_ERROR, q.pop(4, &got));
+
+    // the spilled messages are referred to, not copied into the session log
+    StoredSession s;
+    s.clientID = "c1";
+    EXPECT_EQ(NO_ERROR, q.checkpoint(&s.offline));
+    ASSERT_EQ(1, s.offline.size());
+    std::string segment = s.offline.front().segment;
+    EXPECT_EQ(96, s.offline.front().count);
+    {
+        SessionStore store(100);
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.compact(std::vector<StoredSession>(1, s)));
+        store.popOffline("c1", 2);
+        store.pushOffline("c1", "tail");
+    }
+    struct stat st;
+    ASSERT_EQ(0, stat(path.c_str(), &st));
+    EXPECT_LT(st.st_size, 1000);
+
+    std::unordered_map<std::string, StoredSession> sessions;
+    {
+        SessionStore store(100);
+        EXPECT_EQ(NO_ERROR, store.open(path));
+        EXPECT_EQ(NO_ERROR, store.load(&sessions));
+    }
+    ASSERT_EQ(2, sessions["c1"].offline.size());
+    EXPECT_EQ(2, sessions["c1"].offline.front().skip);
+    OfflineQueue restored;
+    restored.memoryLimit = 3000;
+    restored.durable = true;
+    for (std::list<OfflineRef>::iterator it = sessions["c1"].offline.begin(); it != sessions["c1"].offline.end(); it++) {
+        EXPECT_EQ(NO_ERROR, restored.restore(*it));
+    }
+    EXPECT_EQ(95, restored.size());
+    got.clear();
+    EXPECT_EQ(NO_ERROR, restored.pop(1000, &got));
+    ASSERT_EQ(95, got.size());
+    EXPECT_EQ(std::string(1000, '6'), got[0]);
+    EXPECT_EQ("tail", got[94]);
+
+    // a drained segment stays until the next checkpoint no longer needs it
+    EXPECT_EQ(0, access(segment.c_str(), F_OK));
+    restored.releaseRetired();
+    EXPECT_NE(0, access(segment.c_str(), F_OK));
+    unlink(path.c_str());
+}
+
+TEST(SessionRegistryTest, NormalTest) {
+    SessionRegistry registry(3);
+    BrokerSideClient* a = (BrokerSideClient*)0x10;
+    BrokerSideClient* b = (BrokerSideClient*)0x20;
+    EXPECT_TRUE(registry.find("c1") == NULL);
+    EXPECT_TRUE(registry.exchange("c1", a) == NULL);
+    EXPECT_TRUE(registry.exchange("c2", b) == NULL);
+    EXPECT_EQ(2, registry.size());
+    EXPECT_TRUE(registry.find("c1") == a);
+
+    // takeover hands back the previous connection
+    EXPECT_TRUE(registry.exchange("c1", b) == a);
+    EXPECT_EQ(2, registry.size());
+    EXPECT_FALSE(registry.remove("c1", a));
+    EXPECT_TRUE(registry.find("c1") == b);
+    // the replaced one is held until the newer CONNECT has taken it over
+    EXPECT_TRUE(registry.holds("c1", a));
+    registry.release("c1", a);
+    EXPECT_FALSE(registry.holds("c1", a));
+    EXPECT_TRUE(registry.remove("c1", b));
+    EXPECT_TRUE(registry.find("c1") == NULL);
+
+    std::vector<std::pair<std::string, BrokerSideClient*> > entries;
+    registry.entries(&entries);
+    EXPECT_EQ(1, entries.size());
+    EXPECT_EQ("c2", entries[0].first);
+}
+
+TEST(BrokerTest, TakeoverTest) {
+    Broker* broker = new Broker();
+    std::vector<BrokerSideClient*> clients;
+    std::vector<ConnectMessage*> connects;
+    for (int i = 0; i < 3; i++) {
+        // CONNACKs go nowhere
+        clients.push_back(new BrokerSideClient(new Transport(open("/dev/null", O_WRONLY), NULL), broker));
+        connects.push_back(new ConnectMessage(60, "dup", false, NULL, NULL));
+    }
+    clients[0]->messageDecoded(connects[0]);
+    {
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        ASSERT_EQ(NO_ERROR, clients[0]->recvConnectMessage(connects[0]));
+    }
+    uint32_t slot = clients[0]->sessionIndex;
+
+    // both take the id over in the registry, the later one is dispatched first
+    clients[1]->messageDecoded(connects[1]);
+    clients[2]->messageDecoded(connects[2]);
+    EXPECT_TRUE(broker->clients.find("dup") == clients[2]);
+    {
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        EXPECT_EQ(NO_ERROR, clients[2]->recvConnectMessage(connects[2]));
+        EXPECT_EQ(CLIENT_ID_IS_USED_ALREADY, clients[1]->recvConnectMessage(connects[1]));
+    }
+    EXPECT_FALSE(clients[0]->isConnecting);
+    EXPECT_FALSE(clients[1]->isConnecting);
+    EXPECT_TRUE(clients[2]->isConnecting);
+    // resumed in the slot its subscriptions point at
+    EXPECT_EQ(slot, clients[2]->sessionIndex);
+    EXPECT_TRUE(broker->sessions[slot] == clients[2]);
+    EXPECT_EQ(1, broker->clients.size());
+    EXPECT_FALSE(broker->clients.holds("dup", clients[0]));
+    EXPECT_FALSE(broker->clients.holds("dup", clients[1]));
+    broker->connectionClosed(clients[0]);
+    broker->connectionClosed(clients[1]);
+}
+
+TEST(OutboxTest, BackpressureTest) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    uint8_t frame[16 * 1024];
+    memset(frame, 0, sizeof(frame));
+    {
+        // the peer never reads, so the queue only grows once the socket buffer is full
+        Outbox out(fds[0], 64 * 1024, 16 * 1024, 256 * 1024, DROP_NEWEST);
+        for (int i = 0; i < 200; i++) {
+            EXPECT_EQ(NO_ERROR, out.push(frame, sizeof(frame), true));
+        }
+        EXPECT_LT(0, out.dropped());
+        EXPECT_GE(64 * 1024 + sizeof(frame), out.bytes());
+        EXPECT_FALSE(out.overflow());
+        MQTT_ERROR err = NO_ERROR;
+        uint64_t slowest = 0;
+        for (int i = 0; i < 200 && err == NO_ERROR; i++) {
+            uint64_t start = monotonicMicros();
+            err = out.push(frame, sizeof(frame), false);
+            slowest = std::max(slowest, monotonicMicros() - start);
+        }
+        EXPECT_EQ(OUTBOUND_QUEUE_FULL, err);
+        EXPECT_TRUE(out.overflow());
+        EXPECT_EQ(0, out.bytes());
+        // the writer is stuck on control frames the peer never takes, the overflow does not wait for them
+        EXPECT_GT(50000, slowest);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(OutboxTest, PriorityTest) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    uint8_t frame[16 * 1024];
+    memset(frame, 0, sizeof(frame));
+    frame[0] = 0x32; // PUBLISH, QoS1
+    uint8_t pingresp[2] = {0xd0, 0x00};
+    uint64_t total = 0;
+    {
+        Outbox out(fds[0], 1024 * 1024, 1024 * 1024, 16 * 1024 * 1024, DROP_NEWEST);
+        for (int i = 0; i < 40; i++) {
+            out.push(frame, sizeof(frame), false);
+        }
+        usleep(10000);
+        out.push(pingresp, sizeof(pingresp), false);
+
+        // the PINGRESP overtakes everything that has not reached the socket yet
+        uint64_t at = 0;
+        bool found = false;
+        uint8_t buf[65536];
+        while (total < 40 * sizeof(frame) + sizeof(pingresp)) {
+            ssize_t n = recv(fds[1], buf, sizeof(buf), 0);
+            ASSERT_LT(0, n);
+            for (ssize_t i = 0; i < n && !found; i++) {
+                if (buf[i] == 0xd0) {
+                    found = true;
+                    at = total + i;
+                }
+            }
+            total += n;
+        }
+        EXPECT_TRUE(found);
+        EXPECT_GT(40 * sizeof(frame), at + 16 * 1024);
+        for (int i = 0; i < 100 && out.controlLatency().count == 0; i++) {
+            usleep(1000);
+        }
+        EXPECT_EQ(1, out.controlLatency().count);
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(BrokerTest, SlowConsumerTest) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    Broker broker;
+    broker.outboundHighWater = 64 * 1024;
+    broker.outboundLowWater = 16 * 1024;
+    broker.slowConsumerThreshold = 1000;
+    Transport* ct = new Transport(fds[0], NULL);
+    ct->outbox = new Outbox(fds[0], broker.outboundHighWater, broker.outboundLowWater, broker.outboundLimit, DROP_NEWEST);
+    BrokerSideClient* bc = new BrokerSideClient(ct, &broker);
+    bc->ID = "reader";
+    bc->cleanSession = true;
+    bc->isConnecting = true;
+    broker.registerSession(bc);
+    bool shared;
+    EXPECT_EQ(NO_ERROR, broker.subscribe(bc->sessionIndex, "t", 1, &shared));
+
+    // the peer does not read, so the outbox stays above the low water mark
+    std::string payload(8 * 1024, 'x');
+    for (int i = 0; i < 100; i++) {
+        broker.publish("t", 1, false, payload);
+    }
+    broker.checkSlowConsumers(10);
+    EXPECT_FALSE(bc->slow);
+    broker.checkSlowConsumers(1010);
+    EXPECT_TRUE(bc->slow);
+    EXPECT_EQ(0, broker.slowConsumerReport.find("reader "));
+    uint32_t inflight = bc->inflight.size();
+    broker.publish("t", 1, false, payload);
+    EXPECT_EQ(inflight, bc->inflight.size());
+
+    // once it catches up the deferred message is sent and the flag cleared
+    char buf[65536];
+    for (int i = 0; i < 200 && ct->outbox->bytes() > 0; i++) {
+        while (recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT) > 0) {}
+        usleep(1000);
+    }
+    broker.checkSlowConsumers(2010);
+    EXPECT_FALSE(bc->slow);
+    EXPECT_EQ("", broker.slowConsumerReport);
+    EXPECT_EQ(inflight + 1, bc->inflight.size());
+    delete bc;
+    delete ct;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+TEST(StatsTest, NormalTest) {
+    uint64_t before[STAT_COUNT];
+    statTotals(before);
+    statAdd(STAT_MESSAGES_RECEIVED, 3);
+    // a thread that has exited still counts
+    std::thread t([]{ statAdd(STAT_MESSAGES_RECEIVED, 4); });
+    t.join();
+    uint64_t after[STAT_COUNT];
+    statTotals(after);
+    EXPECT_EQ(before[STAT_MESSAGES_RECEIVED] + 7, after[STAT_MESSAGES_RECEIVED]);
+
+    Broker broker;
+    broker.publishStats(1000);
+    const RetainedMessage* m = broker.retains->find("$SYS/broker/clients/total");
+    ASSERT_TRUE(m != NULL);
+    EXPECT_EQ("0", m->payload);
+    EXPECT_TRUE(broker.retains->find("$SYS/broker/load/messages/received") != NULL);
+}
+
+TEST(LatencyHistogramTest, NormalTest) {
+    for (uint64_t v = 1; v < (1ULL << 36); v = v * 3 + 1) {
+        uint64_t top = LatencyHistogram::bucketValue(LatencyHistogram::bucketOf(v));
+        EXPECT_LE(v, top);
+        EXPECT_GE(v + v / 16, top);
+    }
+    EXPECT_EQ(LATENCY_BUCKETS - 1, LatencyHistogram::bucketOf(1ULL << 40));
+
+    LatencyHistogram h;
+    for (uint64_t v = 1; v <= 1000; v++) {
+        h.record(v * 1000);
+    }
+    EXPECT_EQ(1000, h.count());
+    EXPECT_NEAR(500000, h.percentile(50), 500000 / 16);
+    EXPECT_NEAR(990000, h.percentile(99), 990000 / 16);
+    EXPECT_NEAR(1000000, h.max(), 1000000 / 16);
+
+    // merged across threads, including one that has exited
+    LatencyHistogram before;
+    latencySnapshot(STAGE_WRITE, &before);
+    latencyRecord(STAGE_WRITE, 100);
+    std::thread t([]{ latencyRecord(STAGE_WRITE, 200); });
+    t.join();
+    LatencyHistogram after;
+    latencySnapshot(STAGE_WRITE, &after);
+    EXPECT_EQ(before.count() + 2, after.count());
+
+    // a wait for the dispatch lock is its own stage, not part of matching
+    std::thread routed([]{
+        latencySampleEvery = 1;
+        latencyRead(true);
+        latencyDecoded();
+        usleep(20000);
+        latencyDispatched();
+        latencyMatched();
+        latencySampleEvery = 16;
+    });
+    routed.join();
+    LatencyHistogram lock;
+    latencySnapshot(STAGE_LOCK, &lock);
+    EXPECT_LE(20000000, lock.max());
+    LatencyHistogram match;
+    latencySnapshot(STAGE_MATCH, &match);
+    EXPECT_GT(20000000, match.max());
+}
+
+static std::string httpGet(uint16_t port, const std::string path) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    std::string resp;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        std::string req = "GET " + path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        send(sock, req.data(), req.size(), 0);
+        char buf[4096];
+        ssize_t n;
+        while ((n = recv(sock, buf, sizeof(buf), 0)) > 0) {
+            resp.append(buf, n);
+        }
+    }
+    close(sock);
+    return resp;
+}
+
+TEST(MetricsTest, NormalTest) {
+    Broker broker;
+    broker.sampleGauges(5);
+    MetricsServer server(&broker);
+    ASSERT_EQ(NO_ERROR, server.start("127.0.0.1", 0));
+    ASSERT_NE(0, server.port());
+
+    std::string resp = httpGet(server.port(), "/metrics");
+    EXPECT_EQ(0, resp.find("HTTP/1.1 200 OK"));
+    EXPECT_NE(std::string::npos, resp.find("# TYPE mqtt_publishes_routed_total counter\n"));
+    EXPECT_NE(std::string::npos, resp.find("\nmqtt_clients_connected 0\n"));
+    EXPECT_NE(std::string::npos, resp.find("\nmqtt_gauges_timestamp_ms 5\n"));
+    EXPECT_EQ(0, httpGet(server.port(), "/").find("HTTP/1.1 404"));
+}
+
+TEST(TraceTest, NormalTest) {
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    Broker broker;
+    Transport* ct = new Transport(fds[0], NULL);
+    ct->outbox = new Outbox(fds[0], broker.outboundHighWater, broker.outboundLowWater, broker.outboundLimit, DROP_NEWEST);
+    BrokerSideClient* bc = new BrokerSideClient(ct, &broker);
+    bc->ID = "reader";
+    bc->cleanSession = true;
+    bc->isConnecting = true;
+    broker.registerSession(bc);
+    bool shared;
+    EXPECT_EQ(NO_ERROR, broker.subscribe(bc->sessionIndex, "traced/t", 1, &shared));
+
+    traceSampleEvery = 2;
+    traceRead(true);
+    EXPECT_EQ(0, traceCurrent().trace);
+    traceRead(true);
+    TraceTag tag = traceCurrent();
+    EXPECT_NE(0, tag.trace);
+    tracePoint(TRACE_RECEIVED, tag, "traced/t", 1);
+    EXPECT_EQ(NO_ERROR, broker.publish("traced/t", 1, false, "payload"));
+    traceRead(false);
+    EXPECT_EQ(0, traceCurrent().trace);
+    traceSampleEvery = 0;
+
+    ASSERT_EQ(1, bc->tracedIDs.size());
+    uint16_t id = bc->tracedIDs.begin()->first;
+    char buf[256];
+    EXPECT_LT(0, recv(fds[1], buf, sizeof(buf), 0));
+    EXPECT_EQ(NO_ERROR, bc->ackMessage(id));
+    EXPECT_EQ(0, bc->tracedIDs.size());
+
+    // the writer records the write once send has returned
+    std::string dump = traceDump();
+    std::stringstream ids;
+    ids << "\"id\":\"0x" << std::hex << tag.trace << "\"";
+    std::string written = "{\"name\":\"written\",\"cat\":\"mqtt\",\"ph\":\"n\"," + ids.str();
+    for (int i = 0; i < 100 && dump.find(written) == std::string::npos; i++) {
+        usleep(1000);
+        dump = traceDump();
+    }
+    EXPECT_EQ(0, dump.find("{\"traceEvents\":["));
+    EXPECT_NE(std::string::npos, dump.find("{\"name\":\"publish traced/t\",\"cat\":\"mqtt\",\"ph\":\"b\"," + ids.str()));
+    EXPECT_NE(std::string::npos, dump.find("{\"name\":\"deliver reader\",\"cat\":\"mqtt\",\"ph\":\"b\"," + ids.str()));
+    const char* points[] = {"read", "matched", "enqueued", "written", "acked"};
+    for (int i = 0; i < 5; i++) {
+        EXPECT_NE(std::string::npos, dump.find(std::string("{\"name\":\"") + points[i] + "\",\"cat\":\"mqtt\",\"ph\":\"n\"," + ids.str())) << points[i];
+    }
+
+    // a long detail is cut on a character boundary
+    std::string prefix(41, 'a');
+    tracePoint(TRACE_RECEIVED, TraceTag(tag.trace + 1, 0), prefix + "\xc3\xa9", 0);
+    EXPECT_NE(std::string::npos, traceDump().find("{\"name\":\"publish " + prefix + "\","));
+    delete bc;
+    delete ct;
+    close(fds[0]);
+    close(fds[1]);
+}
+
+class RecordingClient : public Client {
+public:
+    std::mutex mtx;
+    std::vector<std::string> payloads;
+    RecordingClient(const std::string id, const User* user = NULL) : Client(id, user, 0, NULL) {};
+    MQTT_ERROR recvPublishMessage(PublishMessage* m) {
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            this->payloads.push_back(m->payload);
+        }
+        return Client::recvPublishMessage(m);
+    };
+    size_t received() {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        return this->payloads.size();
+    };
+};
+
+TEST(LoopbackTest, NormalTest) {
+    PublishMessage m(false, 1, true, 7, "a/b", "payload");
+    Message* copy = copyMessage(&m);
+    ASSERT_TRUE(copy != NULL);
+    EXPECT_EQ(PUBLISH_MESSAGE_TYPE, copy->fh->type);
+    EXPECT_EQ(7, copy->fh->packetID);
+    EXPECT_TRUE(copy->fh->retain);
+    EXPECT_EQ("payload", ((PublishMessage*)copy)->payload);
+    delete copy;
+
+    // its sessions end on their own threads, so it outlives the test
+    Broker* broker = new Broker();
+    RecordingClient sub("sub");
+    ASSERT_EQ(NO_ERROR, sub.connect(broker, true));
+    EXPECT_TRUE(sub.isConnecting);
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("loop/t", 1));
+    EXPECT_EQ(NO_ERROR, sub.subscribe(topics));
+    for (int i = 0; i < 1000 && sub.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(0, sub.inflight.size());
+
+    RecordingClient pub("pub");
+    ASSERT_EQ(NO_ERROR, pub.connect(broker, true));
+    for (int i = 0; i < 10; i++) {
+        EXPECT_EQ(NO_ERROR, pub.publish("loop/t", "hello", 1, false));
+    }
+    for (int i = 0; i < 1000 && (sub.received() < 10 || pub.inflight.size() > 0); i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(10, sub.received());
+    EXPECT_EQ("hello", sub.payloads[0]);
+    EXPECT_EQ(0, pub.inflight.size());
+    EXPECT_EQ(2, broker->clients.size());
+
+    pub.disconnect();
+    for (int i = 0; i < 1000 && broker->clients.size() > 1; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(1, broker->clients.size());
+    sub.disconnect();
+}
+
+static Broker* restartedBroker(const std::string& sessions, const std::string& publishes) {
+    Broker* broker = new Broker();
+    broker->sessionStorePath = sessions;
+    broker->publishLogPath = publishes;
+    EXPECT_EQ(NO_ERROR, broker->restoreSessions());
+    EXPECT_EQ(NO_ERROR, broker->replayPublishes());
+    EXPECT_EQ(NO_ERROR, broker->checkpoint());
+    return broker;
+}
+
+TEST(PublishLogTest, RestartTest) {
+    std::string sessions = "/tmp/mqttcc_publish_log_test.sessions";
+    std::string publishes = "/tmp/mqttcc_publish_log_test.publishes";
+    unlink(sessions.c_str());
+    unlink(publishes.c_str());
+    Broker* broker = restartedBroker(sessions, publishes);
+    RecordingClient sub("sub");
+    ASSERT_EQ(NO_ERROR, sub.connect(broker, false));
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("wal/t", 1));
+    EXPECT_EQ(NO_ERROR, sub.subscribe(topics));
+    for (int i = 0; i < 1000 && sub.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    sub.disconnect();
+    bool offline = false;
+    for (int i = 0; i < 1000 && !offline; i++) {
+        usleep(1000);
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        offline = !broker->clients.find("sub")->isConnecting;
+    }
+    ASSERT_TRUE(offline);
+    RecordingClient pub("pub");
+    ASSERT_EQ(NO_ERROR, pub.connect(broker, true));
+    EXPECT_EQ(NO_ERROR, pub.publish("wal/t", "once", 1, false));
+    for (int i = 0; i < 1000 && pub.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(0, pub.inflight.size());
+    pub.disconnect();
+
+    // the queued publish is in both logs, each restart must route it at most once
+    restartedBroker(sessions, publishes);
+    broker = restartedBroker(sessions, publishes);
+    RecordingClient back("sub");
+    ASSERT_EQ(NO_ERROR, back.connect(broker, false));
+    for (int i = 0; i < 1000 && back.received() < 1; i++) {
+        usleep(1000);
+    }
+    usleep(50000);
+    ASSERT_EQ(1, back.received());
+    EXPECT_EQ("once", back.payloads[0]);
+    back.disconnect();
+    unlink(sessions.c_str());
+    unlink(publishes.c_str());
+}
+
+class PubrecCountingClient : public Client {
+public:
+    std::atomic<int> pubrecs;
+    PubrecCountingClient(const std::string id) : Client(id, NULL, 0, NULL), pubrecs(0) {};
+    MQTT_ERROR recvPubrecMessage(PubrecMessage* m) {
+        this->pubrecs++;
+        return NO_ERROR;
+    };
+};
+
+TEST(BrokerTest, DuplicateQoS2Test) {
+    std::string publishes = "/tmp/mqttcc_duplicate_qos2_test.publishes";
+    unlink(publishes.c_str());
+    Broker* broker = new Broker();
+    broker->publishLogPath = publishes;
+    ASSERT_EQ(NO_ERROR, broker->replayPublishes());
+    RecordingClient sub("sub");
+    ASSERT_EQ(NO_ERROR, sub.connect(broker, true));
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("dup/t", 2));
+    EXPECT_EQ(NO_ERROR, sub.subscribe(topics));
+    for (int i = 0; i < 1000 && sub.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+
+    // sent past the client's own window so the broker sees the id twice before any PUBREL
+    PubrecCountingClient pub("pub");
+    ASSERT_EQ(NO_ERROR, pub.connect(broker, true));
+    PublishMessage first(false, 2, false, 42, "dup/t", "once");
+    PublishMessage again(true, 2, false, 42, "dup/t", "once");
+    EXPECT_EQ(NO_ERROR, pub.ct->sendMessage(&first));
+    EXPECT_EQ(NO_ERROR, pub.ct->sendMessage(&again));
+    for (int i = 0; i < 1000 && (pub.pubrecs < 2 || sub.received() < 1); i++) {
+        usleep(1000);
+    }
+    usleep(50000);
+    EXPECT_EQ(2, pub.pubrecs);
+    EXPECT_EQ(1, sub.received());
+    pub.disconnect();
+    sub.disconnect();
+    unlink(publishes.c_str());
+}
+
+class CountingAuthenticator : public Authenticator {
+public:
+    int calls;
+    CountingAuthenticator() : calls(0) {};
+    bool verify(const std::string& name, const std::string& password) {
+        this->calls++;
+        return password == name + "-secret";
+    };
+};
+
+TEST(AuthTest, NormalTest) {
+    std::string path = "/tmp/mqttcc_auth_test.passwd";
+    {
+        std::ofstream f(path.c_str(), std::ios::out | std::ios::trunc);
+        f << "# devices" << std::endl;
+        f << PasswordFile::entry("alice", "wonderland", 100) << std::endl;
+        f << std::endl;
+        f << PasswordFile::entry("bob", "builder", 1) << std::endl;
+    }
+    PasswordFile* passwords = new PasswordFile();
+    ASSERT_EQ(NO_ERROR, passwords->load(path));
+    EXPECT_EQ(2, passwords->size());
+    EXPECT_TRUE(passwords->verify("alice", "wonderland"));
+    EXPECT_FALSE(passwords->verify("alice", "builder"));
+    EXPECT_TRUE(passwords->verify("bob", "builder"));
+    EXPECT_FALSE(passwords->verify("carol", ""));
+    // salts are random, the same password hashes differently
+    EXPECT_NE(PasswordFile::entry("a", "p", 1), PasswordFile::entry("a", "p", 1));
+    {
+        std::ofstream f(path.c_str(), std::ios::out | std::ios::trunc);
+        f << "alice:100:zz:00" << std::endl;
+    }
+    PasswordFile broken;
+    EXPECT_EQ(STORE_CORRUPTED, broken.load(path));
+
+    CountingAuthenticator* counting = new CountingAuthenticator();
+    AuthCache cache(counting, 2);
+    EXPECT_TRUE(cache.verify("a", "a-secret"));
+    EXPECT_TRUE(cache.verify("a", "a-secret"));
+    EXPECT_FALSE(cache.verify("a", "wrong"));
+    EXPECT_FALSE(cache.verify("a", "wrong"));
+    EXPECT_EQ(2, counting->calls);
+    EXPECT_EQ(2, cache.hits());
+    // "a" was used last, the refusal is evicted
+    EXPECT_TRUE(cache.verify("a", "a-secret"));
+    EXPECT_TRUE(cache.verify("b", "b-secret"));
+    EXPECT_EQ(2, cache.size());
+    EXPECT_TRUE(cache.verify("a", "a-secret"));
+    EXPECT_FALSE(cache.verify("a", "wrong"));
+    EXPECT_EQ(4, counting->calls);
+    // name and password do not run into each other
+    EXPECT_FALSE(cache.verify("a-", "secret"));
+
+    Broker* broker = new Broker();
+    broker->authenticator = new AuthCache(passwords, 16);
+    RecordingClient anonymous("anonymous");
+    EXPECT_EQ(CONNECTION_REFUSED, anonymous.connect(broker, true));
+    EXPECT_FALSE(anonymous.isConnecting);
+    Client wrong("wrong", new User("alice", "builder"), 0, NULL);
+    EXPECT_EQ(CONNECTION_REFUSED, wrong.connect(broker, true));
+    Client right("right", new User("alice", "wonderland"), 0, NULL);
+    EXPECT_EQ(NO_ERROR, right.connect(broker, true));
+    EXPECT_TRUE(right.isConnecting);
+    EXPECT_EQ(1, broker->clients.size());
+    right.disconnect();
+
+    // over TCP the refusal waits on the outbox, closing the connection must not drop it
+    int fds[2];
+    ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+    Transport* ct = new Transport(fds[0], NULL);
+    ct->outbox = new Outbox(fds[0], broker->outboundHighWater, broker->outboundLowWater, broker->outboundLimit, DROP_NEWEST);
+    BrokerSideClient* bc = new BrokerSideClient(ct, broker);
+    uint8_t wire[256];
+    ConnectMessage connect(0, "tcp", true, NULL, new User("alice", "builder"));
+    int64_t len = connect.getWire(wire);
+    ASSERT_EQ(len, send(fds[1], wire, len, 0));
+    std::thread reader([broker, bc]{
+        readLoop(bc);
+        broker->connectionClosed(bc);
+    });
+    struct timeval timeout = {2, 0};
+    setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    std::string got;
+    char buf[256];
+    for (ssize_t n; (n = recv(fds[1], buf, sizeof(buf), 0)) > 0; ) {
+        got.append(buf, n);
+    }
+    reader.join();
+    ConnackMessage refusal(false, CONNECT_BAD_USERNAME_OR_PASSWORD);
+    len = refusal.getWire(wire);
+    EXPECT_EQ(std::string((const char*)wire, len), got);
+    close(fds[1]);
+    unlink(path.c_str());
+}
+
+TEST(AclTest, NormalTest) {
+    AclMatcher m;
+    m.add(ACL_READWRITE, "devices/alice/#");
+    m.add(ACL_READ, "broadcast/+/news");
+    EXPECT_EQ(ACL_READWRITE, m.access("devices/alice"));
+    EXPECT_EQ(ACL_READWRITE, m.access("devices/alice/engine/temp"));
+    EXPECT_EQ(ACL_NONE, m.access("devices/bob/engine"));
+    EXPECT_EQ(ACL_READ, m.access("broadcast/eu/news"));
+    EXPECT_EQ(ACL_NONE, m.access("broadcast/eu/news/extra"));
+    // a filter is granted only if every topic it can match is
+    EXPECT_EQ(ACL_READWRITE, m.filterAccess("devices/alice/+/temp"));
+    EXPECT_EQ(ACL_READ, m.filterAccess("broadcast/+/news"));
+    EXPECT_EQ(ACL_NONE, m.filterAccess("broadcast/#"));
+    EXPECT_EQ(ACL_NONE, m.filterAccess("devices/+/engine"));
+    EXPECT_TRUE(m.canSubscribe("$share/g/devices/alice/#"));
+    EXPECT_FALSE(m.canSubscribe("$share/g/devices/#"));
+    m.add(ACL_READ, "#");
+    EXPECT_EQ(ACL_READ, m.access("anything"));
+    EXPECT_EQ(ACL_NONE, m.access("$SYS/broker/clients"));
+
+    EXPECT_TRUE(m.canPublish("devices/alice/cmd"));
+    EXPECT_TRUE(m.canPublish("devices/alice/cmd"));
+    EXPECT_FALSE(m.canPublish("devices/bob/cmd"));
+
+    std::string path = "/tmp/mqttcc_acl_test.acl";
+    {
+        std::ofstream f(path.c_str(), std::ios::out | std::ios::trunc);
+        f << "# clients without a username" << std::endl;
+        f << "topic read public/#" << std::endl;
+        f << "user alice" << std::endl;
+        f << "topic write alerts" << std::endl;
+        f << "pattern devices/%u/#" << std::endl;
+        f << "pattern read clients/%c" << std::endl;
+    }
+    AclFile* acls = new AclFile();
+    ASSERT_EQ(NO_ERROR, acls->load(path));
+    AclMatcher* anonymous = acls->compile(NULL, "c1");
+    EXPECT_EQ(ACL_READ, anonymous->access("public/x"));
+    EXPECT_EQ(ACL_READ, anonymous->access("clients/c1"));
+    EXPECT_EQ(ACL_NONE, anonymous->access("devices/c1/x"));
+    delete anonymous;
+    User alice("alice", "");
+    AclMatcher* compiled = acls->compile(&alice, "car");
+    EXPECT_EQ(ACL_WRITE, compiled->access("alerts"));
+    EXPECT_EQ(ACL_READWRITE, compiled->access("devices/alice/x"));
+    EXPECT_EQ(ACL_READ, compiled->access("clients/car"));
+    EXPECT_EQ(ACL_NONE, compiled->access("public/x"));
+    delete compiled;
+    // a wildcard in the username does not widen the pattern
+    User wild("+", "");
+    compiled = acls->compile(&wild, "x");
+    EXPECT_EQ(ACL_NONE, compiled->access("devices/bob/x"));
+    delete compiled;
+    unlink(path.c_str());
+
+    uint64_t before[STAT_COUNT];
+    statTotals(before);
+    Broker* broker = new Broker();
+    broker->acls = acls;
+    RecordingClient owner("owner", new User("alice", ""));
+    ASSERT_EQ(NO_ERROR, owner.connect(broker, true));
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("devices/alice/status", 1));
+    EXPECT_EQ(NO_ERROR, owner.subscribe(topics));
+    RecordingClient other("other", new User("bob", ""));
+    ASSERT_EQ(NO_ERROR, other.connect(broker, true));
+    std::vector<SubscribeTopic*> otherTopics;
+    otherTopics.push_back(new SubscribeTopic("devices/alice/status", 1));
+    EXPECT_EQ(NO_ERROR, other.subscribe(otherTopics));
+    for (int i = 0; i < 1000 && (owner.inflight.size() > 0 || other.inflight.size() > 0); i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(NO_ERROR, other.publish("devices/alice/cmd", "denied", 1, false));
+    EXPECT_EQ(NO_ERROR, owner.publish("devices/alice/status", "allowed", 1, false));
+    for (int i = 0; i < 1000 && (owner.received() < 1 || other.inflight.size() > 0); i++) {
+        usleep(1000);
+    }
+    // the denied publish is still acknowledged
+    EXPECT_EQ(0, other.inflight.size());
+    usleep(10000);
+    ASSERT_EQ(1, owner.received());
+    EXPECT_EQ("allowed", owner.payloads[0]);
+    EXPECT_EQ(0, other.received());
+    uint64_t after[STAT_COUNT];
+    statTotals(after);
+    EXPECT_EQ(1, after[STAT_PUBLISHES_DENIED] - before[STAT_PUBLISHES_DENIED]);
+    {
+        // nor does it leave a node behind
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        std::vector<std::string> leaves = broker->topicRoot->dumpTree();
+        EXPECT_TRUE(std::find(leaves.begin(), leaves.end(), "devices/alice/cmd") == leaves.end());
+        EXPECT_TRUE(std::find(leaves.begin(), leaves.end(), "devices/alice/status") != leaves.end());
+    }
+    other.disconnect();
+    owner.disconnect();
+}
+
+// publishes count messages split over publishers, returns the ms until the subscriber has them all
+static uint64_t limitedPublish(Broker* broker, std::vector<RecordingClient*> publishers, uint32_t count) {
+    RecordingClient sub("limited-sub");
+    EXPECT_EQ(NO_ERROR, sub.connect(broker, true));
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("limited/t", 0));
+    EXPECT_EQ(NO_ERROR, sub.subscribe(topics));
+    for (int i = 0; i < 1000 && sub.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    uint64_t start = monotonicMicros();
+    for (uint32_t i = 0; i < count; i++) {
+        EXPECT_EQ(NO_ERROR, publishers[i % publishers.size()]->publish("limited/t", "x", 0, false));
+    }
+    for (int i = 0; i < 5000 && sub.received() < count; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(count, sub.received());
+    sub.disconnect();
+    return (monotonicMicros() - start) / 1000;
+}
+
+TEST(RateLimitTest, NormalTest) {
+    TokenBucket bucket(10, 10);
+    EXPECT_EQ(0, bucket.take(10, 1000000));
+    EXPECT_EQ(100000, bucket.take(1, 1000000));
+    // a second refills 10, the debt of 1 is paid first
+    EXPECT_EQ(0, bucket.take(1, 2000000));
+    EXPECT_EQ(0, bucket.take(8, 2000000));
+    EXPECT_EQ(100000, bucket.take(1, 2000000));
+
+    RateLimiter limiter(RateLimit(0, 1000));
+    EXPECT_EQ(0, limiter.admit(500, 1000000));
+    EXPECT_EQ(500000, limiter.admit(1000, 1000000));
+
+    uint64_t before[STAT_COUNT];
+    statTotals(before);
+    // nothing is dropped, the first 50 pass and the other 25 take half a second
+    Broker* broker = new Broker();
+    broker->clientRateLimit = RateLimit(50, 0);
+    RecordingClient pub("limited-pub");
+    ASSERT_EQ(NO_ERROR, pub.connect(broker, true));
+    std::vector<RecordingClient*> publishers(1, &pub);
+    EXPECT_GE(limitedPublish(broker, publishers, 75), 400);
+    pub.disconnect();
+    uint64_t after[STAT_COUNT];
+    statTotals(after);
+    EXPECT_LT(0, after[STAT_READ_PAUSES] - before[STAT_READ_PAUSES]);
+
+    // two connections of one user share its bucket
+    Broker* shared = new Broker();
+    shared->userRateLimit = RateLimit(50, 0);
+    RecordingClient first("limited-first", new User("fleet", ""));
+    RecordingClient second("limited-second", new User("fleet", ""));
+    ASSERT_EQ(NO_ERROR, first.connect(shared, true));
+    ASSERT_EQ(NO_ERROR, second.connect(shared, true));
+    publishers.clear();
+    publishers.push_back(&first);
+    publishers.push_back(&second);
+    EXPECT_GE(limitedPublish(shared, publishers, 80), 500);
+    first.disconnect();
+    second.disconnect();
+
+    // limiters of users without connections are swept as others come and go
+    for (int i = 0; i < 100; i++) {
+        std::stringstream name;
+        name << "gone" << i;
+        EXPECT_TRUE(shared->userLimiter(name.str()) != NULL);
+    }
+    std::lock_guard<std::mutex> lock(shared->limitersMtx);
+    EXPECT_GT(50, shared->userLimiters.size());
+}
+
+// never acknowledges, what it is sent stays inflight on the broker
+class SilentClient : public Client {
+public:
+    SilentClient(const std::string id) : Client(id, NULL, 0, NULL) {};
+    MQTT_ERROR recvPublishMessage(PublishMessage* m) {
+        return NO_ERROR;
+    };
+};
+
+TEST(MemoryTest, NormalTest) {
+    uint64_t before[STAT_COUNT];
+    statTotals(before);
+    Broker* broker = new Broker();
+    RecordingClient quiet("quiet");
+    ASSERT_EQ(NO_ERROR, quiet.connect(broker, true));
+    SilentClient hog("hog");
+    ASSERT_EQ(NO_ERROR, hog.connect(broker, true));
+    std::vector<SubscribeTopic*> topics;
+    topics.push_back(new SubscribeTopic("mem/t", 1));
+    EXPECT_EQ(NO_ERROR, hog.subscribe(topics));
+    for (int i = 0; i < 1000 && hog.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(NO_ERROR, quiet.publish("mem/t", std::string(1000, 'x'), 1, false));
+    }
+    for (int i = 0; i < 1000 && quiet.inflight.size() > 0; i++) {
+        usleep(1000);
+    }
+    uint64_t hogHeld, quietHeld;
+    {
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        hogHeld = broker->clients.find("hog")->heldBytes();
+        quietHeld = broker->clients.find("quiet")->heldBytes();
+    }
+    EXPECT_GT(hogHeld, quietHeld + 100 * 1000);
+
+    // over its own limit a connection is closed, the others stay
+    broker->clientMemoryLimit = (hogHeld + quietHeld) / 2;
+    broker->accountMemory();
+    EXPECT_FALSE(broker->shedding);
+    for (int i = 0; i < 1000 && broker->clients.size() > 1; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(1, broker->clients.size());
+    EXPECT_TRUE(broker->clients.find("quiet") != NULL);
+    broker->clientMemoryLimit = 0;
+
+    // over the total, QoS0 deliveries and new connections are refused first
+    broker->memoryLimit = 1;
+    broker->accountMemory();
+    EXPECT_TRUE(broker->shedding);
+    EXPECT_TRUE(broker->clients.find("quiet")->isConnecting);
+    RecordingClient late("late");
+    EXPECT_EQ(CONNECTION_REFUSED, late.connect(broker, true));
+    topics.clear();
+    topics.push_back(new SubscribeTopic("mem/q", 1));
+    EXPECT_EQ(NO_ERROR, quiet.subscribe(topics));
+    EXPECT_EQ(NO_ERROR, quiet.publish("mem/q", "dropped", 0, false));
+    EXPECT_EQ(NO_ERROR, quiet.publish("mem/q", "kept", 1, false));
+    for (int i = 0; i < 1000 && (quiet.received() < 1 || quiet.inflight.size() > 0); i++) {
+        usleep(1000);
+    }
+    ASSERT_EQ(1, quiet.received());
+    EXPECT_EQ("kept", quiet.payloads[0]);
+
+    // and still over at the next accounting, the largest holders go
+    broker->accountMemory();
+    for (int i = 0; i < 1000 && broker->clients.size() > 0; i++) {
+        usleep(1000);
+    }
+    EXPECT_EQ(0, broker->clients.size());
+    broker->memoryLimit = 0;
+    broker->accountMemory();
+    EXPECT_FALSE(broker->shedding);
+    uint64_t after[STAT_COUNT];
+    statTotals(after);
+    EXPECT_EQ(2, after[STAT_MEMORY_DISCONNECTS] - before[STAT_MEMORY_DISCONNECTS]);
+    EXPECT_LE(1, after[STAT_PUBLISHES_DROPPED] - before[STAT_PUBLISHES_DROPPED]);
+}
+
+TEST(PacketIDPoolTest, NormalTest) {
+    PacketIDPool pool;
+    std::vector<bool> seen(65536, false);
+    uint16_t id = 0;
+    for (int i = 0; i < 65535; i++) {
+        EXPECT_TRUE(pool.acquire(&id));
+        EXPECT_NE(0, id);
+        EXPECT_FALSE(seen[id]);
+        seen[id] = true;
+    }
+    EXPECT_EQ(65535, pool.size());
+    EXPECT_FALSE(pool.acquire(&id));
+
+    pool.release(4321);
+    EXPECT_FALSE(pool.isUsed(4321));
+    EXPECT_TRUE(pool.acquire(&id));
+    EXPECT_EQ(4321, id);
+
+    pool.release(10);
+    pool.mark(10);
+    EXPECT_EQ(65535, pool.size());
+    pool.mark(10);
+    EXPECT_EQ(65535, pool.size());
+}
+
+TEST(InflightWindowTest, NormalTest) {
+    InflightWindow w;
+    Message* a = new PubackMessage(300);
+    Message* b = new PubackMessage(7);
+    Message* c = new PubackMessage(65535);
+    EXPECT_TRUE(w.insert(300, a, 0));
+    EXPECT_TRUE(w.insert(7, b, 0));
+    EXPECT_TRUE(w.insert(65535, c, 0));
+    EXPECT_FALSE(w.insert(7, c, 0));
+    EXPECT_FALSE(w.insert(0, c, 0));
+    EXPECT_EQ(3, w.size());
+    EXPECT_EQ(b, w.find(7));
+    EXPECT_TRUE(w.find(8) == NULL);
+
+    // iteration follows insertion order
+    uint16_t order[3] = {300, 7, 65535};
+    int i = 0;
+    for (uint16_t id = w.first(); id != 0; id = w.next(id)) {
+        EXPECT_EQ(order[i++], id);
+    }
+    EXPECT_EQ(3, i);
+
+    InflightWindow copy = w;
+    EXPECT_EQ(b, w.remove(7));
+    EXPECT_TRUE(w.remove(7) == NULL);
+    EXPECT_EQ(2, w.size());
+    EXPECT_EQ(65535, w.next(300));
+    EXPECT_EQ(3, copy.size());
+    EXPECT_EQ(b, copy.find(7));
+
+    delete a;
+    delete b;
+    delete c;
+}
+
+TEST(TimingWheelTest, NormalTest) {
+    TimingWheel wheel(10, NULL);
+    uint64_t ticks = 0;
+    uint64_t firedA = 0, firedB = 0, firedC = 0, firedD = 0;
+    TimerEntry a([&]{firedA = ticks;});
+    TimerEntry b([&]{firedB = ticks;});
+    TimerEntry c([&]{firedC = ticks;});
+    TimerEntry d([&]{firedD = ticks;});
+    wheel.schedule(&a, 50);          // 5 ticks
+    wheel.schedule(&b, 3000);        // 300 ticks, level 1
+    wheel.schedule(&c, 700000);      // 70000 ticks, level 2
+    wheel.schedule(&d, 100);
+    EXPECT_TRUE(d.armed());
+    wheel.cancel(&d);
+    EXPECT_FALSE(d.armed());
+    for (ticks = 1; ticks <= 70000; ticks++) {
+        wheel.advance(1);
+        if (ticks == 100) {
+            // rescheduling an armed entry moves it
+            wheel.schedule(&b, 10);
+        }
+    }
+    EXPECT_EQ(5, firedA);
+    EXPECT_EQ(101, firedB);
+    EXPECT_EQ(70000, firedC);
+    EXPECT_EQ(0, firedD);
+    EXPECT_FALSE(c.armed());
+}
+
 
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
@@ -0,0 +1,202 @@
+#include "acl.h"
+#include "sharedSubscription.h"
+#include "util.h"
+#include <fstream>
+#include <sstream>
+
+AclMatcher::Node::~Node() {
+    for (std::map<std::string, Node*>::iterator it = this->children.begin(); it != this->children.end(); it++) {
+        delete it->second;
+    }
+    delete this->plus;
+}
+
+void AclMatcher::add(uint8_t access, const std::string filter) {
+    this->decisions.clear();
+    std::vector<std::string> levels;
+    split(filter, "/", &levels);
+    Node* node = &this->root;
+    for (size_t i = 0; i < levels.size(); i++) {
+        if (levels[i] == "#") {
+            node->rest |= access;
+            return;
+        }
+        Node** next = &node->plus;
+        if (levels[i] != "+") {
+            next = &node->children[levels[i]];
+        }
+        if (*next == NULL) {
+            *next = new Node();
+        }
+        node = *next;
+    }
+    node->exact |= access;
+}
+
+// in filter mode a level of the subscription can only be covered by the same
+// wildcard or a wider one
+uint8_t AclMatcher::walk(const Node* node, const std::vector<std::string>& levels, size_t i, bool filter) {
+    // wildcards at the root do not reach topics starting with '$'
+    bool system = i == 0 && levels.size() > 0 && levels[0].size() > 0 && levels[0][0] == '$';
+    uint8_t granted = system ? ACL_NONE : node->rest;
+    if (i == levels.size()) {
+        return granted | node->exact;
+    }
+    const std::string& level = levels[i];
+    if (filter && level == "#") {
+        return granted;
+    }
+    if (node->plus != NULL && !system) {
+        granted |= this->walk(node->plus, levels, i + 1, filter);
+    }
+    if (!filter || level != "+") {
+        std::map<std::string, Node*>::const_iterator it = node->children.find(level);
+        if (it != node->children.end()) {
+            granted |= this->walk(it->second, levels, i + 1, filter);
+        }
+    }
+    return granted;
+}
+
+uint8_t AclMatcher::access(const std::string topic) {
+    std::vector<std::string> levels;
+    split(topic, "/", &levels);
+    return this->walk(&this->root, levels, 0, false);
+}
+
+uint8_t AclMatcher::filterAccess(const std::string filter) {
+    std::vector<std::string> levels;
+    split(filter, "/", &levels);
+    return this->walk(&this->root, levels, 0, true);
+}
+
+bool AclMatcher::canPublish(const std::string& topic) {
+    std::unordered_map<std::string, uint8_t>::iterator it = this->decisions.find(topic);
+    if (it != this->decisions.end()) {
+        return (it->second & ACL_WRITE) != 0;
+    }
+    if (this->decisions.size() >= this->cacheLimit) {
+        this->decisions.clear();
+    }
+    uint8_t granted = this->access(topic);
+    this->decisions[topic] = granted;
+    return (granted & ACL_WRITE) != 0;
+}
+
+bool AclMatcher::canSubscribe(const std::string filter) {
+    std::string group, inner;
+    MQTT_ERROR err = NO_ERROR;
+    if (splitSharedTopic(filter, &group, &inner, err)) {
+        return err == NO_ERROR && (this->filterAccess(inner) & ACL_READ) != 0;
+    }
+    return (this->filterAccess(filter) & ACL_READ) != 0;
+}
+
+static bool parseAccess(const std::string word, uint8_t* access) {
+    if (word == "read") {
+        *access = ACL_READ;
+    } else if (word == "write") {
+        *access = ACL_WRITE;
+    } else if (word == "readwrite") {
+        *access = ACL_READWRITE;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+MQTT_ERROR AclFile::load(const std::string path) {
+    std::ifstream f(path.c_str());
+    if (!f) {
+        return STORE_IO_ERROR;
+    }
+    AclFile loaded;
+    std::string user("");
+    std::string line;
+    while (std::getline(f, line)) {
+        std::stringstream ss(line);
+        std::string kind, word, filter;
+        ss >> kind;
+        if (kind.size() == 0 || kind[0] == '#') {
+            continue;
+        }
+        if (kind == "user") {
+            ss >> user;
+            if (user.size() == 0) {
+                return STORE_CORRUPTED;
+            }
+            continue;
+        }
+        if (kind != "topic" && kind != "pattern") {
+            return STORE_CORRUPTED;
+        }
+        uint8_t access = ACL_READWRITE;
+        ss >> word >> filter;
+        if (filter.size() == 0) {
+            filter = word;
+        } else if (!parseAccess(word, &access)) {
+            return STORE_CORRUPTED;
+        }
+        if (filter.size() == 0) {
+            return STORE_CORRUPTED;
+        }
+        if (kind == "topic") {
+            loaded.addTopic(user, access, filter);
+        } else {
+            loaded.addPattern(access, filter);
+        }
+    }
+    this->anonymous.swap(loaded.anonymous);
+    this->users.swap(loaded.users);
+    this->patterns.swap(loaded.patterns);
+    return NO_ERROR;
+}
+
+void AclFile::addTopic(const std::string user, uint8_t access, const std::string filter) {
+    if (user.size() == 0) {
+        this->anonymous.push_back(AclRule(access, filter));
+    } else {
+        this->users[user].push_back(AclRule(access, filter));
+    }
+}
+
+void AclFile::addPattern(uint8_t access, const std::string filter) {
+    this->patterns.push_back(AclRule(access, filter));
+}
+
+// a name that is not a single plain level would widen the pattern
+static bool substitute(std::string* filter, const std::string& placeholder, const std::string& value) {
+    size_t at = filter->find(placeholder);
+    if (at == std::string::npos) {
+        return true;
+    }
+    if (value.size() == 0 || value.find_first_of("/+#") != std::string::npos) {
+        return false;
+    }
+    for (; at != std::string::npos; at = filter->find(placeholder, at + value.size())) {
+        filter->replace(at, placeholder.size(), value);
+    }
+    return true;
+}
+
+AclMatcher* AclFile::compile(const User* user, const std::string& clientID) {
+    std::string name = user != NULL ? user->name : "";
+    AclMatcher* matcher = new AclMatcher();
+    std::vector<AclRule>* rules = &this->anonymous;
+    if (name.size() > 0) {
+        std::unordered_map<std::string, std::vector<AclRule> >::iterator it = this->users.find(name);
+        rules = it != this->users.end() ? &it->second : NULL;
+    }
+    if (rules != NULL) {
+        for (std::vector<AclRule>::iterator it = rules->begin(); it != rules->end(); it++) {
+            matcher->add(it->access, it->filter);
+        }
+    }
+    for (std::vector<AclRule>::iterator it = this->patterns.begin(); it != this->patterns.end(); it++) {
+        std::string filter = it->filter;
+        if (substitute(&filter, "%u", name) && substitute(&filter, "%c", clientID)) {
+            matcher->add(it->access, filter);
+        }
+    }
+    return matcher;
+}
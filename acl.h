@@ -0,0 +1,70 @@
+#ifndef MQTT_ACL_H_
+#define MQTT_ACL_H_
+
+#include "frame.h"
+#include "mqttError.h"
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum AclAccess {
+    ACL_NONE = 0,
+    ACL_READ = 1, // subscribe
+    ACL_WRITE = 2, // publish
+    ACL_READWRITE = 3,
+};
+
+struct AclRule {
+    AclRule(uint8_t access, std::string filter) : access(access), filter(filter) {};
+    uint8_t access;
+    std::string filter;
+};
+
+// the rules of one session as a trie over topic levels, '+' and '#' are
+// edges of their own. A topic is checked in one walk whatever the number of
+// rules, and the verdict for a topic name is remembered so publishing to it
+// again skips the walk.
+class AclMatcher {
+    struct Node {
+        Node() : plus(NULL), exact(ACL_NONE), rest(ACL_NONE) {};
+        ~Node();
+        std::map<std::string, Node*> children;
+        Node* plus;
+        uint8_t exact; // filters ending here
+        uint8_t rest; // filters ending in '#' here, this level and every one below
+    };
+    Node root;
+    std::unordered_map<std::string, uint8_t> decisions;
+    uint8_t walk(const Node* node, const std::vector<std::string>& levels, size_t i, bool filter);
+public:
+    size_t cacheLimit; // decisions kept, the cache starts over past it
+    AclMatcher() : cacheLimit(4096) {};
+    void add(uint8_t access, const std::string filter);
+    // what the rules grant on a topic name
+    uint8_t access(const std::string topic);
+    // what they grant on every topic a subscription filter can match
+    uint8_t filterAccess(const std::string filter);
+    bool canPublish(const std::string& topic);
+    bool canSubscribe(const std::string filter);
+};
+
+// "user <name>" starts the rules of a user, "topic [read|write|readwrite]
+// <filter>" adds one to it (rules before any user line are for clients
+// without a username) and "pattern [read|write|readwrite] <filter>" adds one
+// for everybody, with %u and %c replaced by the username and client id. The
+// access defaults to readwrite. Anything not granted is denied.
+class AclFile {
+    std::vector<AclRule> anonymous;
+    std::unordered_map<std::string, std::vector<AclRule> > users;
+    std::vector<AclRule> patterns;
+public:
+    MQTT_ERROR load(const std::string path);
+    void addTopic(const std::string user, uint8_t access, const std::string filter); // "" is anonymous
+    void addPattern(uint8_t access, const std::string filter);
+    // the rules of a client connecting as user, owned by the caller
+    AclMatcher* compile(const User* user, const std::string& clientID);
+};
+
+#endif // MQTT_ACL_H_
@@ -0,0 +1,291 @@
+#include "auth.h"
+#include "util.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+// FIPS 180-4, enough of it for HMAC and PBKDF2 without a crypto library
+struct Sha256 {
+    uint32_t h[8];
+    uint8_t block[64];
+    uint64_t length; // bytes hashed so far
+    Sha256();
+    void update(const uint8_t* data, size_t len);
+    void update(const std::string& s) {this->update((const uint8_t*)s.data(), s.size());};
+    void finish(uint8_t digest[32]);
+    void compress(const uint8_t* p);
+};
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t rotr(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+Sha256::Sha256() : length(0) {
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(this->h, initial, sizeof(this->h));
+}
+
+void Sha256::compress(const uint8_t* p) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)p[i*4] << 24 | (uint32_t)p[i*4+1] << 16 | (uint32_t)p[i*4+2] << 8 | p[i*4+3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = this->h[0], b = this->h[1], c = this->h[2], d = this->h[3];
+    uint32_t e = this->h[4], f = this->h[5], g = this->h[6], hh = this->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    this->h[0] += a; this->h[1] += b; this->h[2] += c; this->h[3] += d;
+    this->h[4] += e; this->h[5] += f; this->h[6] += g; this->h[7] += hh;
+}
+
+void Sha256::update(const uint8_t* data, size_t len) {
+    size_t used = this->length % 64;
+    this->length += len;
+    if (used > 0) {
+        size_t n = std::min(len, 64 - used);
+        memcpy(this->block + used, data, n);
+        data += n;
+        len -= n;
+        if (used + n < 64) {
+            return;
+        }
+        this->compress(this->block);
+    }
+    for (; len >= 64; data += 64, len -= 64) {
+        this->compress(data);
+    }
+    memcpy(this->block, data, len);
+}
+
+void Sha256::finish(uint8_t digest[32]) {
+    uint64_t bits = this->length * 8;
+    uint8_t pad[72] = {0x80};
+    size_t n = 64 - (this->length + 8) % 64;
+    for (int i = 0; i < 8; i++) {
+        pad[n+i] = (uint8_t)(bits >> (56 - i*8));
+    }
+    this->update(pad, n + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i*4] = (uint8_t)(this->h[i] >> 24);
+        digest[i*4+1] = (uint8_t)(this->h[i] >> 16);
+        digest[i*4+2] = (uint8_t)(this->h[i] >> 8);
+        digest[i*4+3] = (uint8_t)this->h[i];
+    }
+}
+
+// HMAC-SHA256 with the padded key already absorbed, each message then costs
+// two compressions instead of four
+struct Hmac {
+    Sha256 inner;
+    Sha256 outer;
+    Hmac(const std::string& key) {
+        uint8_t k[64] = {0};
+        if (key.size() > 64) {
+            Sha256 s;
+            s.update(key);
+            s.finish(k);
+        } else {
+            memcpy(k, key.data(), key.size());
+        }
+        uint8_t ipad[64], opad[64];
+        for (int i = 0; i < 64; i++) {
+            ipad[i] = k[i] ^ 0x36;
+            opad[i] = k[i] ^ 0x5c;
+        }
+        this->inner.update(ipad, 64);
+        this->outer.update(opad, 64);
+    };
+    void mac(const uint8_t* data, size_t len, uint8_t digest[32]) const {
+        Sha256 in = this->inner;
+        in.update(data, len);
+        in.finish(digest);
+        Sha256 out = this->outer;
+        out.update(digest, 32);
+        out.finish(digest);
+    };
+};
+
+// PBKDF2-HMAC-SHA256 (RFC 8018), one 32 byte block
+static std::string pbkdf2(const std::string& password, const std::string& salt, uint32_t iterations) {
+    Hmac hmac(password);
+    std::string first = salt + std::string("\0\0\0\1", 4);
+    uint8_t u[32], t[32];
+    hmac.mac((const uint8_t*)first.data(), first.size(), u);
+    memcpy(t, u, 32);
+    for (uint32_t i = 1; i < iterations; i++) {
+        hmac.mac(u, 32, u);
+        for (int j = 0; j < 32; j++) {
+            t[j] ^= u[j];
+        }
+    }
+    return std::string((const char*)t, 32);
+}
+
+static std::string toHex(const std::string& bytes) {
+    static const char* digits = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        hex += digits[(uint8_t)bytes[i] >> 4];
+        hex += digits[bytes[i] & 0xf];
+    }
+    return hex;
+}
+
+static bool fromHex(const std::string& hex, std::string* bytes) {
+    if (hex.size() % 2 != 0) {
+        return false;
+    }
+    bytes->clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        char* end;
+        std::string pair = hex.substr(i, 2);
+        long v = strtol(pair.c_str(), &end, 16);
+        if (*end != '\0') {
+            return false;
+        }
+        *bytes += (char)v;
+    }
+    return true;
+}
+
+static std::string randomBytes(size_t n) {
+    std::ifstream urandom("/dev/urandom", std::ios::in | std::ios::binary);
+    std::string bytes(n, '\0');
+    urandom.read(&bytes[0], n);
+    return bytes;
+}
+
+// takes as long for any two hashes of the same length
+static bool sameHash(const std::string& a, const std::string& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    uint8_t diff = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+MQTT_ERROR PasswordFile::load(const std::string path) {
+    std::ifstream f(path.c_str());
+    if (!f) {
+        return STORE_IO_ERROR;
+    }
+    std::unordered_map<std::string, PasswordEntry> users;
+    std::string line;
+    while (std::getline(f, line)) {
+        if (line.size() == 0 || line[0] == '#') {
+            continue;
+        }
+        std::vector<std::string> fields;
+        split(line, ":", &fields);
+        PasswordEntry e;
+        char* end;
+        if (fields.size() != 4 || fields[1].size() == 0) {
+            return STORE_CORRUPTED;
+        }
+        e.iterations = strtoul(fields[1].c_str(), &end, 10);
+        if (*end != '\0' || e.iterations == 0 || !fromHex(fields[2], &e.salt) || !fromHex(fields[3], &e.hash) || e.hash.size() != 32) {
+            return STORE_CORRUPTED;
+        }
+        users[fields[0]] = e;
+    }
+    this->users.swap(users);
+    return NO_ERROR;
+}
+
+bool PasswordFile::verify(const std::string& name, const std::string& password) {
+    std::unordered_map<std::string, PasswordEntry>::iterator it = this->users.find(name);
+    if (it == this->users.end()) {
+        return false;
+    }
+    return sameHash(pbkdf2(password, it->second.salt, it->second.iterations), it->second.hash);
+}
+
+size_t PasswordFile::size() {
+    return this->users.size();
+}
+
+std::string PasswordFile::entry(const std::string& name, const std::string& password, uint32_t iterations) {
+    std::string salt = randomBytes(16);
+    std::stringstream line;
+    line << name << ":" << iterations << ":" << toHex(salt) << ":" << toHex(pbkdf2(password, salt, iterations));
+    return line.str();
+}
+
+AuthCache::AuthCache(Authenticator* inner, size_t capacity) : inner(inner), capacity(capacity), key(randomBytes(32)), hitCount(0), missCount(0) {}
+
+AuthCache::~AuthCache() {
+    delete this->inner;
+}
+
+bool AuthCache::verify(const std::string& name, const std::string& password) {
+    // the name is length prefixed so "ab"+"c" and "a"+"bc" differ
+    uint32_t n = name.size();
+    std::string credentials = std::string((const char*)&n, 4) + name + password;
+    uint8_t digest[32];
+    Hmac(this->key).mac((const uint8_t*)credentials.data(), credentials.size(), digest);
+    std::string id((const char*)digest, 32);
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        std::unordered_map<std::string, std::list<std::pair<std::string, bool> >::iterator>::iterator it = this->entries.find(id);
+        if (it != this->entries.end()) {
+            this->order.splice(this->order.begin(), this->order, it->second);
+            this->hitCount++;
+            return it->second->second;
+        }
+        this->missCount++;
+    }
+    // not under the lock, other connections go on while this one hashes
+    bool ok = this->inner->verify(name, password);
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (this->capacity == 0 || this->entries.count(id) > 0) {
+        return ok;
+    }
+    this->order.push_front(std::make_pair(id, ok));
+    this->entries[id] = this->order.begin();
+    if (this->order.size() > this->capacity) {
+        this->entries.erase(this->order.back().first);
+        this->order.pop_back();
+    }
+    return ok;
+}
+
+size_t AuthCache::size() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->order.size();
+}
+
+uint64_t AuthCache::hits() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->hitCount;
+}
+
+uint64_t AuthCache::misses() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->missCount;
+}
@@ -0,0 +1,61 @@
+#ifndef MQTT_AUTH_H_
+#define MQTT_AUTH_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// checks the username and password of a CONNECT. verify is called from the
+// connection's own thread before the broker lock is taken, concurrently for
+// different connections.
+class Authenticator {
+public:
+    virtual ~Authenticator() {};
+    virtual bool verify(const std::string& name, const std::string& password) = 0;
+};
+
+struct PasswordEntry {
+    uint32_t iterations;
+    std::string salt;
+    std::string hash; // PBKDF2-HMAC-SHA256 of the password, 32 bytes
+};
+
+// users from a file of "name:iterations:salt:hash" lines, salt and hash in hex.
+// Blank lines and lines starting with '#' are skipped.
+class PasswordFile : public Authenticator {
+    std::unordered_map<std::string, PasswordEntry> users;
+public:
+    MQTT_ERROR load(const std::string path);
+    bool verify(const std::string& name, const std::string& password);
+    size_t size();
+    // a line for the file, with a fresh random salt
+    static std::string entry(const std::string& name, const std::string& password, uint32_t iterations);
+};
+
+// remembers what another authenticator decided, so a fleet reconnecting at
+// once pays the slow hash only for credentials it has not seen. Entries are
+// keyed by a keyed hash of name and password, no password is kept, and the
+// least recently used one is evicted past capacity. Refusals are cached too,
+// a device retrying with a wrong password costs no more than a right one.
+class AuthCache : public Authenticator {
+    Authenticator* inner; // owned
+    size_t capacity;
+    std::string key; // random per cache, the hashes are useless outside this process
+    std::mutex mtx;
+    std::list<std::pair<std::string, bool> > order; // most recently used first
+    std::unordered_map<std::string, std::list<std::pair<std::string, bool> >::iterator> entries;
+    uint64_t hitCount;
+    uint64_t missCount;
+public:
+    AuthCache(Authenticator* inner, size_t capacity);
+    ~AuthCache();
+    bool verify(const std::string& name, const std::string& password);
+    size_t size();
+    uint64_t hits();
+    uint64_t misses();
+};
+
+#endif // MQTT_AUTH_H_
@@ -1,19 +1,140 @@
 #include "broker.h"
 #include "frame.h"
+#include "util.h"
+#include "latency.h"
+#include "trace.h"
+#include <algorithm>
 #include <sstream>
 #include <thread>
 #include <sys/socket.h>
 #include "unistd.h"
+#include <stdio.h>
+// mallinfo2 is glibc 2.33 and later, elsewhere the heap gauges fall back to the sessions' own accounting
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#include <malloc.h>
+#define MQTT_HAVE_MALLINFO2 1
+#endif
 
-Broker::Broker() {
+const static std::string SLOW_CONSUMERS_TOPIC = "$SYS/broker/clients/slow";
+// ms between looks at whether the retained segment has been indexed
+const static uint32_t RETAIN_INDEX_POLL_MS = 100;
+
+Broker::Broker() : retransmitInterval(20000), retainStorePath(""), retainBatchSize(256), retainInflightWindow(1024), retainCheckInterval(10000), retainsIndexed(true), maxInflightPerSession(1024), offlineMemoryLimit(1024 * 1024), offlineDiskLimit(256 * 1024 * 1024), offlineSpillDir("/tmp"), offlineBatchSize(1024), publishLog(NULL), publishLogPath(""), publishCommitWindowUs(0), publishLogCheckpointBytes(64 * 1024 * 1024), publishSeq(0), sessionStore(NULL), sessionStorePath(""), sessionCheckpointInterval(60000), topicSnapshotPath(""), topicSnapshot(NULL), outboundHighWater(1024 * 1024), outboundLowWater(256 * 1024), outboundLimit(16 * 1024 * 1024), qos0DropPolicy(DROP_NEWEST), slowConsumerInterval(1000), slowConsumerThreshold(5000), statsInterval(10000), statsSampledAt(0), metricsAddress("127.0.0.1"), metricsPort(0), metrics(NULL), passwordFilePath(""), authCacheSize(100000), allowAnonymous(false), authenticator(NULL), aclFilePath(""), acls(NULL), userLimitersSwept(0), memoryLimit(0), clientMemoryLimit(0), memoryCheckInterval(1000), shedding(false), memoryHeld(0), dummyClientIDs(0), connectionGenerations(0) {
     this->topicRoot = new TopicNode("", "");
+    this->retains = new RetainStore();
+    this->timers = new TimingWheel(100, &this->mtx);
+    this->shareStrategy = new RoundRobinStrategy();
+    this->checkpointTimer.callback = [this]{
+        bool sessions = this->sessionStore != NULL && this->sessionStore->needsCompaction();
+        bool publishes = this->publishLog != NULL && this->publishLog->size() > this->publishLogCheckpointBytes;
+        if (sessions || publishes) {
+            MQTT_ERROR err = this->checkpoint();
+            if (err != NO_ERROR) {
+                emitError(err);
+            }
+        }
+        this->timers->schedule(&this->checkpointTimer, this->sessionCheckpointInterval);
+    };
+    // indexing and compaction of the retained segment stay off the publish path
+    this->retainTimer.callback = [this]{
+        if (!this->retainsIndexed && this->retains->ready()) {
+            this->retainsIndexed = true;
+            for (size_t i = 0; i < this->sessions.size(); i++) {
+                BrokerSideClient* bc = this->sessions[i];
+                if (bc != NULL && bc->isConnecting && bc->retainCursors.size() > 0) {
+                    MQTT_ERROR err = bc->streamRetained();
+                    if (err != NO_ERROR) {
+                        emitError(err);
+                    }
+                }
+            }
+        }
+        if (this->retains->needsCompaction()) {
+            MQTT_ERROR err = this->retains->compact();
+            if (err != NO_ERROR) {
+                emitError(err);
+            }
+        }
+        this->timers->schedule(&this->retainTimer, this->retainsIndexed ? this->retainCheckInterval : RETAIN_INDEX_POLL_MS);
+    };
+    this->slowConsumerTimer.callback = [this]{
+        this->checkSlowConsumers(monotonicMillis());
+        this->timers->schedule(&this->slowConsumerTimer, this->slowConsumerInterval);
+    };
+    this->memoryTimer.callback = [this]{
+        this->accountMemory();
+        this->timers->schedule(&this->memoryTimer, this->memoryCheckInterval);
+    };
+    this->statsTimer.callback = [this]{
+        this->publishStats(monotonicMillis());
+        this->timers->schedule(&this->statsTimer, this->statsInterval);
+    };
+    statTotals(this->statsPrevious);
 }
 
 Broker::~Broker() {
+    delete this->metrics;
+    delete this->timers;
     delete this->topicRoot;
+    delete this->retains;
+    delete this->shareStrategy;
+    delete this->authenticator;
+    delete this->acls;
+    delete this->publishLog;
+    delete this->sessionStore;
+    // lazily loaded nodes point into the mapping
+    delete this->topicSnapshot;
 }
 
 MQTT_ERROR Broker::Start() {
+    if (this->passwordFilePath.size() > 0) {
+        PasswordFile* passwords = new PasswordFile();
+        MQTT_ERROR err = passwords->load(this->passwordFilePath);
+        if (err != NO_ERROR) {
+            delete passwords;
+            return err;
+        }
+        delete this->authenticator;
+        this->authenticator = new AuthCache(passwords, this->authCacheSize);
+    }
+    if (this->aclFilePath.size() > 0) {
+        AclFile* acls = new AclFile();
+        MQTT_ERROR err = acls->load(this->aclFilePath);
+        if (err != NO_ERROR) {
+            delete acls;
+            return err;
+        }
+        delete this->acls;
+        this->acls = acls;
+    }
+    if (this->retainStorePath.size() > 0) {
+        MQTT_ERROR err = this->retains->open(this->retainStorePath);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        this->retainsIndexed = false;
+        this->timers->schedule(&this->retainTimer, RETAIN_INDEX_POLL_MS);
+    }
+    if (this->sessionStorePath.size() > 0) {
+        MQTT_ERROR err = this->restoreSessions();
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (this->publishLogPath.size() > 0) {
+        // after the sessions, so replayed publishes reach them
+        MQTT_ERROR err = this->replayPublishes();
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (this->sessionStore != NULL || this->publishLog != NULL) {
+        MQTT_ERROR err = this->checkpoint();
+        if (err != NO_ERROR) {
+            return err;
+        }
+        this->timers->schedule(&this->checkpointTimer, this->sessionCheckpointInterval);
+    }
     struct sockaddr_in addr;
     int listener = socket(AF_INET, SOCK_STREAM, 0);
     addr.sin_family = AF_INET;
@@ -21,19 +142,295 @@ MQTT_ERROR Broker::Start() {
     addr.sin_addr.s_addr = INADDR_ANY;
     bind(listener, (struct sockaddr *)&addr, sizeof(addr));
     listen(listener, 5);
+    this->timers->schedule(&this->slowConsumerTimer, this->slowConsumerInterval);
+    if (this->memoryLimit > 0 || this->clientMemoryLimit > 0) {
+        this->timers->schedule(&this->memoryTimer, this->memoryCheckInterval);
+    }
+    if (this->metricsPort > 0) {
+        this->metrics = new MetricsServer(this);
+        MQTT_ERROR err = this->metrics->start(this->metricsAddress, this->metricsPort);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (this->statsInterval > 0) {
+        this->statsSampledAt = monotonicMillis();
+        this->sampleGauges(this->statsSampledAt);
+        this->timers->schedule(&this->statsTimer, this->statsInterval);
+    }
+    this->timers->start();
     while (true) {
         struct sockaddr_in client;
         unsigned int len = sizeof(client);
         int sock = accept(listener, (struct sockaddr *)&client, &len);
-        BrokerSideClient* bc = new BrokerSideClient(new Transport(sock, &client), this);
-        std::thread t(readLoop, bc);
-        t.join();
-        bc->readThread = &t;
+        Transport* ct = new Transport(sock, &client);
+        ct->outbox = new Outbox(sock, this->outboundHighWater, this->outboundLowWater, this->outboundLimit, this->qos0DropPolicy);
+        BrokerSideClient* bc = new BrokerSideClient(ct, this);
+        bc->readThread = NULL;
+        std::thread([this, bc]{
+            readLoop(bc);
+            this->connectionClosed(bc);
+        }).detach();
     }
 
     return NO_ERROR;
 }
 
+// serves an in-process client like one accepted on the listener, on its own thread
+void Broker::attach(LoopbackTransport* ct) {
+    BrokerSideClient* bc = new BrokerSideClient(ct, this);
+    bc->readThread = NULL;
+    std::thread([this, bc]{
+        loopbackLoop(bc);
+        this->connectionClosed(bc);
+    }).detach();
+}
+
+// rebuilds the sessions in the store as disconnected clients
+MQTT_ERROR Broker::restoreSessions() {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    if (this->sessionStore == NULL) {
+        // session changes are not acked to anyone, 2ms of batching costs nothing
+        this->sessionStore = new SessionStore(2000);
+    }
+    MQTT_ERROR err = this->sessionStore->open(this->sessionStorePath);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    std::unordered_map<std::string, StoredSession> stored;
+    err = this->sessionStore->load(&stored);
+    if (err != NO_ERROR) {
+        return err;
+    }
+
+    // the tree of the last checkpoint is mapped and only corrected by what changed since
+    std::vector<SnapshotSession> table;
+    std::unordered_map<std::string, SnapshotSession*> snapshotted;
+    if (this->topicSnapshotPath.size() > 0 && access(this->topicSnapshotPath.c_str(), F_OK) == 0) {
+        TopicNode* root = NULL;
+        this->topicSnapshot = new TopicSnapshot();
+        err = this->topicSnapshot->open(this->topicSnapshotPath, &root, &table);
+        if (err == NO_ERROR) {
+            delete this->topicRoot;
+            this->topicRoot = root;
+        } else {
+            emitError(err);
+            table.clear();
+        }
+    }
+    for (std::vector<SnapshotSession>::iterator it = table.begin(); it != table.end(); it++) {
+        snapshotted[it->clientID] = &*it;
+        if (it->slot >= this->sessions.size()) {
+            this->sessions.resize(it->slot + 1, NULL);
+        }
+    }
+    uint32_t reserved = this->sessions.size();
+
+    uint32_t now = monotonicMillis();
+    for (std::unordered_map<std::string, StoredSession>::iterator s = stored.begin(); s != stored.end(); s++) {
+        BrokerSideClient* bc = new BrokerSideClient(NULL, this);
+        bc->ID = s->first;
+        bc->cleanSession = false;
+        bc->maxInflight = this->maxInflightPerSession;
+        this->clients.exchange(s->first, bc);
+        std::map<std::string, uint8_t> before;
+        std::unordered_map<std::string, SnapshotSession*>::iterator snap = snapshotted.find(s->first);
+        if (snap != snapshotted.end()) {
+            bc->sessionIndex = snap->second->slot;
+            this->sessions[bc->sessionIndex] = bc;
+            before.insert(snap->second->subscriptions.begin(), snap->second->subscriptions.end());
+            snapshotted.erase(snap);
+        } else {
+            this->registerSession(bc);
+        }
+        for (std::map<std::string, uint8_t>::iterator it = s->second.subscriptions.begin(); it != s->second.subscriptions.end(); it++) {
+            std::map<std::string, uint8_t>::iterator old = before.find(it->first);
+            bool shared;
+            if ((old != before.end() && old->second == it->second) || this->subscribe(bc->sessionIndex, it->first, it->second, &shared) == NO_ERROR) {
+                bc->subTopics[it->first] = it->second;
+            }
+        }
+        for (std::map<std::string, uint8_t>::iterator it = before.begin(); it != before.end(); it++) {
+            if (bc->subTopics.find(it->first) == bc->subTopics.end()) {
+                this->unsubscribe(bc->sessionIndex, it->first);
+            }
+        }
+        for (std::vector<StoredMessage>::iterator it = s->second.inflight.begin(); it != s->second.inflight.end(); it++) {
+            err = NO_ERROR;
+            Message* m = parseStoredMessage(it->wire, err);
+            if (err != NO_ERROR) {
+                delete m;
+                continue;
+            }
+            bc->inflight.insert(it->id, m, now);
+            bc->packetIDs.mark(it->id);
+        }
+        for (std::list<std::string>::iterator it = s->second.pending.begin(); it != s->second.pending.end(); it++) {
+            err = NO_ERROR;
+            Message* m = parseStoredMessage(*it, err);
+            if (err != NO_ERROR) {
+                delete m;
+                continue;
+            }
+            bc->pendingPublishes.push_back(m);
+        }
+        bc->offline.durable = true;
+        for (std::list<OfflineRef>::iterator it = s->second.offline.begin(); it != s->second.offline.end(); it++) {
+            err = bc->offline.restore(*it);
+            if (err != NO_ERROR) {
+                // a spill segment that is gone, the rest of the queue is still worth having
+                emitError(err);
+            }
+        }
+        for (std::vector<uint16_t>::iterator it = s->second.received.begin(); it != s->second.received.end(); it++) {
+            bc->receivedQoS2.mark(*it);
+        }
+    }
+    // sessions dropped after the snapshot was taken
+    for (std::unordered_map<std::string, SnapshotSession*>::iterator s = snapshotted.begin(); s != snapshotted.end(); s++) {
+        for (size_t i = 0; i < s->second->subscriptions.size(); i++) {
+            this->unsubscribe(s->second->slot, s->second->subscriptions[i].first);
+        }
+    }
+    for (uint32_t idx = 0; idx < reserved; idx++) {
+        if (this->sessions[idx] == NULL) {
+            this->freeSessions.push_back(idx);
+        }
+    }
+    return NO_ERROR;
+}
+
+// a publish log record is [seq(8)][PUBLISH as received]
+static std::string publishRecord(uint64_t seq, Message* m) {
+    std::string rec;
+    for (int i = 7; i >= 0; i--) {
+        rec.push_back((char)(seq >> (i * 8)));
+    }
+    return rec + messageWire(m);
+}
+
+// routes the publishes accepted before a restart again, the log is cleared by
+// the next checkpoint. Those the restored sessions already hold are skipped.
+MQTT_ERROR Broker::replayPublishes() {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    if (this->publishLog == NULL) {
+        this->publishLog = new LogFile(this->publishCommitWindowUs);
+    }
+    MQTT_ERROR err = this->publishLog->open(this->publishLogPath);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    uint64_t applied = this->sessionStore != NULL ? this->sessionStore->appliedPublishes() : 0;
+    this->publishSeq = std::max(this->publishSeq, applied);
+    err = this->publishLog->replay([this, applied](const uint8_t* data, uint32_t len) {
+        if (len < 8) {
+            return;
+        }
+        uint64_t seq = 0;
+        for (int i = 0; i < 8; i++) {
+            seq = seq << 8 | data[i];
+        }
+        this->publishSeq = std::max(this->publishSeq, seq);
+        if (seq <= applied) {
+            return;
+        }
+        MQTT_ERROR err = NO_ERROR;
+        Message* m = parseStoredMessage(std::string((const char*)data + 8, len - 8), err);
+        if (err == NO_ERROR && m->fh->type == PUBLISH_MESSAGE_TYPE) {
+            PublishMessage* p = (PublishMessage*)m;
+            this->publish(p->topicName, p->fh->qos, p->fh->retain, p->payload);
+        }
+        delete m;
+    });
+    if (err == NO_ERROR && this->sessionStore != NULL && this->publishSeq > applied) {
+        this->sessionStore->markApplied(this->publishSeq);
+    }
+    return err;
+}
+
+// snapshots the sessions, which also makes every publish routed so far durable
+MQTT_ERROR Broker::checkpoint() {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    if (this->sessionStore != NULL) {
+        MQTT_ERROR err = this->checkpointSessions();
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (this->topicSnapshotPath.size() > 0) {
+        std::vector<SnapshotSession> table;
+        std::vector<std::pair<std::string, BrokerSideClient*> > entries;
+        this->clients.entries(&entries);
+        for (std::vector<std::pair<std::string, BrokerSideClient*> >::iterator it = entries.begin(); it != entries.end(); it++) {
+            BrokerSideClient* bc = it->second;
+            if (bc == NULL || !bc->persistent() || bc->sessionIndex == INVALID_SESSION) {
+                continue;
+            }
+            table.push_back(SnapshotSession());
+            table.back().slot = bc->sessionIndex;
+            table.back().clientID = it->first;
+            table.back().subscriptions.assign(bc->subTopics.begin(), bc->subTopics.end());
+        }
+        MQTT_ERROR err = TopicSnapshot::write(this->topicSnapshotPath, this->topicRoot, table);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (this->publishLog != NULL) {
+        // retained publishes acked from the log are only on disk in the segment after this
+        MQTT_ERROR err = this->retains->sync();
+        if (err != NO_ERROR) {
+            return err;
+        }
+        return this->publishLog->rewrite(std::vector<std::string>());
+    }
+    return NO_ERROR;
+}
+
+// replaces the session log with the current state of every persistent session
+MQTT_ERROR Broker::checkpointSessions() {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    std::vector<StoredSession> snapshot;
+    std::vector<std::pair<std::string, BrokerSideClient*> > entries;
+    this->clients.entries(&entries);
+    for (std::vector<std::pair<std::string, BrokerSideClient*> >::iterator it = entries.begin(); it != entries.end(); it++) {
+        BrokerSideClient* bc = it->second;
+        if (bc == NULL || !bc->persistent()) {
+            continue;
+        }
+        snapshot.push_back(StoredSession());
+        StoredSession& s = snapshot.back();
+        s.clientID = it->first;
+        s.subscriptions = bc->subTopics;
+        for (uint16_t id = bc->inflight.first(); id != 0; id = bc->inflight.next(id)) {
+            s.inflight.push_back(StoredMessage(id, messageWire(bc->inflight.find(id))));
+        }
+        for (std::list<Message*>::iterator m = bc->pendingPublishes.begin(); m != bc->pendingPublishes.end(); m++) {
+            s.pending.push_back(messageWire(*m));
+        }
+        MQTT_ERROR err = bc->offline.checkpoint(&s.offline);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        for (uint32_t id = 1; id <= 65535 && s.received.size() < bc->receivedQoS2.size(); id++) {
+            if (bc->receivedQoS2.isUsed(id)) {
+                s.received.push_back(id);
+            }
+        }
+    }
+    MQTT_ERROR err = this->sessionStore->compact(snapshot);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    // drained spill segments are not referred to any more
+    for (std::vector<std::pair<std::string, BrokerSideClient*> >::iterator it = entries.begin(); it != entries.end(); it++) {
+        if (it->second != NULL) {
+            it->second->offline.releaseRetired();
+        }
+    }
+    return NO_ERROR;
+}
+
 MQTT_ERROR Broker::checkQoSAndPublish(BrokerSideClient* requestClient, uint8_t publisherQoS, uint8_t requestedQoS, bool retain, std::string topic, std::string message) {
     uint16_t id = 0;
     MQTT_ERROR err = NO_ERROR;
@@ -42,35 +439,670 @@ MQTT_ERROR Broker::checkQoSAndPublish(BrokerSideClient* requestClient, uint8_t p
         // QoS downgrade
         qos = requestedQoS;
     }
+    TraceTag tag = traceCurrent();
+    if (tag.trace != 0) {
+        tag.session = requestClient->sessionIndex;
+        traceDelivering(tag.session);
+    }
+    if (qos == 0 && this->shedding) {
+        statAdd(STAT_PUBLISHES_DROPPED, 1);
+        return NO_ERROR;
+    }
+    if (qos > 0 && (requestClient->slow || requestClient->offline.size() > 0 || (!requestClient->cleanSession && !requestClient->isConnecting))) {
+        // kept until the session is back or its reader has caught up, so the order is preserved
+        if (tag.trace != 0) {
+            tracePoint(TRACE_ENQUEUED, tag, requestClient->ID, 0);
+        }
+        return requestClient->enqueueOffline(new PublishMessage(false, qos, retain, 0, topic, message));
+    }
     if (qos > 0) {
         err = requestClient->getUsablePacketID(&id);
         if (err != NO_ERROR) {
             return err;
         }
+        if (tag.trace != 0) {
+            requestClient->tracedIDs[id] = tag;
+        } else if (requestClient->tracedIDs.size() > 0) {
+            // the id may still name a sampled message that was never acked
+            requestClient->tracedIDs.erase(id);
+        }
     }
     err = requestClient->sendMessage(new PublishMessage(false, qos, retain, id, topic, message));
+    LATENCY_QUEUED();
+    if (tag.trace != 0) {
+        tracePoint(TRACE_ENQUEUED, tag, requestClient->ID, id);
+    }
     return err;
 }
 
+MQTT_ERROR Broker::publish(const std::string topic, uint8_t qos, bool retain, const std::string payload) {
+    MQTT_ERROR err = NO_ERROR;
+    if (retain) {
+        std::string data = payload;
+        if (qos == 0 && data.size() > 0) {
+            data = "";
+        }
+        err = this->retains->apply(topic, qos, data);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    std::vector<TopicNode*> nodes;
+    err = this->topicRoot->getTopicNode(topic, true, &nodes);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    TopicNode* node = nodes[0];
+    LATENCY_MATCHED();
+    statAdd(STAT_PUBLISHES_ROUTED, 1);
+    TraceTag tag = traceCurrent();
+    if (tag.trace != 0) {
+        tracePoint(TRACE_MATCHED, tag, "", node->subscribers.size() + node->sharedGroups.size());
+    }
+    // a subscriber that cannot take the message is not the publisher's problem
+    this->fanout(node, qos, false, topic, payload);
+    return NO_ERROR;
+}
+
+MQTT_ERROR Broker::fanout(TopicNode* node, uint8_t publisherQoS, bool retain, std::string topic, std::string message) {
+    MQTT_ERROR err = NO_ERROR;
+    uint64_t deliveries = 0;
+    std::vector<Subscriber>& subs = node->subscribers;
+    for (std::vector<Subscriber>::iterator it = subs.begin(); it != subs.end(); it++) {
+        BrokerSideClient* subscriber = this->sessions[it->session];
+        if (subscriber == NULL) {
+            continue;
+        }
+        err = this->checkQoSAndPublish(subscriber, publisherQoS, it->qos, retain, topic, message);
+        deliveries++;
+    }
+    // each shared group gets the message once, on the member the strategy picks
+    for (std::map<std::string, SharedGroup*>::iterator it = node->sharedGroups.begin(); it != node->sharedGroups.end(); it++) {
+        const Subscriber* member = it->second->pick(topic, this->shareStrategy, this);
+        if (member == NULL) {
+            continue;
+        }
+        err = this->checkQoSAndPublish(this->sessions[member->session], publisherQoS, member->qos, retain, topic, message);
+        deliveries++;
+    }
+    statAdd(STAT_FANOUT_DELIVERIES, deliveries);
+    return err;
+}
+
+void Broker::setShareStrategy(ShareStrategy* strategy) {
+    delete this->shareStrategy;
+    this->shareStrategy = strategy;
+}
+
+bool Broker::isAvailable(uint32_t session) {
+    return session < this->sessions.size() && this->sessions[session] != NULL && this->sessions[session]->isConnecting;
+}
+
+uint32_t Broker::inflightCount(uint32_t session) {
+    return this->sessions[session]->inflight.size();
+}
+
+MQTT_ERROR Broker::subscribe(uint32_t session, const std::string topic, uint8_t qos, bool* shared) {
+    std::vector<TopicNode*> nodes;
+    std::string group, filter;
+    MQTT_ERROR err = NO_ERROR;
+    *shared = splitSharedTopic(topic, &group, &filter, err);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    err = this->topicRoot->getTopicNode(*shared ? filter : topic, true, &nodes);
+    if (err != NO_ERROR) {
+        return err;
+    }
+    for (std::vector<TopicNode*>::iterator it = nodes.begin(); it != nodes.end(); it++) {
+        if (*shared) {
+            (*it)->setSharedSubscriber(group, session, qos);
+        } else {
+            (*it)->setSubscriber(session, qos);
+        }
+    }
+    return NO_ERROR;
+}
+
+MQTT_ERROR Broker::unsubscribe(uint32_t session, const std::string topic) {
+    std::string group, filter;
+    MQTT_ERROR err = NO_ERROR;
+    if (splitSharedTopic(topic, &group, &filter, err)) {
+        if (err != NO_ERROR) {
+            return err;
+        }
+        return this->topicRoot->deleteSharedSubscriber(session, group, filter);
+    }
+    return this->topicRoot->deleteSubscriber(session, topic);
+}
+
+uint32_t Broker::registerSession(BrokerSideClient* bc) {
+    uint32_t idx;
+    if (this->freeSessions.size() > 0) {
+        idx = this->freeSessions.back();
+        this->freeSessions.pop_back();
+        this->sessions[idx] = bc;
+    } else {
+        idx = this->sessions.size();
+        this->sessions.push_back(bc);
+    }
+    bc->sessionIndex = idx;
+    return idx;
+}
+
+void Broker::releaseSession(uint32_t idx) {
+    if (idx >= this->sessions.size() || this->sessions[idx] == NULL) {
+        return;
+    }
+    BrokerSideClient* bc = this->sessions[idx];
+    // the slot is going to be reused, so no subscription may keep pointing at it
+    for (std::map<std::string, uint8_t>::iterator it = bc->subTopics.begin(); it != bc->subTopics.end(); it++) {
+        this->unsubscribe(idx, it->first);
+    }
+    bc->sessionIndex = INVALID_SESSION;
+    this->sessions[idx] = NULL;
+    this->freeSessions.push_back(idx);
+}
+
+// samples every connection's outbound queue. A reader whose queue stays above
+// the low water mark for slowConsumerThreshold is flagged slow: its QoS1/2
+// deliveries move to its offline queue, which is drained here and on acks only
+// while the outbox has room, so publishers never wait on it.
+void Broker::checkSlowConsumers(uint32_t now) {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    std::stringstream report;
+    for (uint32_t idx = 0; idx < this->sessions.size(); idx++) {
+        BrokerSideClient* bc = this->sessions[idx];
+        if (bc == NULL || !bc->isConnecting || bc->ct == NULL || bc->ct->outbox == NULL) {
+            continue;
+        }
+        Outbox* out = bc->ct->outbox;
+        uint64_t written = out->written();
+        if (now != bc->sampledAt) {
+            bc->drainRate = (written - bc->sampledWritten) * 1000 / (now - bc->sampledAt);
+        }
+        bc->sampledAt = now;
+        bc->sampledWritten = written;
+        uint64_t depth = out->bytes();
+        if (depth > this->outboundLowWater) {
+            if (!bc->behind) {
+                bc->behind = true;
+                bc->behindSince = now;
+            }
+            if (this->slowConsumerThreshold > 0 && now - bc->behindSince >= this->slowConsumerThreshold) {
+                bc->slow = true;
+            }
+        } else {
+            bc->behind = false;
+            bc->slow = false;
+        }
+        if (bc->slow) {
+            report << bc->ID << " " << depth << " " << bc->drainRate << "\n";
+        }
+        if (bc->offline.size() > 0) {
+            bc->drainOffline();
+        }
+    }
+    if (report.str() != this->slowConsumerReport) {
+        // retained, so a new subscriber sees the current list at once
+        this->slowConsumerReport = report.str();
+        this->publish(SLOW_CONSUMERS_TOPIC, 1, true, this->slowConsumerReport);
+    }
+}
+
+// over memoryLimit the broker first sheds load: QoS0 deliveries are dropped
+// and new connections refused. Still over at the next accounting, the
+// connections holding the most are closed until the total is back under 90%.
+// A connection over clientMemoryLimit is closed right away.
+void Broker::accountMemory() {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    uint64_t total = 0;
+    std::vector<std::pair<uint64_t, BrokerSideClient*> > connected;
+    for (uint32_t idx = 0; idx < this->sessions.size(); idx++) {
+        BrokerSideClient* bc = this->sessions[idx];
+        if (bc == NULL) {
+            continue;
+        }
+        bc->memoryHeld = bc->heldBytes();
+        total += bc->memoryHeld;
+        if (!bc->isConnecting) {
+            continue;
+        }
+        if (this->clientMemoryLimit > 0 && bc->memoryHeld > this->clientMemoryLimit) {
+            emitError(MEMORY_LIMIT_EXCEEDED);
+            statAdd(STAT_MEMORY_DISCONNECTS, 1);
+            bc->disconnectProcessing();
+            continue;
+        }
+        connected.push_back(std::make_pair(bc->memoryHeld, bc));
+    }
+    if (this->memoryLimit > 0) {
+        uint64_t low = this->memoryLimit / 10 * 9;
+        if (this->shedding && total > this->memoryLimit) {
+            std::sort(connected.begin(), connected.end(), [](const std::pair<uint64_t, BrokerSideClient*>& a, const std::pair<uint64_t, BrokerSideClient*>& b) {
+                return a.first > b.first;
+            });
+            // what they held is only freed as their threads finish, the next
+            // accounting sees what actually went
+            for (size_t i = 0; i < connected.size() && total > low; i++) {
+                emitError(MEMORY_LIMIT_EXCEEDED);
+                statAdd(STAT_MEMORY_DISCONNECTS, 1);
+                connected[i].second->disconnectProcessing();
+                total -= std::min(total, connected[i].first);
+            }
+        }
+        this->shedding = total > this->memoryLimit || (this->shedding && total > low);
+    }
+    this->memoryHeld = total;
+}
+
+static uint64_t residentBytes() {
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    unsigned long size = 0, resident = 0;
+    if (fscanf(f, "%lu %lu", &size, &resident) != 2) {
+        resident = 0;
+    }
+    fclose(f);
+    return (uint64_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+void Broker::sampleGauges(uint32_t now) {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    BrokerGauges* g = new BrokerGauges();
+    g->takenAt = now;
+    for (uint32_t idx = 0; idx < this->sessions.size(); idx++) {
+        BrokerSideClient* bc = this->sessions[idx];
+        if (bc == NULL) {
+            continue;
+        }
+        if (bc->isConnecting) {
+            g->connected++;
+        }
+        if (bc->slow) {
+            g->slowConsumers++;
+        }
+        uint64_t held = bc->heldBytes();
+        g->sessionMemory += held;
+        if (held > g->sessionMemoryMax) {
+            g->sessionMemoryMax = held;
+        }
+        g->subscriptions += bc->subTopics.size();
+        g->inflight += bc->inflight.size();
+        g->offlineMessages += bc->offline.size();
+        if (bc->ct != NULL && bc->ct->outbox != NULL) {
+            uint64_t queued = bc->ct->outbox->bytes();
+            g->outboundBytes += queued;
+            if (queued > g->outboundMaxBytes) {
+                g->outboundMaxBytes = queued;
+            }
+        }
+    }
+    g->sessions = this->clients.size();
+    // a gauge must not make the segment be read at boot
+    g->retained = this->retains->indexedSize();
+    g->shedding = this->shedding ? 1 : 0;
+#ifdef MQTT_HAVE_MALLINFO2
+    struct mallinfo2 heap = mallinfo2();
+    g->heapInUse = heap.uordblks;
+    g->heapFree = heap.fordblks;
+    g->heapMapped = heap.hblkhd;
+#else
+    g->heapInUse = g->sessionMemory;
+#endif
+    g->resident = residentBytes();
+    std::atomic_store(&this->gauges, std::shared_ptr<const BrokerGauges>(g));
+}
+
+// publishes the counters of every thread and the current gauges as retained
+// $SYS messages, loads are per second since the previous update
+void Broker::publishStats(uint32_t now) {
+    std::lock_guard<std::recursive_mutex> lock(this->mtx);
+    this->sampleGauges(now);
+    std::shared_ptr<const BrokerGauges> g = std::atomic_load(&this->gauges);
+    uint64_t totals[STAT_COUNT];
+    statTotals(totals);
+    uint64_t elapsed = now - this->statsSampledAt;
+    uint64_t rates[STAT_COUNT];
+    for (int i = 0; i < STAT_COUNT; i++) {
+        rates[i] = elapsed == 0 ? 0 : (totals[i] - this->statsPrevious[i]) * 1000 / elapsed;
+        this->statsPrevious[i] = totals[i];
+    }
+    this->statsSampledAt = now;
+
+    std::vector<std::pair<std::string, uint64_t> > values;
+    values.push_back(std::make_pair("$SYS/broker/clients/connected", g->connected));
+    values.push_back(std::make_pair("$SYS/broker/clients/total", g->sessions));
+    values.push_back(std::make_pair("$SYS/broker/subscriptions/count", g->subscriptions));
+    values.push_back(std::make_pair("$SYS/broker/retained messages/count", g->retained));
+    values.push_back(std::make_pair("$SYS/broker/messages/inflight", g->inflight));
+    values.push_back(std::make_pair("$SYS/broker/messages/received", totals[STAT_MESSAGES_RECEIVED]));
+    values.push_back(std::make_pair("$SYS/broker/messages/sent", totals[STAT_MESSAGES_SENT]));
+    values.push_back(std::make_pair("$SYS/broker/bytes/received", totals[STAT_BYTES_RECEIVED]));
+    values.push_back(std::make_pair("$SYS/broker/bytes/sent", totals[STAT_BYTES_SENT]));
+    values.push_back(std::make_pair("$SYS/broker/publish/messages/received", totals[STAT_PUBLISHES_RECEIVED]));
+    values.push_back(std::make_pair("$SYS/broker/publish/messages/sent", totals[STAT_PUBLISHES_SENT]));
+    values.push_back(std::make_pair("$SYS/broker/publish/messages/dropped", totals[STAT_PUBLISHES_DROPPED]));
+    values.push_back(std::make_pair("$SYS/broker/load/messages/received", rates[STAT_MESSAGES_RECEIVED]));
+    values.push_back(std::make_pair("$SYS/broker/load/messages/sent", rates[STAT_MESSAGES_SENT]));
+    values.push_back(std::make_pair("$SYS/broker/load/bytes/received", rates[STAT_BYTES_RECEIVED]));
+    values.push_back(std::make_pair("$SYS/broker/load/bytes/sent", rates[STAT_BYTES_SENT]));
+    values.push_back(std::make_pair("$SYS/broker/topics/nodes", totals[STAT_TOPIC_NODES_CREATED] - totals[STAT_TOPIC_NODES_DELETED]));
+    values.push_back(std::make_pair("$SYS/broker/memory/resident", g->resident));
+    values.push_back(std::make_pair("$SYS/broker/memory/sessions", g->sessionMemory));
+#if MQTT_STAGE_LATENCY
+    // ns, since the broker started
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        LatencyHistogram h;
+        latencySnapshot((LatencyStage)stage, &h);
+        std::string prefix = std::string("$SYS/broker/latency/") + StageName[stage];
+        values.push_back(std::make_pair(prefix + "/count", h.count()));
+        values.push_back(std::make_pair(prefix + "/p50", h.percentile(50)));
+        values.push_back(std::make_pair(prefix + "/p99", h.percentile(99)));
+        values.push_back(std::make_pair(prefix + "/p999", h.percentile(99.9)));
+        values.push_back(std::make_pair(prefix + "/max", h.max()));
+    }
+#endif
+    for (std::vector<std::pair<std::string, uint64_t> >::iterator it = values.begin(); it != values.end(); it++) {
+        std::stringstream payload;
+        payload << it->second;
+        MQTT_ERROR err = this->publish(it->first, 1, true, payload.str());
+        if (err != NO_ERROR) {
+            emitError(err);
+        }
+    }
+}
+
+// runs on the read thread once its loop has returned, nothing reads the socket any more
+void Broker::connectionClosed(BrokerSideClient* bc) {
+    Transport* ct;
+    {
+        std::lock_guard<std::recursive_mutex> lock(this->mtx);
+        if (bc->isConnecting) {
+            // dropped without DISCONNECT
+            bc->disconnectProcessing();
+        }
+        ct = bc->ct;
+        bc->ct = NULL;
+        // a session that was resumed or taken over has been handed to the newer connection,
+        // one still held by the registry is freed by the CONNECT that takes it over
+        if (bc->sessionIndex == INVALID_SESSION && !this->clients.holds(bc->ID, bc)) {
+            delete bc;
+        }
+    }
+    // stops the writer before the fd goes away. Its outbox may wait for the
+    // peer to take the last control frames, nobody else waits for that.
+    int sock = ct->sock;
+    delete ct;
+    if (sock >= 0) {
+        close(sock);
+    }
+}
+
 void Broker::ApplyDummyClientID(std::string* id) {
     std::stringstream ss;
-    ss << "DummyClientID" << this->clients.size() + 1;
+    ss << "DummyClientID" << ++this->dummyClientIDs;
     *id = ss.str();
     return;
 }
 
+ConnectReturnCode Broker::authenticate(const User* user) {
+    if (this->authenticator == NULL) {
+        return CONNECT_ACCEPTED;
+    }
+    if (user == NULL) {
+        return this->allowAnonymous ? CONNECT_ACCEPTED : CONNECT_NOT_AUTHORIZED;
+    }
+    return this->authenticator->verify(user->name, user->passwd) ? CONNECT_ACCEPTED : CONNECT_BAD_USERNAME_OR_PASSWORD;
+}
+
+// one limiter per username while any of its connections holds it
+std::shared_ptr<RateLimiter> Broker::userLimiter(const std::string name) {
+    std::lock_guard<std::mutex> lock(this->limitersMtx);
+    // users with no connection left are swept whenever the map has doubled
+    if (this->userLimiters.size() >= 2 * this->userLimitersSwept + 16) {
+        for (std::map<std::string, std::weak_ptr<RateLimiter> >::iterator it = this->userLimiters.begin(); it != this->userLimiters.end(); ) {
+            if (it->second.expired()) {
+                it = this->userLimiters.erase(it);
+            } else {
+                it++;
+            }
+        }
+        this->userLimitersSwept = this->userLimiters.size();
+    }
+    std::weak_ptr<RateLimiter>& slot = this->userLimiters[name];
+    std::shared_ptr<RateLimiter> limiter = slot.lock();
+    if (limiter == NULL) {
+        limiter = std::make_shared<RateLimiter>(this->userRateLimit);
+        slot = limiter;
+    }
+    return limiter;
+}
+
 
-BrokerSideClient::BrokerSideClient(Transport* ct, Broker* b) : broker(b), Terminal("", NULL, 0, NULL) {
+BrokerSideClient::BrokerSideClient(Transport* ct, Broker* b) : Terminal("", NULL, 0, NULL), broker(b), droppedPublishes(0), behind(false), behindSince(0), sampledAt(0), sampledWritten(0), drainRate(0), authChecked(false), authCode(CONNECT_ACCEPTED), acl(NULL), previous(NULL), connectPending(false), superseded(false), generation(++b->connectionGenerations), sessionIndex(INVALID_SESSION), slow(false), memoryHeld(0) {
     this->ct = ct;
+    this->dispatchLock = &b->mtx;
+    this->keepAliveTimer.callback = [this]{this->keepAliveExpired();};
+    this->retransmitTimer.callback = [this]{this->retransmit();};
+    this->offline.memoryLimit = b->offlineMemoryLimit;
+    this->offline.diskLimit = b->offlineDiskLimit;
+    this->offline.spillDir = b->offlineSpillDir;
 }
 
-BrokerSideClient::~BrokerSideClient() {}
+BrokerSideClient::~BrokerSideClient() {
+    this->broker->timers->cancel(&this->keepAliveTimer);
+    this->broker->timers->cancel(&this->retransmitTimer);
+    delete this->acl;
+}
+
+// counted before the dispatch lock is taken
+void BrokerSideClient::frameReceived(FixedHeader* fh, uint32_t length) {
+    statAdd(STAT_MESSAGES_RECEIVED, 1);
+    statAdd(STAT_BYTES_RECEIVED, length);
+    if (fh->type == PUBLISH_MESSAGE_TYPE) {
+        statAdd(STAT_PUBLISHES_RECEIVED, 1);
+        this->throttle(length);
+    }
+}
+
+// a client over its rate is not read from until it is back under, TCP pushes
+// back on it rather than the broker dropping what it sent
+void BrokerSideClient::throttle(uint32_t length) {
+    uint64_t now = monotonicMicros();
+    uint64_t wait = 0;
+    if (this->clientLimiter != NULL) {
+        wait = this->clientLimiter->admit(length, now);
+    }
+    if (this->userLimiter != NULL) {
+        wait = std::max(wait, this->userLimiter->admit(length, now));
+    }
+    if (wait == 0) {
+        return;
+    }
+    statAdd(STAT_READ_PAUSES, 1);
+    if (this->keepAlive != 0) {
+        // the frame is here, the pause must not run the client into its keepalive
+        {
+            std::lock_guard<std::recursive_mutex> lock(this->broker->mtx);
+            this->packetReceived();
+        }
+        wait = std::min<uint64_t>(wait, (uint64_t)this->keepAlive * 1000000);
+    }
+    // in slices, a connection closed meanwhile stops waiting
+    for (uint64_t end = now + wait; this->isConnecting && now < end; now = monotonicMicros()) {
+        usleep(std::min<uint64_t>(end - now, 100000));
+    }
+}
+
+void BrokerSideClient::messageDecoded(Message* m) {
+    if (m->fh->type == CONNECT_MESSAGE_TYPE) {
+        this->admitConnect((ConnectMessage*)m);
+    }
+}
+
+// the password hash is slow and the registry has its own locks, so a CONNECT
+// is verified and takes its client id over here on the connection's thread
+// rather than while the broker lock is held for its dispatch
+void BrokerSideClient::admitConnect(ConnectMessage* m) {
+    ConnectReturnCode code = this->broker->authenticate(m->user);
+    if (code == CONNECT_ACCEPTED && this->broker->shedding) {
+        code = CONNECT_SERVER_UNAVAILABLE;
+    }
+    this->authCode = code;
+    this->authChecked = true;
+    bool valid = m->protocol.name == MQTT_3_1_1.name && m->protocol.level == MQTT_3_1_1.level;
+    if (code == CONNECT_ACCEPTED && valid && m->clientID.size() > 0 && !this->isConnecting) {
+        this->connectPending = true;
+        this->broker->clients.takeOver(m->clientID, this, &this->previous);
+    }
+}
+
+// the client this CONNECT replaces. Those that took the id over in between but
+// have not been dispatched yet are skipped, their CONNECTs are refused.
+BrokerSideClient* BrokerSideClient::takePrevious(const std::string& id) {
+    BrokerSideClient* prev = this->previous;
+    this->previous = NULL;
+    this->connectPending = false;
+    while (prev != NULL && prev->connectPending) {
+        BrokerSideClient* next = prev->previous;
+        prev->previous = NULL;
+        prev->connectPending = false;
+        prev->superseded = true;
+        // its own connection closes it, there is nothing to hand over
+        this->broker->clients.release(id, prev);
+        prev = next;
+    }
+    return prev;
+}
+
+// any control packet from the client restarts its keepalive
+void BrokerSideClient::packetReceived() {
+    if (this->isConnecting && this->keepAlive != 0) {
+        this->broker->timers->schedule(&this->keepAliveTimer, this->keepAlive * 1500);
+    }
+}
+
+void BrokerSideClient::keepAliveExpired() {
+    if (!this->isConnecting) {
+        return;
+    }
+    emitError(CLIENT_TIMED_OUT);
+    this->disconnectProcessing();
+}
+
+// an object and its encoded fields
+static uint64_t messageBytes(Message* m) {
+    return sizeof(PublishMessage) + m->fh->length;
+}
+
+// what this session keeps in memory: its connection and the buffers in it,
+// unacked and queued messages, the unspilled part of its offline queue and
+// its subscriptions. Counted from the structures rather than per allocation,
+// so it is an estimate that never drifts.
+uint64_t BrokerSideClient::heldBytes() {
+    uint64_t held = sizeof(BrokerSideClient);
+    if (this->ct != NULL) {
+        held += sizeof(Transport);
+        if (this->ct->outbox != NULL) {
+            held += this->ct->outbox->bytes();
+        }
+    }
+    for (uint16_t id = this->inflight.first(); id != 0; id = this->inflight.next(id)) {
+        held += messageBytes(this->inflight.find(id));
+    }
+    for (std::list<Message*>::iterator it = this->pendingPublishes.begin(); it != this->pendingPublishes.end(); it++) {
+        held += messageBytes(*it);
+    }
+    held += this->offline.memoryUsed();
+    for (std::map<std::string, uint8_t>::iterator it = this->subTopics.begin(); it != this->subTopics.end(); it++) {
+        // the map entry and the subscriber in the topic tree
+        held += it->first.size() * 2 + sizeof(Subscriber) + 64;
+    }
+    return held;
+}
+
+// QoS0 publishes dropped on this session's connections so far
+uint64_t BrokerSideClient::dropped() {
+    uint64_t n = this->droppedPublishes;
+    if (this->isConnecting && this->ct != NULL && this->ct->outbox != NULL) {
+        n += this->ct->outbox->dropped();
+    }
+    return n;
+}
+
+bool BrokerSideClient::backlogged() {
+    return this->ct != NULL && this->ct->outbox != NULL && this->ct->outbox->bytes() > this->broker->outboundLowWater;
+}
+
+bool BrokerSideClient::persistent() {
+    return !this->cleanSession && this->ID.size() > 0 && this->broker->sessionStore != NULL;
+}
+
+void BrokerSideClient::inflightStored(uint16_t id, Message* m) {
+    if (this->persistent()) {
+        this->broker->sessionStore->storeInflight(this->ID, id, m);
+    }
+}
+
+void BrokerSideClient::inflightRemoved(uint16_t id) {
+    if (this->persistent()) {
+        this->broker->sessionStore->removeInflight(this->ID, id);
+    }
+}
+
+void BrokerSideClient::pendingPushed(Message* m) {
+    if (this->persistent()) {
+        this->broker->sessionStore->pushPending(this->ID, m);
+    }
+}
+
+void BrokerSideClient::pendingPopped() {
+    if (this->persistent()) {
+        this->broker->sessionStore->popPending(this->ID);
+    }
+}
+
+void BrokerSideClient::inflightAdded() {
+    if (this->broker->retransmitInterval != 0 && !this->retransmitTimer.armed()) {
+        this->broker->timers->schedule(&this->retransmitTimer, this->broker->retransmitInterval);
+    }
+}
+
+// resends every message unacked for retransmitInterval, oldest first
+void BrokerSideClient::retransmit() {
+    if (!this->isConnecting) {
+        return;
+    }
+    uint32_t now = monotonicMillis();
+    uint32_t interval = this->broker->retransmitInterval;
+    for (uint32_t n = this->inflight.size(); n > 0; n--) {
+        uint16_t id = this->inflight.first();
+        if (now - this->inflight.stampOf(id) < interval) {
+            break;
+        }
+        Message* m = this->inflight.find(id);
+        if (m->fh->type == PUBLISH_MESSAGE_TYPE) {
+            m->fh->dup = true;
+        }
+        if (this->ct->sendMessage(m) != NO_ERROR) {
+            break;
+        }
+        this->inflight.touch(id, now);
+    }
+    if (this->inflight.size() > 0) {
+        uint32_t age = now - this->inflight.stampOf(this->inflight.first());
+        this->broker->timers->schedule(&this->retransmitTimer, age < interval ? interval - age : interval);
+    }
+}
 
 MQTT_ERROR  BrokerSideClient::disconnectProcessing() {
     MQTT_ERROR err = NO_ERROR;
     if (this->will != NULL) {
         if (this->will->retain) {
-            err = this->broker->topicRoot->applyRetain(will->topic, will->qos, will->message);
+            err = this->broker->retains->apply(will->topic, will->qos, will->message);
             if (err != NO_ERROR) {
                 return err;
                 }
@@ -81,42 +1113,50 @@ MQTT_ERROR  BrokerSideClient::disconnectProcessing() {
             return err;
         }
 
-        for (std::map<std::string, uint8_t>::iterator it = nodes[0]->subscribers.begin(); it != nodes[0]->subscribers.end(); it++) {
-            BrokerSideClient* subscriber = broker->clients[it->first];
-            this->broker->checkQoSAndPublish(subscriber, this->will->qos, it->second, this->will->retain, this->will->topic, this->will->message);
-        }
+        this->broker->fanout(nodes[0], this->will->qos, this->will->retain, this->will->topic, this->will->message);
     }
     if (this->isConnecting) {
-        // stop keepalive timer
+        this->broker->timers->cancel(&this->keepAliveTimer);
+        this->broker->timers->cancel(&this->retransmitTimer);
+        if (this->ct != NULL && this->ct->outbox != NULL) {
+            // nothing reaches the outbox once the session is disconnected
+            this->droppedPublishes += this->ct->outbox->dropped();
+        }
         if (this->cleanSession) {
-            delete this->broker->clients[ID];
+            this->broker->releaseSession(this->sessionIndex);
+            this->broker->clients.remove(this->ID, this);
         }
     }
     err = this->disconnectBase();
     return err;
 }
 
-void expirationTimer(BrokerSideClient* bc, int tID) {
-    usleep(bc->keepAlive);
-    if (bc->threads.find(tID) != bc->threads.end()) {
-        bool gotPing = bc->threads[tID];
-        if (!gotPing) {
-            // TODO : show some error
-            bc->disconnectProcessing();
-        }
-    } else {
-        // TODO : show error?
-    }
-    return;
-}
-
 void BrokerSideClient::setPreviousSession(BrokerSideClient* ps) {
+    this->ID = ps->ID;
     this->subTopics = ps->subTopics;
-    this->packetIDMap = ps->packetIDMap;
+    this->sessionIndex = ps->sessionIndex;
+    this->inflight = ps->inflight;
+    ps->inflight = InflightWindow();
+    this->pendingPublishes.swap(ps->pendingPublishes);
+    this->offline.swap(ps->offline);
+    this->packetIDs = ps->packetIDs;
+    this->receivedQoS2 = ps->receivedQoS2;
+    this->droppedPublishes = ps->droppedPublishes;
     this->cleanSession = ps->cleanSession;
     this->will = ps->will;
     this->user = ps->user;
     this->keepAlive = ps->keepAlive;
+    // the old client owns nothing any more and no slot points at it
+    ps->will = NULL;
+    ps->user = NULL;
+    ps->sessionIndex = INVALID_SESSION;
+}
+
+// the session is not connected, so the CONNACK goes to the transport directly
+void BrokerSideClient::refuseConnect(ConnectReturnCode code) {
+    ConnackMessage* m = new ConnackMessage(false, code);
+    this->ct->sendMessage(m);
+    delete m;
 }
 
 MQTT_ERROR BrokerSideClient::recvConnectMessage(ConnectMessage* m) {
@@ -125,23 +1165,41 @@ MQTT_ERROR BrokerSideClient::recvConnectMessage(ConnectMessage* m) {
         return INVALID_PROTOCOL_NAME;
     }
     if (m->protocol.level != MQTT_3_1_1.level) {
-        this->sendMessage(new ConnackMessage(false, CONNECT_UNNACCEPTABLE_PROTOCOL_VERSION));
+        this->refuseConnect(CONNECT_UNNACCEPTABLE_PROTOCOL_VERSION);
         return INVALID_PROTOCOL_NAME;
     }
-    std::map<std::string, BrokerSideClient*>::iterator bc = this->broker->clients.find(m->clientID);
-    if (bc != this->broker->clients.end() && bc->second->isConnecting) {
-        this->sendMessage(new ConnackMessage(false, CONNECT_IDENTIFIER_REJECTED));
+    if (!this->authChecked) {
+        this->admitConnect(m);
+    }
+    this->authChecked = false;
+    if (this->authCode != CONNECT_ACCEPTED) {
+        this->refuseConnect(this->authCode);
+        return CONNECTION_REFUSED;
+    }
+    if (this->superseded) {
+        // a newer connection with this id was dispatched first and holds the session
         return CLIENT_ID_IS_USED_ALREADY;
     }
+    bool registered = m->clientID.size() > 0;
+    BrokerSideClient* prev = registered ? this->takePrevious(m->clientID) : NULL;
+    BrokerSideClient* bc = prev;
+    if (bc != NULL && bc->isConnecting) {
+        // the newer connection takes over, the old one is closed as if it had dropped
+        bc->disconnectProcessing();
+    }
+    if (bc != NULL && bc->cleanSession) {
+        bc = NULL;
+    }
     bool cs = (ConnectFlag)(m->flags&CLEANSESSION_FLAG) == CLEANSESSION_FLAG;
-    if (bc != this->broker->clients.end() && !this->cleanSession) {
-        this->setPreviousSession(bc->second);
+    bool handedOver = bc != NULL && !this->cleanSession;
+    if (handedOver) {
+        this->setPreviousSession(bc);
     } else if (!cs && m->clientID.size() == 0) {
-        this->sendMessage(new ConnackMessage(false, CONNECT_IDENTIFIER_REJECTED));
+        this->refuseConnect(CONNECT_IDENTIFIER_REJECTED);
         return CLEANSESSION_MUST_BE_TRUE;
     }
 
-    bool sessionPresent = bc != this->broker->clients.end();
+    bool sessionPresent = bc != NULL;
     if (cs || !sessionPresent) {
         // set torelant Duration
         if (m->clientID.size() == 0) {
@@ -151,84 +1209,161 @@ MQTT_ERROR BrokerSideClient::recvConnectMessage(ConnectMessage* m) {
         this->user = m->user;
         this->will = m->will;
         this->keepAlive = m->keepAlive;
+        this->maxInflight = this->broker->maxInflightPerSession;
         this->cleanSession = cs;
+        this->subTopics.clear();
         sessionPresent = false;
     }
-    this->broker->clients[m->clientID] = this;
+    if (handedOver && !cs) {
+        // resumed session keeps its slot, subscriptions already point at it
+        this->broker->sessions[this->sessionIndex] = this;
+    } else {
+        if (handedOver) {
+            // the slot still refers to the old client and its subscriptions
+            this->broker->releaseSession(this->sessionIndex);
+            this->offline.clear();
+        }
+        this->broker->registerSession(this);
+    }
+    if (!registered) {
+        this->broker->clients.exchange(m->clientID, this);
+    }
+    if (prev != NULL) {
+        this->broker->clients.release(m->clientID, prev);
+        if (prev->ct == NULL) {
+            // its connection has been closed already, connectionClosed will not see it again
+            delete prev;
+        }
+    }
+    if (this->broker->sessionStore != NULL) {
+        if (cs) {
+            this->broker->sessionStore->dropSession(this->ID);
+        } else if (!sessionPresent) {
+            this->broker->sessionStore->putSession(this->ID);
+        }
+    }
 
     if ((ConnectFlag)(m->flags&WILL_FLAG) == WILL_FLAG) {
         this->will = m->will;
     } else {
 
     }
-    if (m->keepAlive != 0) {
-        // TODO : bad way
-        this->threadIdx = 0;
-        std::thread t = std::thread(expirationTimer, this, this->threadIdx);
-        this->threads[this->threadIdx] = false;
-        t.join();
+    this->keepAlive = m->keepAlive;
+    if (this->broker->acls != NULL) {
+        delete this->acl;
+        this->acl = this->broker->acls->compile(m->user, this->ID);
+    }
+    if (this->broker->clientRateLimit.limited()) {
+        this->clientLimiter = std::make_shared<RateLimiter>(this->broker->clientRateLimit);
+    }
+    if (this->broker->userRateLimit.limited() && m->user != NULL && m->user->name.size() > 0) {
+        this->userLimiter = this->broker->userLimiter(m->user->name);
     }
     this->isConnecting = true;
+    this->packetReceived();
     err = this->sendMessage(new ConnackMessage(sessionPresent, CONNECT_ACCEPTED));
     err = this->redelivery();
-    return err;
+    if (err != NO_ERROR) {
+        return err;
+    }
+    return this->drainOffline();
 
 }
 MQTT_ERROR BrokerSideClient::recvConnackMessage(ConnackMessage* m) {return INVALID_MESSAGE_CAME;}
 MQTT_ERROR BrokerSideClient::recvPublishMessage(PublishMessage* m) {
-    if (m->fh->dup) {
-        // re-delivered
-    } else {
-        // first time delivery
+    if (m->fh->qos > 0 && m->fh->packetID == 0) {
+        return PACKET_ID_SHOULD_NOT_BE_ZERO;
     }
-
-    MQTT_ERROR err = NO_ERROR;
-    if (m->fh->retain) {
-        std::string data = m->payload;
-        if (m->fh->qos == 0 && data.size() > 0) {
-            data = "";
-        }
-        err = this->broker->topicRoot->applyRetain(m->topicName, m->fh->qos, data);
-        if (err != NO_ERROR) {
-            return err;
+    TraceTag tag = traceCurrent();
+    if (tag.trace != 0) {
+        tracePoint(TRACE_RECEIVED, tag, m->topicName, m->fh->qos);
+    }
+    if (m->fh->qos == 2 && this->receivedQoS2.isUsed(m->fh->packetID)) {
+        // already routed, only the PUBREC is repeated, not before the original's
+        if (this->broker->publishLog != NULL) {
+            this->broker->publishLog->afterDurable(this->durableAck(2, m->fh->packetID));
+            return NO_ERROR;
         }
+        return this->ackPublish(2, m->fh->packetID);
     }
-    std::vector<TopicNode*> nodes;
-    err = broker->topicRoot->getTopicNode(m->topicName, true, &nodes);
+    // checked on the name, a denied topic must not leave a node in the tree
+    if (this->acl != NULL && !this->acl->canPublish(m->topicName)) {
+        // 3.1.1 cannot refuse a PUBLISH, it is acknowledged and dropped
+        statAdd(STAT_PUBLISHES_DENIED, 1);
+        return m->fh->qos == 0 ? NO_ERROR : this->ackPublish(m->fh->qos, m->fh->packetID);
+    }
+    uint64_t seq = 0;
+    if (m->fh->qos > 0 && this->broker->publishLog != NULL) {
+        seq = ++this->broker->publishSeq;
+    }
+    MQTT_ERROR err = this->broker->publish(m->topicName, m->fh->qos, m->fh->retain, m->payload);
     if (err != NO_ERROR) {
         return err;
     }
-
-    for (std::map<std::string, uint8_t>::iterator it = nodes[0]->subscribers.begin(); it != nodes[0]->subscribers.end(); it++) {
-        if (nodes[0]->subscribers.find(it->first) == nodes[0]->subscribers.end()) {
-            continue;
-        }
-        BrokerSideClient* subscriber = this->broker->clients[it->first];
-        err = this->broker->checkQoSAndPublish(subscriber, m->fh->qos, it->second, false, m->topicName, m->payload);
+    if (seq != 0 && this->broker->sessionStore != NULL) {
+        // whatever routing it queued for sessions is logged ahead of this
+        this->broker->sessionStore->markApplied(seq);
+    }
+    if (m->fh->qos == 2) {
+        this->receivedQoS2.mark(m->fh->packetID);
+        if (this->persistent()) {
+            this->broker->sessionStore->markReceived(this->ID, m->fh->packetID);
         }
-
-    switch (m->fh->qos) {
-    case 0:
+    }
+    if (m->fh->qos == 0) {
         if (m->fh->packetID != 0){
             return PACKET_ID_SHOULD_BE_ZERO;
         }
-        break;
-    case 1:
-        err = this->sendMessage(new PubackMessage(m->fh->packetID));
-        break;
-    case 2:
-        err = this->sendMessage(new PubrecMessage(m->fh->packetID));
-        break;
+        return NO_ERROR;
     }
+    if (this->broker->publishLog != NULL) {
+        // acked once the publish is on disk, along with the rest of its commit window
+        this->broker->publishLog->append(publishRecord(seq, m), this->durableAck(m->fh->qos, m->fh->packetID));
+        return NO_ERROR;
+    }
+    return this->ackPublish(m->fh->qos, m->fh->packetID);
+}
 
-    return err;
+// runs on the publish log committer, the connection may be gone by then.
+// Only the slot table is trusted, the client in it must be this connection
+std::function<void()> BrokerSideClient::durableAck(uint8_t qos, uint16_t packetID) {
+    Broker* broker = this->broker;
+    uint32_t session = this->sessionIndex;
+    uint64_t generation = this->generation;
+    return [broker, session, generation, qos, packetID]{
+        std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+        if (session >= broker->sessions.size()) {
+            return;
+        }
+        BrokerSideClient* bc = broker->sessions[session];
+        if (bc != NULL && bc->generation == generation && bc->isConnecting) {
+            MQTT_ERROR err = bc->ackPublish(qos, packetID);
+            if (err != NO_ERROR) {
+                emitError(err);
+            }
+        }
+    };
+}
+
+MQTT_ERROR BrokerSideClient::ackPublish(uint8_t qos, uint16_t packetID) {
+    if (qos == 1) {
+        return this->sendMessage(new PubackMessage(packetID));
+    }
+    return this->sendMessage(new PubrecMessage(packetID));
 }
 
 
 
 MQTT_ERROR BrokerSideClient::recvPubackMessage(PubackMessage* m) {
     if (m->fh->packetID > 0) {
-        return this->ackMessage(m->fh->packetID);
+        MQTT_ERROR err = this->ackMessage(m->fh->packetID);
+        if (err == NO_ERROR) {
+            err = this->drainOffline();
+        }
+        if (err != NO_ERROR) {
+            return err;
+        }
+        return this->streamRetained();
     }
     return NO_ERROR;
 }
@@ -243,16 +1378,23 @@ MQTT_ERROR BrokerSideClient::recvPubrecMessage(PubrecMessage* m) {
 }
 
 MQTT_ERROR BrokerSideClient::recvPubrelMessage(PubrelMessage* m) {
-    MQTT_ERROR err = this->ackMessage(m->fh->packetID);
-    if (err < 0) {
-        return err;
+    // an unknown id is completed as well, its PUBCOMP may have been lost
+    this->receivedQoS2.release(m->fh->packetID);
+    if (this->persistent()) {
+        this->broker->sessionStore->releaseReceived(this->ID, m->fh->packetID);
     }
-    err = this->sendMessage(new PubcompMessage(m->fh->packetID));
-    return err;
+    return this->sendMessage(new PubcompMessage(m->fh->packetID));
 }
 
 MQTT_ERROR BrokerSideClient::recvPubcompMessage(PubcompMessage* m) {
-    return this->ackMessage(m->fh->packetID);
+    MQTT_ERROR err = this->ackMessage(m->fh->packetID);
+    if (err == NO_ERROR) {
+        err = this->drainOffline();
+    }
+    if (err != NO_ERROR) {
+        return err;
+    }
+    return this->streamRetained();
 }
 
 
@@ -261,29 +1403,144 @@ MQTT_ERROR BrokerSideClient::recvSubscribeMessage(SubscribeMessage* m) {
 
     MQTT_ERROR err; // this sould be duplicate?
     for (std::vector<SubscribeTopic*>::iterator it = m->subTopics.begin(); it != m->subTopics.end(); it++) {
-        std::vector<TopicNode*> nodes;
-        err = this->broker->topicRoot->getTopicNode((*it)->topic, true, &nodes);
+        if (this->acl != NULL && !this->acl->canSubscribe((*it)->topic)) {
+            returnCodes.push_back(FAILURE);
+            continue;
+        }
+        bool shared = false;
+        err = this->broker->subscribe(this->sessionIndex, (*it)->topic, (*it)->qos, &shared);
         SubackCode code = (SubackCode)(*it)->qos;
 
         if (err != NO_ERROR) {
             code = FAILURE;
         } else {
-            for (std::vector<TopicNode*>::iterator nIt = nodes.begin(); nIt != nodes.end(); nIt++) {
-                (*nIt)->subscribers[ID] = (*it)->qos;
-                this->subTopics[(*it)->topic] = (*it)->qos;
-                if ((*nIt)->retainMessage.size() > 0) {
-                    err = this->broker->checkQoSAndPublish(this, (*nIt)->retainQoS, (*it)->qos, true, (*nIt)->fullPath,(*nIt)->retainMessage);
-                    if (err != NO_ERROR) {
-                        return err;
-                    }
-                }
+            this->subTopics[(*it)->topic] = (*it)->qos;
+            if (this->persistent()) {
+                this->broker->sessionStore->subscribe(this->ID, (*it)->topic, (*it)->qos);
+            }
+            // retained messages are not sent for shared subscriptions
+            if (!shared) {
+                this->retainCursors.push_back(RetainCursor((*it)->topic, (*it)->qos));
             }
         }
         returnCodes.push_back(code);
     }
-    return this->sendMessage(new SubackMessage(m->fh->packetID, returnCodes));
+    err = this->sendMessage(new SubackMessage(m->fh->packetID, returnCodes));
+    if (err != NO_ERROR) {
+        return err;
+    }
+    return this->streamRetained();
 }
 
+// sends retained messages for pending subscriptions in batched writes, pausing
+// when retainInflightWindow QoS1/2 messages are unacked; acks resume the stream
+MQTT_ERROR BrokerSideClient::streamRetained() {
+    MQTT_ERROR err = NO_ERROR;
+    if (!this->broker->retains->ready()) {
+        // the retain timer resumes it once the segment is indexed
+        return NO_ERROR;
+    }
+    while (this->retainCursors.size() > 0) {
+        RetainCursor& cursor = this->retainCursors.front();
+        std::vector<RetainedMatch> matches;
+        bool finished = this->broker->retains->scan(cursor.filter, cursor.last, this->broker->retainBatchSize, &matches);
+
+        std::vector<Message*> batch;
+        for (std::vector<RetainedMatch>::iterator it = matches.begin(); it != matches.end(); it++) {
+            uint8_t qos = it->qos < cursor.qos ? it->qos : cursor.qos;
+            uint16_t id = 0;
+            if (qos > 0) {
+                uint32_t inflight = this->inflight.size() + batch.size();
+                if (inflight >= this->broker->retainInflightWindow || inflight >= this->maxInflight) {
+                    finished = false;
+                    break;
+                }
+                err = this->getUsablePacketID(&id);
+                if (err != NO_ERROR) {
+                    finished = false;
+                    break;
+                }
+            }
+            batch.push_back(new PublishMessage(false, qos, true, id, it->topic, it->payload));
+            cursor.last = it->topic;
+        }
+        if (batch.size() > 0) {
+            err = this->sendMessages(batch);
+            if (err != NO_ERROR) {
+                for (std::vector<Message*>::iterator it = batch.begin(); it != batch.end(); it++) {
+                    delete *it;
+                }
+                return err;
+            }
+        }
+        if (finished) {
+            this->retainCursors.pop_front();
+        } else if (batch.size() < matches.size() || batch.size() == 0) {
+            // window is full, wait for acks
+            return NO_ERROR;
+        }
+    }
+    return NO_ERROR;
+}
+
+
+MQTT_ERROR BrokerSideClient::enqueueOffline(Message* m) {
+    std::string wire = messageWire(m);
+    delete m;
+    this->offline.durable = this->persistent();
+    MQTT_ERROR err = this->offline.push(wire);
+    if (err == NO_ERROR && this->persistent()) {
+        this->broker->sessionStore->pushOffline(this->ID, wire);
+    }
+    return err;
+}
+
+// sends the offline backlog in batched writes while the inflight window and the outbox have room
+MQTT_ERROR BrokerSideClient::drainOffline() {
+    while (this->isConnecting && this->offline.size() > 0 && this->pendingPublishes.size() == 0 && !this->backlogged()) {
+        uint32_t room = this->maxInflight > this->inflight.size() ? this->maxInflight - this->inflight.size() : 0;
+        if (room > 65535 - this->packetIDs.size()) {
+            room = 65535 - this->packetIDs.size();
+        }
+        if (room > this->broker->offlineBatchSize) {
+            room = this->broker->offlineBatchSize;
+        }
+        if (room == 0) {
+            // window is full, wait for acks
+            return NO_ERROR;
+        }
+        std::vector<std::string> wires;
+        MQTT_ERROR err = this->offline.pop(room, &wires);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        if (this->persistent()) {
+            this->broker->sessionStore->popOffline(this->ID, wires.size());
+        }
+        std::vector<Message*> batch;
+        for (std::vector<std::string>::iterator it = wires.begin(); it != wires.end(); it++) {
+            err = NO_ERROR;
+            Message* m = parseStoredMessage(*it, err);
+            if (err != NO_ERROR) {
+                delete m;
+                continue;
+            }
+            this->getUsablePacketID(&m->fh->packetID);
+            batch.push_back(m);
+        }
+        if (batch.size() == 0) {
+            continue;
+        }
+        err = this->sendMessages(batch);
+        if (err != NO_ERROR) {
+            for (std::vector<Message*>::iterator it = batch.begin(); it != batch.end(); it++) {
+                delete *it;
+            }
+            return err;
+        }
+    }
+    return NO_ERROR;
+}
 
 MQTT_ERROR BrokerSideClient::recvSubackMessage(SubackMessage* m) {return INVALID_MESSAGE_CAME;}
 
@@ -294,8 +1551,11 @@ MQTT_ERROR BrokerSideClient::recvUnsubscribeMessage(UnsubscribeMessage* m) {
 
     MQTT_ERROR err = NO_ERROR;
     for (std::vector<std::string>::iterator it = m->topics.begin(); it != m->topics.end(); it++) {
-        err = this->broker->topicRoot->deleteSubscriber(this->ID, *it);
+        err = this->broker->unsubscribe(this->sessionIndex, *it);
         this->subTopics.erase(*it);
+        if (this->persistent()) {
+            this->broker->sessionStore->unsubscribe(this->ID, *it);
+        }
     }
 
     err = this->sendMessage(new UnsubackMessage(m->fh->packetID));
@@ -304,17 +1564,8 @@ MQTT_ERROR BrokerSideClient::recvUnsubscribeMessage(UnsubscribeMessage* m) {
 
 MQTT_ERROR BrokerSideClient::recvUnsubackMessage(UnsubackMessage* m) {return INVALID_MESSAGE_CAME;}
 MQTT_ERROR BrokerSideClient::recvPingreqMessage(PingreqMessage* m) {
-    MQTT_ERROR err = this->sendMessage(new PingrespMessage());
-    if (err != NO_ERROR) {
-        return err;
-    }
-    if (this->keepAlive != 0) {
-        this->threads[this->threadIdx++] = true; // got ping;
-        std::thread t = std::thread(expirationTimer, this, this->threadIdx);
-        t.join();
-        this->threads[this->threadIdx] = false;
-    }
-    return NO_ERROR;
+    // the keepalive was already restarted by packetReceived
+    return this->sendMessage(new PingrespMessage());
 
 }
 MQTT_ERROR BrokerSideClient::recvPingrespMessage(PingrespMessage* m) {return INVALID_MESSAGE_CAME;}
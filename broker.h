@@ -4,32 +4,186 @@
 #include "frame.h"
 #include "terminal.h"
 #include "topicTree.h"
+#include "topicSnapshot.h"
+#include "sharedSubscription.h"
+#include "retainStore.h"
+#include "sessionStore.h"
+#include "offlineQueue.h"
+#include "timer.h"
+#include "sessionRegistry.h"
+#include "stats.h"
+#include "metrics.h"
+#include "loopback.h"
+#include "auth.h"
+#include "acl.h"
+#include "rateLimit.h"
+#include <functional>
+#include <list>
 #include <map>
+#include <mutex>
+#include <vector>
 #include <string.h>
 
+const static uint32_t INVALID_SESSION = 0xffffffff;
+
 class BrokerSideClient;
-class Broker {
+class Broker : public SessionLoad {
 public:
-    std::map<std::string, BrokerSideClient*>clients;
+    SessionRegistry clients;
+    std::vector<BrokerSideClient*> sessions; // slot table referenced by TopicNode::subscribers
+    std::vector<uint32_t> freeSessions;
+    std::recursive_mutex mtx; // session state is only touched while this is held
+    TimingWheel* timers; // keepalive and retransmission deadlines of every session
+    uint32_t retransmitInterval; // ms before an unacked QoS1/2 message is resent, 0 disables
     TopicNode* topicRoot;
+    RetainStore* retains;
+    std::string retainStorePath; // retained messages survive restarts when set
+    uint32_t retainBatchSize; // retained messages per write on subscribe
+    uint32_t retainInflightWindow; // QoS1/2 retained messages unacked before the stream pauses
+    uint32_t retainCheckInterval; // ms between checks whether the retained segment needs compaction
+    bool retainsIndexed; // the segment has been indexed and the retained streams waiting for it resumed
+    TimerEntry retainTimer;
+    uint32_t maxInflightPerSession; // further QoS1/2 publishes are queued per session
+    uint64_t offlineMemoryLimit; // bytes of queued messages kept in memory per offline session
+    uint64_t offlineDiskLimit; // bytes spilled to disk per session before messages are dropped
+    std::string offlineSpillDir; // spill segments of persistent sessions stay here across restarts
+    uint32_t offlineBatchSize; // queued messages per write when a session catches up
+    LogFile* publishLog;
+    std::string publishLogPath; // accepted QoS1/2 publishes are fsynced before the ack when set
+    uint32_t publishCommitWindowUs; // extra wait for publishes to share an fsync, those arriving during one always do
+    uint64_t publishLogCheckpointBytes; // the publish log is truncated past this size
+    uint64_t publishSeq; // of the last record in the publish log, kept across checkpoints by the session store
+    SessionStore* sessionStore;
+    std::string sessionStorePath; // cleanSession=false sessions survive restarts when set
+    uint32_t sessionCheckpointInterval; // ms between checks whether the session log needs compaction
+    std::string topicSnapshotPath; // persistent subscriptions are mapped from here on start instead of rebuilt
+    TopicSnapshot* topicSnapshot;
+    TimerEntry checkpointTimer;
+    uint64_t outboundHighWater; // queued bytes per connection above which QoS0 publishes are dropped
+    uint64_t outboundLowWater; // ...until the queue drains below this
+    uint64_t outboundLimit; // queued bytes at which a connection that does not read is closed
+    DropPolicy qos0DropPolicy;
+    uint32_t slowConsumerInterval; // ms between samples of every connection's outbound queue
+    uint32_t slowConsumerThreshold; // ms a queue stays above outboundLowWater before its reader is flagged slow, 0 disables
+    std::string slowConsumerReport; // last payload published on the $SYS list
+    TimerEntry slowConsumerTimer;
+    uint32_t statsInterval; // ms between $SYS statistics updates, 0 disables
+    TimerEntry statsTimer;
+    uint64_t statsPrevious[STAT_COUNT]; // totals at the last update, for the load rates
+    uint32_t statsSampledAt;
+    std::shared_ptr<const BrokerGauges> gauges; // swapped whole by the stats timer, use std::atomic_load
+    std::string metricsAddress;
+    uint16_t metricsPort; // Prometheus /metrics is served here when set, gauges need statsInterval
+    MetricsServer* metrics;
+    std::string passwordFilePath; // CONNECTs must carry a user of this file when set
+    uint32_t authCacheSize; // verification results remembered, 0 hashes every CONNECT
+    bool allowAnonymous; // CONNECTs without a username pass the authenticator
+    Authenticator* authenticator; // owned, NULL lets everyone in, set from passwordFilePath on Start
+    std::string aclFilePath;
+    AclFile* acls; // owned, NULL grants every topic, set from aclFilePath on Start
+    RateLimit clientRateLimit; // per connection
+    RateLimit userRateLimit; // shared by every connection with the same username
+    std::mutex limitersMtx; // userLimiters is used outside mtx
+    std::map<std::string, std::weak_ptr<RateLimiter> > userLimiters;
+    size_t userLimitersSwept; // entries left by the last sweep of expired limiters
+    uint64_t memoryLimit; // bytes held by all sessions before load is shed, 0 disables
+    uint64_t clientMemoryLimit; // bytes one connected session may hold before it is closed, 0 disables
+    uint32_t memoryCheckInterval; // ms between accountings while a limit is set
+    TimerEntry memoryTimer;
+    std::atomic<bool> shedding; // over memoryLimit, QoS0 deliveries and new connections are refused
+    uint64_t memoryHeld; // by all sessions at the last accounting
+    uint64_t dummyClientIDs; // ids handed to clients that connected without one
+    std::atomic<uint64_t> connectionGenerations; // last BrokerSideClient::generation handed out
+    ShareStrategy* shareStrategy; // owned, replace to change how shared groups are balanced
     Broker();
     ~Broker();
     MQTT_ERROR Start();
+    void attach(LoopbackTransport* ct);
+    MQTT_ERROR restoreSessions();
+    MQTT_ERROR checkpointSessions();
+    MQTT_ERROR replayPublishes();
+    MQTT_ERROR checkpoint();
+    MQTT_ERROR publish(const std::string topic, uint8_t qos, bool retain, const std::string payload);
+    uint32_t registerSession(BrokerSideClient* bc);
+    void releaseSession(uint32_t idx);
+    void connectionClosed(BrokerSideClient* bc);
+    void checkSlowConsumers(uint32_t now);
+    void accountMemory();
+    void sampleGauges(uint32_t now);
+    void publishStats(uint32_t now);
+    void setShareStrategy(ShareStrategy* strategy);
+    bool isAvailable(uint32_t session);
+    uint32_t inflightCount(uint32_t session);
+    MQTT_ERROR fanout(TopicNode* node, uint8_t publisherQoS, bool retain, std::string topic, std::string message);
+    MQTT_ERROR subscribe(uint32_t session, const std::string topic, uint8_t qos, bool* shared);
+    MQTT_ERROR unsubscribe(uint32_t session, const std::string topic);
     MQTT_ERROR checkQoSAndPublish(BrokerSideClient* requestClient, uint8_t publisherQoS, uint8_t requestedQoS, bool retain, std::string topic, std::string message);
     void ApplyDummyClientID(std::string* id);
+    ConnectReturnCode authenticate(const User* user);
+    std::shared_ptr<RateLimiter> userLimiter(const std::string name);
+};
+
+struct RetainCursor {
+    RetainCursor(std::string filter, uint8_t qos) : filter(filter), qos(qos), last("") {};
+    std::string filter;
+    uint8_t qos;
+    std::string last; // topic of the last retained message sent
 };
 
 class BrokerSideClient : public Terminal {
+    friend class Broker;
 private:
     Broker* broker;
     std::map<std::string, uint8_t> subTopics;
-    std::thread expirationThread;
-    int threadIdx;
+    std::list<RetainCursor> retainCursors;
+    OfflineQueue offline;
+    TimerEntry keepAliveTimer;
+    TimerEntry retransmitTimer;
+    uint64_t droppedPublishes; // by connections that have ended
+    bool behind; // outbound queue above the low water mark at the last sample
+    uint32_t behindSince;
+    uint32_t sampledAt;
+    uint64_t sampledWritten;
+    uint64_t drainRate; // bytes/s written to the socket between the last two samples
+    bool authChecked; // authCode is the verdict on the CONNECT being dispatched
+    ConnectReturnCode authCode;
+    AclMatcher* acl; // compiled at CONNECT, NULL when the broker has no ACLs
+    std::shared_ptr<RateLimiter> clientLimiter; // set at CONNECT, only used by the reading thread
+    std::shared_ptr<RateLimiter> userLimiter;
+    BrokerSideClient* previous; // registered under the same id before this CONNECT, handed over when it is dispatched
+    bool connectPending; // registered by a CONNECT that has not been dispatched yet
+    bool superseded; // a newer CONNECT with the same id was dispatched before this one
+    uint64_t generation; // unique per connection, a freed one's address may be reused
+    void admitConnect(ConnectMessage* m);
+    BrokerSideClient* takePrevious(const std::string& id);
+    void throttle(uint32_t length);
+    bool backlogged();
+    void keepAliveExpired();
+    void retransmit();
+    bool persistent();
+    void refuseConnect(ConnectReturnCode code);
 public:
-    std::map<int, bool> threads;
+    uint32_t sessionIndex;
+    bool slow; // QoS1/2 deliveries go through the offline queue, drained as fast as it reads
     BrokerSideClient(Transport* ct, Broker* broker);
+    uint64_t dropped();
+    uint64_t memoryHeld; // at the last accounting
+    uint64_t heldBytes();
     ~BrokerSideClient();
     MQTT_ERROR disconnectProcessing();
+    MQTT_ERROR streamRetained();
+    MQTT_ERROR enqueueOffline(Message* m);
+    MQTT_ERROR drainOffline();
+    MQTT_ERROR ackPublish(uint8_t qos, uint16_t packetID);
+    std::function<void()> durableAck(uint8_t qos, uint16_t packetID);
+    void frameReceived(FixedHeader* fh, uint32_t length);
+    void messageDecoded(Message* m);
+    void packetReceived();
+    void inflightAdded();
+    void inflightStored(uint16_t id, Message* m);
+    void inflightRemoved(uint16_t id);
+    void pendingPushed(Message* m);
+    void pendingPopped();
     void setPreviousSession(BrokerSideClient* ps);
     MQTT_ERROR recvConnectMessage(ConnectMessage* m);
     MQTT_ERROR recvConnackMessage(ConnackMessage* m);
@@ -47,6 +201,4 @@ public:
     MQTT_ERROR recvDisconnectMessage(DisconnectMessage* m);
 };
 
-void expirationTimer(BrokerSideClient* bc, int tID);
-
 #endif //MQTT_BROKER_H_
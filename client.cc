@@ -1,14 +1,24 @@
 #include "client.h"
 #include "util.h"
+#include "broker.h"
+#include "loopback.h"
 #include <thread>
 #include <sys/time.h>
 #include "unistd.h"
 
-Client::Client(const std::string id, const User* user, uint16_t keepAlive, const Will* will) : pingDulation(0), Terminal(id, user, keepAlive, will) {}
+Client::Client(const std::string id, const User* user, uint16_t keepAlive, const Will* will) : Terminal(id, user, keepAlive, will), loopbackThread(NULL), pingDulation(0) {}
 
-Client::~Client() {}
+Client::~Client() {
+    if (this->loopbackThread != NULL) {
+        this->ct->shutdown();
+        this->loopbackThread->join();
+        delete this->loopbackThread;
+        delete this->ct;
+    }
+}
 
 MQTT_ERROR Client::ping() {
+    std::unique_lock<std::recursive_mutex> lock = this->lockDispatch();
     MQTT_ERROR err = this->sendMessage(new PingreqMessage());
     gettimeofday(&(this->timeOfPing), NULL);
     return err;
@@ -37,10 +47,55 @@ MQTT_ERROR Client::connect(const std::string addr, int port, bool cs) {
     }
     std::thread t(readLoop, this);
     t.join();
+    close(this->ct->sock);
     this->readThread = &t;
     return err;
 }
 
+// the answer of an in-process broker can arrive before sendMessage has stored
+// what it answers, so sending holds off the loop's dispatch
+std::unique_lock<std::recursive_mutex> Client::lockDispatch() {
+    if (this->dispatchLock == NULL) {
+        return std::unique_lock<std::recursive_mutex>();
+    }
+    return std::unique_lock<std::recursive_mutex>(*this->dispatchLock);
+}
+
+// attaches to a broker in the same process, publish, subscribe and disconnect
+// work as over TCP. Returns once the CONNACK has been handled.
+MQTT_ERROR Client::connect(Broker* broker, bool cs) {
+    if (this->ID.size() == 0 && !cs) {
+        return CLEANSESSION_MUST_BE_TRUE;
+    }
+
+    LoopbackTransport* local = new LoopbackTransport();
+    LoopbackTransport* remote = new LoopbackTransport();
+    LoopbackTransport::connectPair(local, remote);
+    this->ct = local;
+    this->dispatchLock = &this->mtx;
+    this->cleanSession = cs;
+    // nothing between the two ends can go silent, and pingLoop would hold up the CONNACK
+    this->keepAlive = 0;
+    broker->attach(remote);
+    ConnectMessage* m = new ConnectMessage(this->keepAlive, this->ID, this->cleanSession, this->will, this->user);
+    MQTT_ERROR err = this->ct->sendMessage(m);
+    // the will and user belong to this client
+    m->will = NULL;
+    m->user = NULL;
+    delete m;
+    if (err != NO_ERROR) {
+        return err;
+    }
+    Message* connack = local->receive();
+    if (connack == NULL) {
+        return PEER_CLOSED;
+    }
+    err = dispatchMessage(this, connack);
+    delete connack;
+    this->loopbackThread = new std::thread(loopbackLoop, this);
+    return err;
+}
+
 MQTT_ERROR Client::disconnectProcessing() {
     MQTT_ERROR err = NO_ERROR;
     if (this->isConnecting) {
@@ -51,6 +106,7 @@ MQTT_ERROR Client::disconnectProcessing() {
 }
 
 MQTT_ERROR Client::publish(const std::string topic, const std::string data, uint8_t qos, bool retain) {
+    std::unique_lock<std::recursive_mutex> lock = this->lockDispatch();
     if (qos >= 3) {
         return INVALID_QOS_3;
     }
@@ -67,6 +123,7 @@ MQTT_ERROR Client::publish(const std::string topic, const std::string data, uint
 }
 
 MQTT_ERROR Client::subscribe(std::vector<SubscribeTopic*> topics) {
+    std::unique_lock<std::recursive_mutex> lock = this->lockDispatch();
     uint16_t id = 0;
     MQTT_ERROR err = getUsablePacketID(&id);
     if (err != NO_ERROR) {
@@ -86,6 +143,7 @@ MQTT_ERROR Client::subscribe(std::vector<SubscribeTopic*> topics) {
 }
 
 MQTT_ERROR Client::unsubscribe(std::vector<std::string> topics) {
+    std::unique_lock<std::recursive_mutex> lock = this->lockDispatch();
     for (int i = 0; i < topics.size(); i++) {
         std::vector<std::string> parts;
         split(topics[i], "/", &parts);
@@ -106,6 +164,7 @@ MQTT_ERROR Client::unsubscribe(std::vector<std::string> topics) {
 }
 
 MQTT_ERROR Client::disconnect() {
+    std::unique_lock<std::recursive_mutex> lock = this->lockDispatch();
     MQTT_ERROR err = this->sendMessage(new DisconnectMessage());
     // TODO : find out how to use thread
     //std::thread t = std::thread([]{
@@ -119,7 +178,7 @@ MQTT_ERROR Client::recvConnectMessage(ConnectMessage* m) {return INVALID_MESSAGE
 
 MQTT_ERROR Client::recvConnackMessage(ConnackMessage* m) {
     if (m->returnCode != CONNECT_ACCEPTED) {
-        //return m->ReturnCode;
+        return CONNECTION_REFUSED;
     }
 
     this->isConnecting = true;
@@ -153,6 +212,7 @@ MQTT_ERROR Client::recvPublishMessage(PublishMessage* m) {
         return this->sendMessage(new PubackMessage(m->fh->packetID));
         break;
     case 2:
+        this->receivedQoS2.mark(m->fh->packetID);
         return this->sendMessage(new PubrecMessage(m->fh->packetID));
         break;
     }
@@ -176,12 +236,8 @@ MQTT_ERROR Client::recvPubrecMessage(PubrecMessage* m) {
     return err;
 }
 MQTT_ERROR Client::recvPubrelMessage(PubrelMessage* m) {
-    MQTT_ERROR err = this->ackMessage(m->fh->packetID);
-    if (err < 0) {
-        return err;
-    }
-    err = this->sendMessage(new PubcompMessage(m->fh->packetID));
-    return err;
+    this->receivedQoS2.release(m->fh->packetID);
+    return this->sendMessage(new PubcompMessage(m->fh->packetID));
 }
 
 MQTT_ERROR Client::recvPubcompMessage(PubcompMessage* m) {
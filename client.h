@@ -7,9 +7,16 @@
 #include "frame.h"
 #include "transport.h"
 #include "terminal.h"
+#include <mutex>
+#include <thread>
 #include "string"
 
+class Broker;
+
 class Client : public Terminal {
+    std::thread* loopbackThread; // runs loopbackLoop while attached to a broker in this process
+    std::recursive_mutex mtx; // dispatchLock while attached
+    std::unique_lock<std::recursive_mutex> lockDispatch();
 public:
     struct timeval timeOfPing;
     uint32_t pingDulation;
@@ -17,6 +24,7 @@ public:
     ~Client();
     MQTT_ERROR ping();
     MQTT_ERROR connect(const std::string addr, int port, bool cleanSession);
+    MQTT_ERROR connect(Broker* broker, bool cleanSession);
     MQTT_ERROR publish(const std::string topic, const std::string data, uint8_t qos, bool retain);
     MQTT_ERROR subscribe(std::vector<SubscribeTopic*> topics);
     MQTT_ERROR unsubscribe(std::vector<std::string> topics);
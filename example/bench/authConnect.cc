@@ -0,0 +1,110 @@
+// CONNECT throughput with username/password authentication. Every device has
+// its own salted PBKDF2 entry in a password file. The first wave connects
+// with credentials the broker has not seen and pays the hash for each, the
+// second wave is the same fleet reconnecting at once and is answered from the
+// verification cache. A run without an authenticator is the baseline. Each
+// worker stands for a read thread: the credentials are checked before the
+// broker lock is taken and the CONNECT is handled under it, as readLoop does.
+// usage: ./authConnect [devices] [workers] [iterations] [password file]
+#include "../../broker.h"
+#include <chrono>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <stdlib.h>
+#include <unistd.h>
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string deviceID(uint32_t i) {
+    std::stringstream ss;
+    ss << "device" << i;
+    return ss.str();
+}
+
+void storm(Broker* broker, uint32_t devices, uint32_t workers, const char* wave) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    uint32_t refused[64] = {0};
+    for (uint32_t w = 0; w < workers; w++) {
+        threads.push_back(std::thread([broker, devices, workers, w, &refused]{
+            // CONNACKs go nowhere
+            Transport* ct = new Transport(open("/dev/null", O_WRONLY), NULL);
+            for (uint32_t i = w; i < devices; i += workers) {
+                std::string id = deviceID(i);
+                ConnectMessage* m = new ConnectMessage(60, id, true, NULL, new User(id, "pw-" + id));
+                BrokerSideClient* bc = new BrokerSideClient(ct, broker);
+                bc->messageDecoded(m);
+                std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+                if (bc->recvConnectMessage(m) != NO_ERROR) {
+                    refused[w]++;
+                }
+            }
+        }));
+    }
+    uint32_t failed = 0;
+    for (uint32_t w = 0; w < workers; w++) {
+        threads[w].join();
+        failed += refused[w];
+    }
+    double took = since(start);
+    std::cout << wave << "\t" << devices << " CONNECTs\t" << took << " s\t" << (uint64_t)(devices / took) << " CONNECT/s";
+    if (failed > 0) {
+        std::cout << "\t" << failed << " refused";
+    }
+    std::cout << std::endl;
+}
+
+int main(int argc, char** argv) {
+    uint32_t devices = argc > 1 ? atoi(argv[1]) : 10000;
+    uint32_t workers = argc > 2 ? atoi(argv[2]) : 8;
+    uint32_t iterations = argc > 3 ? atoi(argv[3]) : 1000;
+    std::string path = argc > 4 ? argv[4] : "/tmp/mqttcc_auth_bench.passwd";
+    if (workers > 64) {
+        workers = 64;
+    }
+    {
+        // hashing the entries costs what the first wave does, spread it the same way
+        std::vector<std::string> lines(devices);
+        std::vector<std::thread> threads;
+        for (uint32_t w = 0; w < workers; w++) {
+            threads.push_back(std::thread([&lines, devices, workers, iterations, w]{
+                for (uint32_t i = w; i < devices; i += workers) {
+                    std::string id = deviceID(i);
+                    lines[i] = PasswordFile::entry(id, "pw-" + id, iterations);
+                }
+            }));
+        }
+        for (uint32_t w = 0; w < workers; w++) {
+            threads[w].join();
+        }
+        std::ofstream f(path.c_str(), std::ios::out | std::ios::trunc);
+        for (uint32_t i = 0; i < devices; i++) {
+            f << lines[i] << "\n";
+        }
+    }
+
+    Broker anonymous;
+    anonymous.timers->start();
+    storm(&anonymous, devices, workers, "no auth");
+
+    Broker broker;
+    PasswordFile* passwords = new PasswordFile();
+    if (passwords->load(path) != NO_ERROR) {
+        std::cout << "cannot load " << path << std::endl;
+        return 1;
+    }
+    AuthCache* cache = new AuthCache(passwords, devices);
+    broker.authenticator = cache;
+    broker.timers->start();
+    storm(&broker, devices, workers, "cold");
+    storm(&broker, devices, workers, "cached");
+    std::cout << "cache\t" << cache->hits() << " hits\t" << cache->misses() << " misses" << std::endl;
+
+    unlink(path.c_str());
+    _exit(0);
+}
@@ -0,0 +1,80 @@
+// CONNECT throughput while every device of a fleet reconnects at once.
+// The sessions are restored from the session log first, like after a broker
+// restart. The first wave resumes them, the second wave connects again while
+// they are still online and takes every one of them over. Each worker stands
+// for a read thread and hands its CONNECTs over as readLoop does: the client id
+// is taken over in the registry first, only the dispatch holds the broker lock.
+// usage: ./connectStorm [devices] [workers] [log path]
+#include "../../broker.h"
+#include <chrono>
+#include <fcntl.h>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <stdlib.h>
+#include <unistd.h>
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::string deviceID(uint32_t i) {
+    std::stringstream ss;
+    ss << "device" << i;
+    return ss.str();
+}
+
+void storm(Broker* broker, uint32_t devices, uint32_t workers, const char* wave) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (uint32_t w = 0; w < workers; w++) {
+        threads.push_back(std::thread([broker, devices, workers, w]{
+            // CONNACKs go nowhere
+            Transport* ct = new Transport(open("/dev/null", O_WRONLY), NULL);
+            for (uint32_t i = w; i < devices; i += workers) {
+                ConnectMessage* m = new ConnectMessage(60, deviceID(i), false, NULL, NULL);
+                BrokerSideClient* bc = new BrokerSideClient(ct, broker);
+                bc->messageDecoded(m);
+                std::lock_guard<std::recursive_mutex> lock(broker->mtx);
+                bc->recvConnectMessage(m);
+            }
+        }));
+    }
+    for (uint32_t w = 0; w < workers; w++) {
+        threads[w].join();
+    }
+    double took = since(start);
+    std::cout << wave << "\t" << devices << " CONNECTs\t" << took << " s\t" << (uint64_t)(devices / took) << " CONNECT/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    uint32_t devices = argc > 1 ? atoi(argv[1]) : 100000;
+    uint32_t workers = argc > 2 ? atoi(argv[2]) : 8;
+    std::string path = argc > 3 ? argv[3] : "/tmp/mqttcc_storm_bench.log";
+    unlink(path.c_str());
+    {
+        SessionStore store(2000);
+        if (store.open(path) != NO_ERROR) {
+            std::cout << "cannot open " << path << std::endl;
+            return 1;
+        }
+        for (uint32_t i = 0; i < devices; i++) {
+            std::string id = deviceID(i);
+            store.putSession(id);
+            store.subscribe(id, "fleet/" + id + "/cmd", 1);
+        }
+    }
+
+    Broker broker;
+    broker.sessionStorePath = path;
+    if (broker.restoreSessions() != NO_ERROR) {
+        std::cout << "restore failed" << std::endl;
+        return 1;
+    }
+    broker.timers->start();
+    storm(&broker, devices, workers, "resume");
+    storm(&broker, devices, workers, "takeover");
+
+    unlink(path.c_str());
+    _exit(0);
+}
@@ -0,0 +1,67 @@
+// Turnaround of control packets queued behind a stream of large publishes.
+// A reader drains the socket at a fixed rate while the outbox is kept full of
+// QoS1 publishes, and a PUBACK is queued every millisecond.
+// usage: ./controlLatency [payload bytes] [reader KB/s] [seconds]
+#include "../../outbox.h"
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    uint32_t payload = argc > 1 ? atoi(argv[1]) : 64 * 1024;
+    uint64_t rate = (argc > 2 ? atoi(argv[2]) : 20 * 1024) * 1024;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    std::atomic<bool> running(true);
+    std::thread reader([&]{
+        char buf[16 * 1024];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        uint64_t got = 0;
+        while (running) {
+            ssize_t n = recv(fds[1], buf, sizeof(buf), MSG_DONTWAIT);
+            if (n > 0) {
+                got += n;
+            }
+            double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (got > elapsed * rate || n <= 0) {
+                usleep(1000);
+            }
+        }
+    });
+
+    std::string frame(payload, '\0');
+    frame[0] = 0x32;
+    uint8_t puback[4] = {0x40, 0x02, 0x00, 0x01};
+    uint64_t published = 0;
+    LatencyStats stats;
+    {
+        Outbox out(fds[0], 1024 * 1024, 256 * 1024, 64 * 1024 * 1024, DROP_NEWEST);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        while (std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() < seconds) {
+            while (out.bytes() < 4 * 1024 * 1024) {
+                out.push((const uint8_t*)frame.data(), frame.size(), false);
+                published++;
+            }
+            out.push(puback, sizeof(puback), false);
+            usleep(1000);
+        }
+        stats = out.controlLatency();
+        running = false;
+    }
+    reader.join();
+    std::cout << "payload " << payload << " B, reader " << rate / 1024 << " KB/s, " << published << " publishes queued" << std::endl;
+    std::cout << "control turnaround\t" << stats.count << " packets\tavg " << (stats.count > 0 ? stats.totalUs / stats.count : 0) << " us\tmax " << stats.maxUs << " us" << std::endl;
+    close(fds[0]);
+    close(fds[1]);
+    return 0;
+}
@@ -0,0 +1,58 @@
+// Packet ID allocation at high inflight occupancy: the bitmap pool against
+// the previous random draw with 5 retries over the inflight map.
+#include "../../packetID.h"
+#include <chrono>
+#include <iostream>
+#include <map>
+#include <random>
+
+const static int ROUNDS = 1000000;
+
+int main() {
+    double occupancies[] = {0.5, 0.9, 0.99, 0.999};
+    for (int o = 0; o < 4; o++) {
+        uint32_t target = (uint32_t)(65535 * occupancies[o]);
+
+        PacketIDPool pool;
+        uint16_t id;
+        for (uint32_t i = 0; i < target; i++) {
+            pool.acquire(&id);
+        }
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        int failures = 0;
+        for (int i = 0; i < ROUNDS; i++) {
+            if (!pool.acquire(&id)) {
+                failures++;
+                continue;
+            }
+            pool.release(id);
+        }
+        double poolNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ROUNDS;
+
+        std::mt19937 mt;
+        std::uniform_int_distribution<> randPacketID(1, 65535);
+        std::map<uint16_t, bool> inflight;
+        while (inflight.size() < target) {
+            inflight[randPacketID(mt)] = true;
+        }
+        start = std::chrono::steady_clock::now();
+        int randFailures = 0;
+        for (int i = 0; i < ROUNDS; i++) {
+            bool exists = true;
+            for (int trial = 0; exists; trial++) {
+                if (trial == 5) {
+                    randFailures++;
+                    break;
+                }
+                id = randPacketID(mt);
+                exists = inflight.find(id) != inflight.end();
+            }
+        }
+        double randNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / ROUNDS;
+
+        std::cout << "occupancy=" << occupancies[o] * 100 << "%"
+                  << "\tpool " << poolNs << " ns/op, " << failures << " failures"
+                  << "\trandom " << randNs << " ns/op, " << randFailures << " failures" << std::endl;
+    }
+    return 0;
+}
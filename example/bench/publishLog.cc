@@ -0,0 +1,64 @@
+// Acked QoS1 publishes per second through the publish log, by commit window.
+// Every client waits for its PUBACK before the next publish, like a client
+// with an inflight window of one.
+// The first row is a single client, which pays one fsync per publish.
+// usage: ./publishLog [clients] [seconds] [log path]
+#include "../../logFile.h"
+#include "../../sessionStore.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdlib.h>
+#include <unistd.h>
+
+int main(int argc, char** argv) {
+    uint32_t clients = argc > 1 ? atoi(argv[1]) : 64;
+    double seconds = argc > 2 ? atof(argv[2]) : 2;
+    std::string path = argc > 3 ? argv[3] : "/tmp/mqttcc_publish_bench.log";
+    uint32_t windows[] = {0, 0, 100, 500, 1000, 2000, 5000};
+
+    PublishMessage m(false, 1, false, 1, "fleet/42/telemetry", std::string(200, 'x'));
+    std::string wire = messageWire(&m);
+    for (uint32_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+        unlink(path.c_str());
+        LogFile log(windows[w]);
+        if (log.open(path) != NO_ERROR) {
+            std::cout << "cannot open " << path << std::endl;
+            return 1;
+        }
+        std::atomic<bool> running(true);
+        std::atomic<uint64_t> acked(0);
+        std::vector<std::thread> threads;
+        uint32_t n = w == 0 ? 1 : clients;
+        for (uint32_t c = 0; c < n; c++) {
+            threads.push_back(std::thread([&]{
+                std::mutex mtx;
+                std::condition_variable cv;
+                while (running) {
+                    bool done = false;
+                    log.append(wire, [&]{
+                        std::lock_guard<std::mutex> lock(mtx);
+                        done = true;
+                        cv.notify_one();
+                    });
+                    std::unique_lock<std::mutex> lock(mtx);
+                    cv.wait(lock, [&]{return done;});
+                    acked++;
+                }
+            }));
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        running = false;
+        for (uint32_t c = 0; c < n; c++) {
+            threads[c].join();
+        }
+        std::cout << n << " clients, window " << windows[w] << " us\t" << (uint64_t)(acked / seconds) << " acked publishes/s" << std::endl;
+        log.close();
+    }
+    unlink(path.c_str());
+    return 0;
+}
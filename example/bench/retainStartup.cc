@@ -0,0 +1,60 @@
+// Restart time of a persistent retained store.
+// usage: ./retainStartup [topics] [segment path]
+#include "../../retainStore.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    uint64_t topics = argc > 1 ? strtoull(argv[1], NULL, 10) : 10000000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/mqttcc_retain_bench.seg";
+    unlink(path.c_str());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        RetainStore store;
+        if (store.open(path) != NO_ERROR) {
+            std::cout << "cannot open " << path << std::endl;
+            return 1;
+        }
+        for (uint64_t i = 0; i < topics; i++) {
+            std::stringstream ss;
+            ss << "fleet/" << i / 1000 << "/device" << i;
+            store.apply(ss.str(), 1, "{\"temp\":21.5,\"status\":\"ok\"}");
+        }
+    }
+    std::cout << "populate\t" << topics << " topics\t" << since(start) << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    RetainStore store;
+    store.open(path);
+    std::cout << "open (mmap)\t" << since(start) * 1000 << " ms" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    store.apply("fleet/new/device", 1, "{\"temp\":21.5,\"status\":\"ok\"}");
+    std::cout << "publish while indexing\t" << since(start) * 1000 << " ms" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    while (!store.ready()) {
+        usleep(1000);
+    }
+    std::cout << "background index\t" << since(start) << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    store.find("fleet/0/device0");
+    std::cout << "first lookup\t" << since(start) * 1000 << " ms" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    std::vector<RetainedMatch> matches;
+    store.scan("fleet/42/#", "", 100000, &matches);
+    std::cout << "scan fleet/42/# (" << matches.size() << " matches)\t" << since(start) * 1000 << " ms" << std::endl;
+
+    unlink(path.c_str());
+    return 0;
+}
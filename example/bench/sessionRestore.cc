@@ -0,0 +1,56 @@
+// Restart time of persistent sessions.
+// usage: ./sessionRestore [sessions] [log path]
+#include "../../broker.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    uint64_t sessions = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/mqttcc_session_bench.log";
+    unlink(path.c_str());
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        SessionStore store(2000);
+        if (store.open(path) != NO_ERROR) {
+            std::cout << "cannot open " << path << std::endl;
+            return 1;
+        }
+        for (uint64_t i = 0; i < sessions; i++) {
+            std::stringstream ss;
+            ss << "device" << i;
+            std::string id = ss.str();
+            store.putSession(id);
+            store.subscribe(id, "fleet/" + id + "/cmd", 1);
+            store.subscribe(id, "fleet/broadcast", 0);
+            if (i % 10 == 0) {
+                PublishMessage m(false, 1, false, 1, "fleet/" + id + "/cmd", "reboot");
+                store.storeInflight(id, 1, &m);
+            }
+        }
+    }
+    std::cout << "populate\t" << sessions << " sessions\t" << since(start) << " s" << std::endl;
+
+    start = std::chrono::steady_clock::now();
+    Broker broker;
+    broker.sessionStorePath = path;
+    if (broker.restoreSessions() != NO_ERROR || broker.checkpointSessions() != NO_ERROR) {
+        std::cout << "restore failed" << std::endl;
+        return 1;
+    }
+    std::cout << "restore + compaction\t" << broker.clients.size() << " sessions\t" << since(start) << " s" << std::endl;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << "peak rss\t" << usage.ru_maxrss / 1024 << " MB" << std::endl;
+
+    unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Consumer throughput of one shared group as members are added.
+// Every consumer waits the same fixed time per message (an I/O bound
+// worker), so throughput should grow close to linearly with the group size.
+#include "../../sharedSubscription.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+const static int MESSAGES = 10000;
+const static int WORK_US = 50;
+
+struct Consumer {
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::string> queue;
+    std::atomic<uint32_t> depth;
+    bool done;
+    Consumer() : depth(0), done(false) {};
+};
+
+class BenchLoad : public SessionLoad {
+public:
+    std::vector<Consumer*>* consumers;
+    bool isAvailable(uint32_t session) {return true;};
+    uint32_t inflightCount(uint32_t session) {return (*consumers)[session]->depth;};
+};
+
+void consume(Consumer* c) {
+    while (true) {
+        std::unique_lock<std::mutex> lock(c->mtx);
+        c->cv.wait(lock, [c]{return c->done || c->queue.size() > 0;});
+        if (c->queue.size() == 0) {
+            return;
+        }
+        c->queue.pop_front();
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::microseconds(WORK_US));
+        c->depth--;
+    }
+}
+
+double run(int groupSize, ShareStrategy* strategy) {
+    SharedGroup g("workers");
+    std::vector<Consumer*> consumers;
+    std::vector<std::thread> threads;
+    BenchLoad load;
+    load.consumers = &consumers;
+    for (int i = 0; i < groupSize; i++) {
+        consumers.push_back(new Consumer());
+        g.setMember(i, 1);
+    }
+    for (int i = 0; i < groupSize; i++) {
+        threads.push_back(std::thread(consume, consumers[i]));
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < MESSAGES; i++) {
+        std::stringstream ss;
+        ss << "fleet/device" << i % 1024;
+        const Subscriber* s = g.pick(ss.str(), strategy, &load);
+        Consumer* c = consumers[s->session];
+        c->depth++;
+        std::lock_guard<std::mutex> lock(c->mtx);
+        c->queue.push_back(ss.str());
+        c->cv.notify_one();
+    }
+    for (int i = 0; i < groupSize; i++) {
+        {
+            std::lock_guard<std::mutex> lock(consumers[i]->mtx);
+            consumers[i]->done = true;
+        }
+        consumers[i]->cv.notify_one();
+        threads[i].join();
+        delete consumers[i];
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return MESSAGES / sec;
+}
+
+int main() {
+    RoundRobinStrategy rr;
+    LeastInflightStrategy li;
+    StickyHashStrategy sh;
+    ShareStrategy* strategies[] = {&rr, &li, &sh};
+    const char* names[] = {"round-robin", "least-inflight", "sticky-hash"};
+    int sizes[] = {1, 2, 4, 8};
+    for (int s = 0; s < 3; s++) {
+        for (int i = 0; i < 4; i++) {
+            std::cout << names[s] << "\tgroup=" << sizes[i] << "\t" << (uint64_t)run(sizes[i], strategies[s]) << " msg/s" << std::endl;
+        }
+    }
+    return 0;
+}
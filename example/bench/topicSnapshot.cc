@@ -0,0 +1,86 @@
+// Startup time of persistent sessions with and without a topic tree snapshot.
+// usage: ./topicSnapshot [sessions] [log path] [snapshot path]
+#include "../../broker.h"
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <stdlib.h>
+#include <unistd.h>
+
+double since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main(int argc, char** argv) {
+    uint64_t sessions = argc > 1 ? strtoull(argv[1], NULL, 10) : 200000;
+    std::string path = argc > 2 ? argv[2] : "/tmp/mqttcc_snapshot_bench.log";
+    std::string snapshotPath = argc > 3 ? argv[3] : "/tmp/mqttcc_snapshot_bench.tree";
+    unlink(path.c_str());
+    unlink(snapshotPath.c_str());
+
+    {
+        SessionStore store(2000);
+        if (store.open(path) != NO_ERROR) {
+            std::cout << "cannot open " << path << std::endl;
+            return 1;
+        }
+        for (uint64_t i = 0; i < sessions; i++) {
+            std::stringstream ss;
+            ss << "device" << i;
+            std::string id = ss.str();
+            store.putSession(id);
+            store.subscribe(id, "fleet/" + id + "/cmd", 1);
+            store.subscribe(id, "fleet/broadcast", 0);
+        }
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    {
+        Broker broker;
+        broker.sessionStorePath = path;
+        if (broker.restoreSessions() != NO_ERROR) {
+            std::cout << "restore failed" << std::endl;
+            return 1;
+        }
+        std::cout << "restore, rebuilt tree\t" << broker.clients.size() << " sessions\t" << since(start) << " s" << std::endl;
+
+        broker.topicSnapshotPath = snapshotPath;
+        start = std::chrono::steady_clock::now();
+        if (broker.checkpoint() != NO_ERROR) {
+            std::cout << "checkpoint failed" << std::endl;
+            return 1;
+        }
+        std::cout << "checkpoint with snapshot\t" << since(start) << " s" << std::endl;
+    }
+
+    start = std::chrono::steady_clock::now();
+    {
+        Broker broker;
+        broker.sessionStorePath = path;
+        broker.topicSnapshotPath = snapshotPath;
+        if (broker.restoreSessions() != NO_ERROR) {
+            std::cout << "restore failed" << std::endl;
+            return 1;
+        }
+        std::cout << "restore, mapped tree\t" << broker.clients.size() << " sessions\t" << since(start) << " s" << std::endl;
+    }
+
+    start = std::chrono::steady_clock::now();
+    TopicSnapshot snapshot;
+    TopicNode* root = NULL;
+    std::vector<SnapshotSession> table;
+    if (snapshot.open(snapshotPath, &root, &table) != NO_ERROR) {
+        std::cout << "snapshot open failed" << std::endl;
+        return 1;
+    }
+    std::cout << "snapshot open\t" << table.size() << " sessions\t" << since(start) << " s" << std::endl;
+    start = std::chrono::steady_clock::now();
+    std::vector<TopicNode*> nodes;
+    root->getTopicNode("fleet/device0/cmd", false, &nodes);
+    std::cout << "first lookup\t" << nodes.size() << " nodes\t" << since(start) * 1000000 << " us" << std::endl;
+    delete root;
+
+    unlink(path.c_str());
+    unlink(snapshotPath.c_str());
+    return 0;
+}
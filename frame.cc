@@ -70,7 +70,6 @@ Message::~Message() {
 
 ConnectMessage::ConnectMessage(uint16_t keepAlive, std::string id, bool cleanSession, const struct Will* w, const struct User* u) :
     keepAlive(keepAlive), clientID(id), cleanSession(cleanSession), will(w), user(u), flags(0), protocol(MQTT_3_1_1), Message(new FixedHeader(CONNECT_MESSAGE_TYPE, false, 0, false, 0, 0)) {
-    std::cout << "will qos:" << this->will->qos << std::endl;
     uint32_t length = 6 + protocol.name.size() + 2 + id.size();
     if (this->cleanSession) {
         this->flags |= CLEANSESSION_FLAG;
@@ -218,7 +217,13 @@ std::string ConnectMessage::flagString() {
 
 std::string ConnectMessage::getString() {
     std::stringstream ss;
-    ss << this->fh->getString() << "Protocol=" << protocol.name << ":" << unsigned(protocol.level) << ", Flags=\n" << flagString() << "\t, KeepAlive=" << keepAlive << ", ClientID=" << clientID << ", Will={" << this->will->topic << ":" << this->will->message << ", retain=" << this->will->retain << ", QoS=" << unsigned(this->will->qos) << "}, UserInfo={" << this->user->name << ":" << this->user->passwd << "}";
+    ss << this->fh->getString() << "Protocol=" << protocol.name << ":" << unsigned(protocol.level) << ", Flags=\n" << flagString() << "\t, KeepAlive=" << keepAlive << ", ClientID=" << clientID;
+    if (this->will != NULL) {
+        ss << ", Will={" << this->will->topic << ":" << this->will->message << ", retain=" << this->will->retain << ", QoS=" << unsigned(this->will->qos) << "}";
+    }
+    if (this->user != NULL) {
+        ss << ", UserInfo={" << this->user->name << ":" << this->user->passwd << "}";
+    }
     return ss.str();
 }
 
@@ -269,6 +274,7 @@ int64_t PublishMessage::getWire(uint8_t* wire) {
     }
     buf += len;
     len = UTF8_encode(buf, this->topicName);
+    buf += len;
     if (this->fh->qos > 0) {
         *(buf++) = (uint8_t)(this->fh->packetID >> 8);
         *(buf++) = (uint8_t)this->fh->packetID;
@@ -284,7 +290,7 @@ int64_t PublishMessage::parse(const uint8_t* wire, MQTT_ERROR& err) {
     int64_t len = UTF8_decode(buf, &(this->topicName));
     buf += len;
 
-    if (this->topicName.find('#') == std::string::npos || this->topicName.find('+') == std::string::npos) {
+    if (this->topicName.find('#') != std::string::npos || this->topicName.find('+') != std::string::npos) {
         err = WILDCARD_CHARACTERS_IN_PUBLISH;
         return -1;
     }
@@ -294,7 +300,7 @@ int64_t PublishMessage::parse(const uint8_t* wire, MQTT_ERROR& err) {
         this->fh->packetID = ((uint16_t)*(buf++) << 8);
         this->fh->packetID |= *(buf++);
     }
-    int payloadLen = this->fh->length - (buf - wire - len);
+    int payloadLen = this->fh->length - (buf - wire);
     this->payload = std::string(buf, buf+payloadLen);
 
     return buf - wire;
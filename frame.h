@@ -104,7 +104,7 @@ public:
     uint32_t length;
     uint16_t packetID;
     FixedHeader(MessageType type, bool dup, uint8_t qos, bool retain, uint32_t length, uint16_t id);
-    FixedHeader() {};
+    FixedHeader() : packetID(0) {};
     ~FixedHeader() {};
     int64_t getWire(uint8_t* wire);
     std::string getString();
@@ -132,7 +132,7 @@ public:
     struct MQTT_VERSION protocol;
 
     ConnectMessage(uint16_t keepAlive, std::string id, bool cleanSession, const struct Will* will, const struct User* user);
-    ConnectMessage(FixedHeader* fh, const uint8_t* wire, MQTT_ERROR& err) : Message(fh) {this->parse(wire, err);};
+    ConnectMessage(FixedHeader* fh, const uint8_t* wire, MQTT_ERROR& err) : Message(fh), will(NULL), user(NULL) {this->parse(wire, err);};
     ~ConnectMessage();
     int64_t getWire(uint8_t* wire);
     std::string flagString();
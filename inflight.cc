@@ -0,0 +1,169 @@
+#include "inflight.h"
+#include <string.h>
+
+InflightWindow::InflightWindow() : dir(NULL), head(0), tail(0), count(0) {}
+
+InflightWindow::InflightWindow(const InflightWindow& w) : dir(NULL), head(0), tail(0), count(0) {
+    *this = w;
+}
+
+InflightWindow& InflightWindow::operator=(const InflightWindow& w) {
+    if (this == &w) {
+        return *this;
+    }
+    if (w.dir == NULL) {
+        this->freePages();
+    } else {
+        if (this->dir == NULL) {
+            this->dir = new Directory();
+            memset(this->dir, 0, sizeof(Directory));
+        }
+        for (int i = 0; i < 256; i++) {
+            if (w.dir->pages[i] == NULL) {
+                delete[] this->dir->pages[i];
+                this->dir->pages[i] = NULL;
+                continue;
+            }
+            if (this->dir->pages[i] == NULL) {
+                this->dir->pages[i] = new Slot[256];
+            }
+            memcpy(this->dir->pages[i], w.dir->pages[i], sizeof(Slot) * 256);
+        }
+        memcpy(this->dir->used, w.dir->used, sizeof(this->dir->used));
+    }
+    this->head = w.head;
+    this->tail = w.tail;
+    this->count = w.count;
+    return *this;
+}
+
+InflightWindow::~InflightWindow() {
+    this->freePages();
+}
+
+void InflightWindow::freePages() {
+    if (this->dir == NULL) {
+        return;
+    }
+    for (int i = 0; i < 256; i++) {
+        delete[] this->dir->pages[i];
+    }
+    delete this->dir;
+    this->dir = NULL;
+}
+
+InflightWindow::Slot* InflightWindow::slot(uint16_t id) {
+    if (this->dir == NULL || this->dir->pages[id >> 8] == NULL) {
+        return NULL;
+    }
+    return &this->dir->pages[id >> 8][id & 0xff];
+}
+
+Message* InflightWindow::find(uint16_t id) {
+    Slot* s = this->slot(id);
+    if (s == NULL) {
+        return NULL;
+    }
+    return s->m;
+}
+
+bool InflightWindow::insert(uint16_t id, Message* m, uint32_t stamp) {
+    if (id == 0 || m == NULL) {
+        return false;
+    }
+    if (this->dir == NULL) {
+        this->dir = new Directory();
+        memset(this->dir, 0, sizeof(Directory));
+    }
+    Slot* page = this->dir->pages[id >> 8];
+    if (page == NULL) {
+        page = new Slot[256];
+        memset(page, 0, sizeof(Slot) * 256);
+        this->dir->pages[id >> 8] = page;
+    }
+    Slot* s = &page[id & 0xff];
+    if (s->m != NULL) {
+        return false;
+    }
+    s->m = m;
+    s->stamp = stamp;
+    s->prev = this->tail;
+    s->next = 0;
+    if (this->tail != 0) {
+        this->slot(this->tail)->next = id;
+    } else {
+        this->head = id;
+    }
+    this->tail = id;
+    this->dir->used[id >> 8]++;
+    this->count++;
+    return true;
+}
+
+Message* InflightWindow::remove(uint16_t id) {
+    Slot* s = this->slot(id);
+    if (s == NULL || s->m == NULL) {
+        return NULL;
+    }
+    Message* m = s->m;
+    if (s->prev != 0) {
+        this->slot(s->prev)->next = s->next;
+    } else {
+        this->head = s->next;
+    }
+    if (s->next != 0) {
+        this->slot(s->next)->prev = s->prev;
+    } else {
+        this->tail = s->prev;
+    }
+    s->m = NULL;
+    this->count--;
+    if (--this->dir->used[id >> 8] == 0) {
+        delete[] this->dir->pages[id >> 8];
+        this->dir->pages[id >> 8] = NULL;
+    }
+    if (this->count == 0) {
+        delete this->dir;
+        this->dir = NULL;
+    }
+    return m;
+}
+
+uint32_t InflightWindow::stampOf(uint16_t id) {
+    Slot* s = this->slot(id);
+    if (s == NULL || s->m == NULL) {
+        return 0;
+    }
+    return s->stamp;
+}
+
+// marks the message as sent again, which moves it to the end of the send order
+void InflightWindow::touch(uint16_t id, uint32_t stamp) {
+    Message* m = this->find(id);
+    if (m == NULL) {
+        return;
+    }
+    // keep the page alive while the slot is relinked
+    this->dir->used[id >> 8]++;
+    this->count++;
+    this->remove(id);
+    this->insert(id, m, stamp);
+    this->dir->used[id >> 8]--;
+    this->count--;
+}
+
+uint32_t InflightWindow::size() {
+    return this->count;
+}
+
+uint16_t InflightWindow::first() {
+    return this->head;
+}
+
+uint16_t InflightWindow::next(uint16_t id) {
+    Slot* s = this->slot(id);
+    if (s == NULL || s->m == NULL) {
+        return 0;
+    }
+    return s->next;
+}
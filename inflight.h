@@ -0,0 +1,42 @@
+#ifndef MQTT_INFLIGHT_H_
+#define MQTT_INFLIGHT_H_
+
+#include "frame.h"
+#include <stdint.h>
+
+// unacknowledged messages indexed directly by packet id. Slots live in 256 entry
+// pages allocated on first use, and are linked in send order for redelivery.
+// An idle window holds no pages at all. id 0 is never inflight and terminates iteration.
+class InflightWindow {
+    struct Slot {
+        Message* m;
+        uint32_t stamp; // when it was last sent, in ms
+        uint16_t prev;
+        uint16_t next;
+    };
+    struct Directory {
+        Slot* pages[256];
+        uint16_t used[256];
+    };
+    Directory* dir;
+    uint16_t head;
+    uint16_t tail;
+    uint32_t count;
+    Slot* slot(uint16_t id);
+    void freePages();
+public:
+    InflightWindow();
+    InflightWindow(const InflightWindow& w);
+    InflightWindow& operator=(const InflightWindow& w);
+    ~InflightWindow();
+    Message* find(uint16_t id);
+    bool insert(uint16_t id, Message* m, uint32_t stamp);
+    Message* remove(uint16_t id);
+    uint32_t stampOf(uint16_t id);
+    void touch(uint16_t id, uint32_t stamp);
+    uint32_t size();
+    uint16_t first();
+    uint16_t next(uint16_t id);
+};
+
+#endif // MQTT_INFLIGHT_H_
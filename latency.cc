@@ -0,0 +1,184 @@
+#include "latency.h"
+#include "util.h"
+#include <mutex>
+#include <vector>
+
+LatencyHistogram::LatencyHistogram() {
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        this->counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+uint32_t LatencyHistogram::bucketOf(uint64_t ns) {
+    if (ns >= (1ULL << LATENCY_MAX_BITS)) {
+        ns = (1ULL << LATENCY_MAX_BITS) - 1;
+    }
+    if (ns < (1 << LATENCY_SUB_BITS)) {
+        return ns;
+    }
+    uint32_t shift = 63 - __builtin_clzll(ns) - (LATENCY_SUB_BITS - 1);
+    return (1 << LATENCY_SUB_BITS) + (shift - 1) * (1 << (LATENCY_SUB_BITS - 1)) + (ns >> shift) - (1 << (LATENCY_SUB_BITS - 1));
+}
+
+// the highest value that falls in the bucket
+uint64_t LatencyHistogram::bucketValue(uint32_t idx) {
+    if (idx < (1 << LATENCY_SUB_BITS)) {
+        return idx;
+    }
+    uint32_t half = 1 << (LATENCY_SUB_BITS - 1);
+    uint32_t shift = (idx - (1 << LATENCY_SUB_BITS)) / half + 1;
+    uint64_t sub = (idx - (1 << LATENCY_SUB_BITS)) % half + half;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::merge(const LatencyHistogram* h) {
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        uint64_t n = h->counts[i].load(std::memory_order_relaxed);
+        if (n > 0) {
+            this->counts[i].store(this->counts[i].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+    }
+}
+
+uint64_t LatencyHistogram::count() {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        total += this->counts[i].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+uint64_t LatencyHistogram::percentile(double p) {
+    uint64_t total = this->count();
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p / 100 * total + 0.5);
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += this->counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank) {
+            return bucketValue(i);
+        }
+    }
+    return bucketValue(LATENCY_BUCKETS - 1);
+}
+
+uint64_t LatencyHistogram::max() {
+    for (uint32_t i = LATENCY_BUCKETS; i > 0; i--) {
+        if (this->counts[i - 1].load(std::memory_order_relaxed) > 0) {
+            return bucketValue(i - 1);
+        }
+    }
+    return 0;
+}
+
+static std::mutex registryMtx;
+static std::vector<LatencyHistogram**> live;
+static LatencyHistogram retired[STAGE_COUNT];
+
+// a histogram is only allocated once its thread records into that stage, the
+// writer of every connection only ever needs STAGE_WRITE
+struct HistogramSlot {
+    LatencyHistogram* stages[STAGE_COUNT];
+    HistogramSlot() {
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            this->stages[i] = NULL;
+        }
+        std::lock_guard<std::mutex> lock(registryMtx);
+        live.push_back(this->stages);
+    };
+    ~HistogramSlot() {
+        std::lock_guard<std::mutex> lock(registryMtx);
+        for (int i = 0; i < STAGE_COUNT; i++) {
+            if (this->stages[i] != NULL) {
+                retired[i].merge(this->stages[i]);
+                delete this->stages[i];
+            }
+        }
+        for (size_t i = 0; i < live.size(); i++) {
+            if (live[i] == this->stages) {
+                live[i] = live.back();
+                live.pop_back();
+                break;
+            }
+        }
+    };
+};
+
+uint32_t latencySampleEvery = 16;
+
+static thread_local HistogramSlot slot;
+static thread_local uint32_t reads = 0;
+static thread_local uint64_t stageAt = 0; // end of the last stage recorded before the match
+static thread_local uint64_t matchedAt = 0;
+
+void latencyRecord(LatencyStage stage, uint64_t ns) {
+    if (slot.stages[stage] == NULL) {
+        // published under the lock so a snapshot never sees a half built one
+        LatencyHistogram* h = new LatencyHistogram();
+        std::lock_guard<std::mutex> lock(registryMtx);
+        slot.stages[stage] = h;
+    }
+    slot.stages[stage]->record(ns);
+}
+
+void latencySnapshot(LatencyStage stage, LatencyHistogram* out) {
+    std::lock_guard<std::mutex> lock(registryMtx);
+    out->merge(&retired[stage]);
+    for (size_t t = 0; t < live.size(); t++) {
+        if (live[t][stage] != NULL) {
+            out->merge(live[t][stage]);
+        }
+    }
+}
+
+// other packets clear the stamps, so a will published on DISCONNECT is not counted
+void latencyRead(bool publish) {
+    stageAt = 0;
+    matchedAt = 0;
+    if (publish && ++reads >= latencySampleEvery) {
+        reads = 0;
+        stageAt = monotonicNanos();
+    }
+}
+
+static void latencyStage(LatencyStage stage) {
+    if (stageAt != 0) {
+        uint64_t now = monotonicNanos();
+        latencyRecord(stage, now - stageAt);
+        stageAt = now;
+    }
+}
+
+void latencyDecoded() {
+    latencyStage(STAGE_DECODE);
+}
+
+void latencyDispatched() {
+    latencyStage(STAGE_LOCK);
+}
+
+// only the first lookup after a read is the routing of that PUBLISH
+void latencyMatched() {
+    if (stageAt == 0) {
+        matchedAt = 0;
+        return;
+    }
+    matchedAt = monotonicNanos();
+    latencyRecord(STAGE_MATCH, matchedAt - stageAt);
+    stageAt = 0;
+}
+
+bool latencySampled() {
+    return matchedAt != 0;
+}
+
+void latencyQueued() {
+    if (matchedAt != 0) {
+        latencyRecord(STAGE_FANOUT, monotonicNanos() - matchedAt);
+    }
+}
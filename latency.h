@@ -0,0 +1,84 @@
+#ifndef MQTT_LATENCY_H_
+#define MQTT_LATENCY_H_
+
+#include <stdint.h>
+#include <atomic>
+
+// build with -DMQTT_STAGE_LATENCY=0 to take every probe out of the publish path
+#ifndef MQTT_STAGE_LATENCY
+#define MQTT_STAGE_LATENCY 1
+#endif
+
+enum LatencyStage {
+    STAGE_DECODE, // PUBLISH read from the socket and let through by the rate limits -> decoded
+    STAGE_LOCK, // decoded -> dispatch lock held
+    STAGE_MATCH, // dispatch lock held -> subscribers looked up
+    STAGE_FANOUT, // subscribers looked up -> queued on one subscriber's connection
+    STAGE_WRITE, // queued -> handed to the subscriber's socket
+    STAGE_COUNT,
+};
+
+static const char* const StageName[] = {
+    "decode",
+    "lock",
+    "match",
+    "fanout",
+    "write",
+};
+
+// HDR style: exact below 32 ns, then 16 linear buckets per power of two, so a
+// recorded value is within about 3% of the real one. Values are clamped at 2^36 ns.
+const static uint32_t LATENCY_SUB_BITS = 5;
+const static uint32_t LATENCY_MAX_BITS = 36;
+const static uint32_t LATENCY_BUCKETS = (1 << LATENCY_SUB_BITS) + (LATENCY_MAX_BITS - LATENCY_SUB_BITS) * (1 << (LATENCY_SUB_BITS - 1));
+
+// written by one thread, merged into a fresh histogram from any other
+class LatencyHistogram {
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS];
+public:
+    LatencyHistogram();
+    static uint32_t bucketOf(uint64_t ns);
+    static uint64_t bucketValue(uint32_t idx);
+    void record(uint64_t ns) {
+        uint32_t idx = bucketOf(ns);
+        this->counts[idx].store(this->counts[idx].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    };
+    void merge(const LatencyHistogram* h);
+    uint64_t count();
+    uint64_t percentile(double p); // ns, p in [0, 100]
+    uint64_t max();
+};
+
+// into the calling thread's histogram of the stage
+void latencyRecord(LatencyStage stage, uint64_t ns);
+
+// sums every live thread and the threads that have exited
+void latencySnapshot(LatencyStage stage, LatencyHistogram* out);
+
+// reading the clock costs about as much as matching a short topic, so only one
+// PUBLISH in this many is timed through the pipeline. 1 times every one.
+extern uint32_t latencySampleEvery;
+
+// the stamps of the PUBLISH the calling thread is routing
+void latencyRead(bool publish);
+void latencyDecoded();
+void latencyDispatched();
+void latencyMatched();
+void latencyQueued();
+bool latencySampled(); // the PUBLISH being routed is timed
+
+#if MQTT_STAGE_LATENCY
+#define LATENCY_READ(publish) latencyRead(publish)
+#define LATENCY_DECODED() latencyDecoded()
+#define LATENCY_DISPATCHED() latencyDispatched()
+#define LATENCY_MATCHED() latencyMatched()
+#define LATENCY_QUEUED() latencyQueued()
+#else
+#define LATENCY_READ(publish)
+#define LATENCY_DECODED()
+#define LATENCY_DISPATCHED()
+#define LATENCY_MATCHED()
+#define LATENCY_QUEUED()
+#endif
+
+#endif // MQTT_LATENCY_H_
@@ -0,0 +1,276 @@
+#include "logFile.h"
+#include "util.h"
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const static uint32_t FRAME_HEADER = 8;
+const static size_t FORCE_COMMIT_BYTES = 4 * 1024 * 1024;
+// pause before a batch that failed to write or sync is tried again
+const static uint32_t RETRY_MS = 100;
+
+static uint32_t checksum(const uint8_t* data, uint32_t len) {
+    // FNV-1a, only has to catch torn writes
+    uint32_t h = 2166136261u;
+    for (uint32_t i = 0; i < len; i++) {
+        h = (h ^ data[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void frame(std::string* out, const std::string& record) {
+    uint32_t len = record.size();
+    uint32_t sum = checksum((const uint8_t*)record.data(), len);
+    uint8_t head[FRAME_HEADER] = {(uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8), (uint8_t)len,
+                                  (uint8_t)(sum >> 24), (uint8_t)(sum >> 16), (uint8_t)(sum >> 8), (uint8_t)sum};
+    out->append((const char*)head, FRAME_HEADER);
+    out->append(record);
+}
+
+LogFile::LogFile(uint32_t commitWindowUs) : fd(-1), appended(0), durable(0), fileSize(0), running(false), writing(false), commitWindowUs(commitWindowUs) {}
+
+LogFile::~LogFile() {
+    this->close();
+}
+
+MQTT_ERROR LogFile::open(const std::string path) {
+    this->path = path;
+    this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (this->fd < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return STORE_IO_ERROR;
+    }
+    this->fileSize = st.st_size;
+    this->running = true;
+    this->committer = std::thread(&LogFile::commitLoop, this);
+    return NO_ERROR;
+}
+
+void LogFile::close() {
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        if (!this->running) {
+            return;
+        }
+        this->running = false;
+    }
+    this->pendingCv.notify_one();
+    this->committer.join();
+    ::close(this->fd);
+    this->fd = -1;
+}
+
+uint64_t LogFile::append(const std::string& record) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    frame(&this->buffer, record);
+    uint64_t seq = ++this->appended;
+    this->pendingCv.notify_one();
+    return seq;
+}
+
+uint64_t LogFile::append(const std::string& record, std::function<void()> onDurable) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    frame(&this->buffer, record);
+    uint64_t seq = ++this->appended;
+    this->callbacks.push_back(std::make_pair(seq, onDurable));
+    this->pendingCv.notify_one();
+    return seq;
+}
+
+void LogFile::afterDurable(std::function<void()> cb) {
+    {
+        std::lock_guard<std::mutex> lock(this->mtx);
+        if (this->durable < this->appended) {
+            this->callbacks.push_back(std::make_pair(this->appended, cb));
+            return;
+        }
+    }
+    cb();
+}
+
+void LogFile::waitDurable(uint64_t seq) {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->durableCv.wait(lock, [this, seq]{return this->durable >= seq || !this->running;});
+}
+
+uint64_t LogFile::size() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->fileSize + this->buffer.size();
+}
+
+void LogFile::commitLoop() {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    while (true) {
+        this->pendingCv.wait(lock, [this]{return this->buffer.size() > 0 || !this->running;});
+        if (this->buffer.size() == 0) {
+            return;
+        }
+        // let more records join this fsync, up to the latency budget
+        if (this->commitWindowUs > 0 && this->running) {
+            std::chrono::steady_clock::time_point until = std::chrono::steady_clock::now() + std::chrono::microseconds(this->commitWindowUs);
+            this->pendingCv.wait_until(lock, until, [this]{return this->buffer.size() >= FORCE_COMMIT_BYTES || !this->running;});
+        }
+        std::string batch;
+        batch.swap(this->buffer);
+        uint64_t seq = this->appended;
+        int out = this->fd;
+        this->writing = true;
+        lock.unlock();
+
+        bool ok = true;
+        const char* p = batch.data();
+        size_t left = batch.size();
+        while (left > 0) {
+            ssize_t n = write(out, p, left);
+            if (n < 0) {
+                perror("write");
+                ok = false;
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+        if (ok && fdatasync(out) != 0) {
+            perror("fdatasync");
+            ok = false;
+        }
+
+        lock.lock();
+        if (!ok) {
+            // none of the batch counts as written: it is cut off and retried
+            // whole, and nothing in it is acknowledged until that succeeds
+            emitError(STORE_IO_ERROR);
+            if (ftruncate(out, this->fileSize) != 0) {
+                perror("ftruncate");
+            }
+            this->buffer.insert(0, batch);
+            this->writing = false;
+            this->durableCv.notify_all();
+            if (!this->running) {
+                return;
+            }
+            this->pendingCv.wait_for(lock, std::chrono::milliseconds(RETRY_MS), [this]{return !this->running;});
+            continue;
+        }
+        this->fileSize += batch.size();
+        this->durable = seq;
+        this->writing = false;
+        this->durableCv.notify_all();
+        // those waiting on a later append stay for the next batch
+        size_t n = 0;
+        while (n < this->callbacks.size() && this->callbacks[n].first <= seq) {
+            n++;
+        }
+        std::vector<std::pair<uint64_t, std::function<void()> > > done(this->callbacks.begin(), this->callbacks.begin() + n);
+        this->callbacks.erase(this->callbacks.begin(), this->callbacks.begin() + n);
+        // callbacks may take locks that are held around rewrite()
+        lock.unlock();
+        for (size_t i = 0; i < done.size(); i++) {
+            done[i].second();
+        }
+        lock.lock();
+    }
+}
+
+MQTT_ERROR LogFile::replay(std::function<void(const uint8_t*, uint32_t)> cb) {
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return STORE_IO_ERROR;
+    }
+    if (st.st_size == 0) {
+        return NO_ERROR;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return STORE_IO_ERROR;
+    }
+    madvise(p, st.st_size, MADV_SEQUENTIAL);
+    const uint8_t* base = (const uint8_t*)p;
+    uint64_t pos = 0;
+    while (pos + FRAME_HEADER <= (uint64_t)st.st_size) {
+        const uint8_t* h = base + pos;
+        uint32_t len = (uint32_t)h[0] << 24 | (uint32_t)h[1] << 16 | (uint32_t)h[2] << 8 | h[3];
+        uint32_t sum = (uint32_t)h[4] << 24 | (uint32_t)h[5] << 16 | (uint32_t)h[6] << 8 | h[7];
+        if (pos + FRAME_HEADER + len > (uint64_t)st.st_size || checksum(h + FRAME_HEADER, len) != sum) {
+            break;
+        }
+        cb(h + FRAME_HEADER, len);
+        pos += FRAME_HEADER + len;
+    }
+    munmap(p, st.st_size);
+    if (pos != (uint64_t)st.st_size) {
+        // torn tail from a crash, new records go after the last complete one
+        if (ftruncate(this->fd, pos) != 0) {
+            return STORE_IO_ERROR;
+        }
+        std::lock_guard<std::mutex> lock(this->mtx);
+        this->fileSize = pos;
+    }
+    return NO_ERROR;
+}
+
+// replaces the whole log with the given records, atomically through a rename
+MQTT_ERROR LogFile::rewrite(const std::vector<std::string>& records) {
+    std::string tmpPath = this->path + ".rewrite";
+    int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    std::string buf;
+    uint64_t written = 0;
+    for (size_t i = 0; i <= records.size(); i++) {
+        if (i < records.size()) {
+            frame(&buf, records[i]);
+        }
+        if (buf.size() >= FORCE_COMMIT_BYTES || (i == records.size() && buf.size() > 0)) {
+            if (write(out, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+                ::close(out);
+                return STORE_IO_ERROR;
+            }
+            written += buf.size();
+            buf.clear();
+        }
+    }
+    if (fsync(out) != 0) {
+        ::close(out);
+        return STORE_IO_ERROR;
+    }
+    ::close(out);
+
+    std::unique_lock<std::mutex> lock(this->mtx);
+    this->durableCv.wait(lock, [this]{return !this->writing;});
+    this->buffer.clear();
+    if (rename(tmpPath.c_str(), this->path.c_str()) != 0) {
+        perror("rename");
+        return STORE_IO_ERROR;
+    }
+    if (syncDirectory(this->path) != NO_ERROR) {
+        return STORE_IO_ERROR;
+    }
+    int nfd = ::open(this->path.c_str(), O_RDWR | O_APPEND);
+    if (nfd < 0) {
+        return STORE_IO_ERROR;
+    }
+    ::close(this->fd);
+    this->fd = nfd;
+    this->fileSize = written;
+    this->durable = this->appended;
+    std::vector<std::pair<uint64_t, std::function<void()> > > done;
+    done.swap(this->callbacks);
+    lock.unlock();
+    this->durableCv.notify_all();
+    for (size_t i = 0; i < done.size(); i++) {
+        done[i].second();
+    }
+    return NO_ERROR;
+}
@@ -0,0 +1,51 @@
+#ifndef MQTT_LOGFILE_H_
+#define MQTT_LOGFILE_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// append-only record log with group commit. Appends are buffered and a committer
+// thread writes and fsyncs them in batches, waiting at most commitWindowUs for more
+// records to share one fsync. Records are framed as [length(4)][checksum(4)][data],
+// a torn tail after a crash is cut off by replay. A batch that fails to write or
+// sync is retried, its records stay undurable and their callbacks wait.
+class LogFile {
+    std::string path;
+    int fd;
+    std::mutex mtx;
+    std::condition_variable pendingCv;
+    std::condition_variable durableCv;
+    std::string buffer;
+    std::vector<std::pair<uint64_t, std::function<void()> > > callbacks;
+    uint64_t appended;
+    uint64_t durable;
+    uint64_t fileSize;
+    bool running;
+    bool writing;
+    std::thread committer;
+    void commitLoop();
+public:
+    uint32_t commitWindowUs;
+    LogFile(uint32_t commitWindowUs);
+    ~LogFile();
+    MQTT_ERROR open(const std::string path);
+    void close();
+    uint64_t append(const std::string& record);
+    uint64_t append(const std::string& record, std::function<void()> onDurable);
+    // runs cb once every record appended so far is durable, right away if they are
+    void afterDurable(std::function<void()> cb);
+    void waitDurable(uint64_t seq);
+    uint64_t size();
+    MQTT_ERROR replay(std::function<void(const uint8_t*, uint32_t)> cb);
+    // records still buffered are dropped as the snapshot supersedes them, their
+    // callbacks run once it is durable
+    MQTT_ERROR rewrite(const std::vector<std::string>& records);
+};
+
+#endif // MQTT_LOGFILE_H_
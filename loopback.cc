@@ -0,0 +1,202 @@
+#include "loopback.h"
+#include "terminal.h"
+#include "stats.h"
+#include "latency.h"
+#include "trace.h"
+#include "util.h"
+
+LoopbackQueue::~LoopbackQueue() {
+    for (std::deque<Message*>::iterator it = this->messages.begin(); it != this->messages.end(); it++) {
+        delete *it;
+    }
+}
+
+LoopbackTransport::LoopbackTransport() : Transport(-1, NULL) {}
+
+LoopbackTransport::~LoopbackTransport() {
+    this->shutdown();
+}
+
+void LoopbackTransport::connectPair(LoopbackTransport* a, LoopbackTransport* b) {
+    a->out = b->in = std::make_shared<LoopbackQueue>();
+    a->in = b->out = std::make_shared<LoopbackQueue>();
+}
+
+// fixed header plus remaining length, what the same message takes on a socket
+static uint32_t frameLength(FixedHeader* fh) {
+    uint32_t len = 2;
+    for (uint32_t rest = fh->length; rest >= 128; rest /= 128) {
+        len++;
+    }
+    return len + fh->length;
+}
+
+MQTT_ERROR LoopbackTransport::sendMessage(Message* m) {
+    if (this->out == NULL) {
+        return SEND_ERROR;
+    }
+    Message* copy = copyMessage(m);
+    if (copy == NULL) {
+        return SEND_ERROR;
+    }
+    {
+        std::lock_guard<std::mutex> lock(this->out->mtx);
+        if (this->out->closed) {
+            delete copy;
+            return SEND_ERROR;
+        }
+        this->out->messages.push_back(copy);
+    }
+    this->out->cv.notify_one();
+    statAdd(STAT_MESSAGES_SENT, 1);
+    statAdd(STAT_BYTES_SENT, frameLength(m->fh));
+    if (m->fh->type == PUBLISH_MESSAGE_TYPE) {
+        statAdd(STAT_PUBLISHES_SENT, 1);
+    }
+    return NO_ERROR;
+}
+
+MQTT_ERROR LoopbackTransport::sendMessages(std::vector<Message*>& ms) {
+    for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+        MQTT_ERROR err = this->sendMessage(*it);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    return NO_ERROR;
+}
+
+// there are no bytes to read, loopbackLoop takes whole messages with receive
+MQTT_ERROR LoopbackTransport::readMessage() {
+    return READ_ERROR;
+}
+
+void LoopbackTransport::shutdown() {
+    std::shared_ptr<LoopbackQueue> queues[2] = {this->in, this->out};
+    for (int i = 0; i < 2; i++) {
+        if (queues[i] == NULL) {
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues[i]->mtx);
+            queues[i]->closed = true;
+        }
+        queues[i]->cv.notify_all();
+    }
+}
+
+Message* LoopbackTransport::receive() {
+    if (this->in == NULL) {
+        return NULL;
+    }
+    std::unique_lock<std::mutex> lock(this->in->mtx);
+    this->in->cv.wait(lock, [this]{return this->in->messages.size() > 0 || this->in->closed;});
+    if (this->in->messages.size() == 0) {
+        return NULL;
+    }
+    Message* m = this->in->messages.front();
+    this->in->messages.pop_front();
+    return m;
+}
+
+Message* copyMessage(Message* m) {
+    FixedHeader* fh = m->fh;
+    Message* copy = NULL;
+    switch (fh->type) {
+    case CONNECT_MESSAGE_TYPE:
+    {
+        ConnectMessage* c = (ConnectMessage*)m;
+        // the receiving session keeps these, the sender's are its own
+        Will* will = c->will != NULL ? new Will(*c->will) : NULL;
+        User* user = c->user != NULL ? new User(*c->user) : NULL;
+        copy = new ConnectMessage(c->keepAlive, c->clientID, c->cleanSession, will, user);
+        break;
+    }
+    case CONNACK_MESSAGE_TYPE:
+        copy = new ConnackMessage(((ConnackMessage*)m)->sessionPresent, ((ConnackMessage*)m)->returnCode);
+        break;
+    case PUBLISH_MESSAGE_TYPE:
+        copy = new PublishMessage(fh->dup, fh->qos, fh->retain, fh->packetID, ((PublishMessage*)m)->topicName, ((PublishMessage*)m)->payload);
+        break;
+    case PUBACK_MESSAGE_TYPE:
+        copy = new PubackMessage(fh->packetID);
+        break;
+    case PUBREC_MESSAGE_TYPE:
+        copy = new PubrecMessage(fh->packetID);
+        break;
+    case PUBREL_MESSAGE_TYPE:
+        copy = new PubrelMessage(fh->packetID);
+        break;
+    case PUBCOMP_MESSAGE_TYPE:
+        copy = new PubcompMessage(fh->packetID);
+        break;
+    case SUBSCRIBE_MESSAGE_TYPE:
+    {
+        std::vector<SubscribeTopic*> topics;
+        std::vector<SubscribeTopic*>& from = ((SubscribeMessage*)m)->subTopics;
+        for (std::vector<SubscribeTopic*>::iterator it = from.begin(); it != from.end(); it++) {
+            topics.push_back(new SubscribeTopic((*it)->topic, (*it)->qos));
+        }
+        copy = new SubscribeMessage(fh->packetID, topics);
+        break;
+    }
+    case SUBACK_MESSAGE_TYPE:
+        copy = new SubackMessage(fh->packetID, ((SubackMessage*)m)->returnCodes);
+        break;
+    case UNSUBSCRIBE_MESSAGE_TYPE:
+        copy = new UnsubscribeMessage(fh->packetID, ((UnsubscribeMessage*)m)->topics);
+        break;
+    case UNSUBACK_MESSAGE_TYPE:
+        copy = new UnsubackMessage(fh->packetID);
+        break;
+    case PINGREQ_MESSAGE_TYPE:
+        copy = new PingreqMessage();
+        break;
+    case PINGRESP_MESSAGE_TYPE:
+        copy = new PingrespMessage();
+        break;
+    case DISCONNECT_MESSAGE_TYPE:
+        copy = new DisconnectMessage();
+        break;
+    default:
+        return NULL;
+    }
+    return copy;
+}
+
+MQTT_ERROR loopbackLoop(Terminal* c) {
+    LoopbackTransport* lt = (LoopbackTransport*)c->ct;
+    MQTT_ERROR err = NO_ERROR;
+    bool first = true;
+    while (first || c->isConnecting) {
+        first = false;
+        Message* m = lt->receive();
+        if (m == NULL) {
+            emitError(PEER_CLOSED);
+            return PEER_CLOSED;
+        }
+        traceRead(m->fh->type == PUBLISH_MESSAGE_TYPE);
+        c->frameReceived(m->fh, frameLength(m->fh));
+        // nothing to decode, the stamp goes straight to the lock wait
+        LATENCY_READ(m->fh->type == PUBLISH_MESSAGE_TYPE);
+        c->messageDecoded(m);
+        {
+            std::unique_lock<std::recursive_mutex> dispatch;
+            if (c->dispatchLock != NULL) {
+                dispatch = std::unique_lock<std::recursive_mutex>(*c->dispatchLock);
+            }
+            LATENCY_DISPATCHED();
+            c->packetReceived();
+            err = dispatchMessage(c, m);
+        }
+        if (m->fh->type != CONNECT_MESSAGE_TYPE) {
+            // a session keeps pointing at the will and user of its CONNECT
+            delete m;
+        }
+        if (err != NO_ERROR) {
+            emitError(err);
+            return err;
+        }
+    }
+    return err;
+}
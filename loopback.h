@@ -0,0 +1,48 @@
+#ifndef MQTT_LOOPBACK_H_
+#define MQTT_LOOPBACK_H_
+
+#include "frame.h"
+#include "mqttError.h"
+#include "transport.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+class Terminal;
+
+// one direction of an in-process connection
+struct LoopbackQueue {
+    LoopbackQueue() : closed(false) {};
+    ~LoopbackQueue();
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<Message*> messages;
+    bool closed;
+};
+
+// a Transport whose peer lives in the same process: a sent message is copied
+// as an object into the peer's queue and handed to its handlers by
+// loopbackLoop, nothing is encoded and no socket is involved. Either end
+// shutting down closes both directions, the peer still gets what was queued.
+class LoopbackTransport : public Transport {
+    std::shared_ptr<LoopbackQueue> in;
+    std::shared_ptr<LoopbackQueue> out;
+public:
+    LoopbackTransport();
+    ~LoopbackTransport();
+    static void connectPair(LoopbackTransport* a, LoopbackTransport* b);
+    MQTT_ERROR sendMessage(Message* m);
+    MQTT_ERROR sendMessages(std::vector<Message*>& ms);
+    MQTT_ERROR readMessage();
+    void shutdown();
+    Message* receive(); // blocks, NULL once the connection is closed and drained
+};
+
+// the sender keeps its message for retransmission, the peer gets its own copy
+Message* copyMessage(Message* m);
+
+// readLoop for a terminal on a LoopbackTransport
+MQTT_ERROR loopbackLoop(Terminal* c);
+
+#endif // MQTT_LOOPBACK_H_
@@ -0,0 +1,192 @@
+#include "metrics.h"
+#include "broker.h"
+#include "stats.h"
+#include "latency.h"
+#include "trace.h"
+#include <errno.h>
+#include <sstream>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+struct CounterInfo {
+    StatID id;
+    const char* name;
+    const char* help;
+};
+
+static const CounterInfo Counters[] = {
+    {STAT_MESSAGES_RECEIVED, "mqtt_messages_received_total", "Control packets read from clients."},
+    {STAT_MESSAGES_SENT, "mqtt_messages_sent_total", "Control packets queued to clients."},
+    {STAT_BYTES_RECEIVED, "mqtt_bytes_received_total", "Bytes of control packets read from clients."},
+    {STAT_BYTES_SENT, "mqtt_bytes_sent_total", "Bytes of control packets queued to clients."},
+    {STAT_PUBLISHES_RECEIVED, "mqtt_publishes_received_total", "PUBLISH packets read from clients."},
+    {STAT_PUBLISHES_SENT, "mqtt_publishes_sent_total", "PUBLISH packets queued to clients."},
+    {STAT_PUBLISHES_DROPPED, "mqtt_publishes_dropped_total", "QoS0 PUBLISH packets dropped on congested connections or while shedding load."},
+    {STAT_PUBLISHES_ROUTED, "mqtt_publishes_routed_total", "Publishes matched against the topic tree."},
+    {STAT_FANOUT_DELIVERIES, "mqtt_fanout_deliveries_total", "Subscriber copies made of routed publishes."},
+    {STAT_PUBLISHES_DENIED, "mqtt_publishes_denied_total", "Publishes acknowledged but not routed, the ACL refused the topic."},
+    {STAT_READ_PAUSES, "mqtt_read_pauses_total", "Times a connection was not read from because it was over its rate limit."},
+    {STAT_MEMORY_DISCONNECTS, "mqtt_memory_disconnects_total", "Connections closed for holding too much memory."},
+};
+
+static void gauge(std::stringstream& out, const char* name, const char* help, uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n";
+    out << "# TYPE " << name << " gauge\n";
+    out << name << " " << value << "\n";
+}
+
+std::string renderMetrics(const BrokerGauges* gauges) {
+    std::stringstream out;
+    uint64_t totals[STAT_COUNT];
+    statTotals(totals);
+    for (size_t i = 0; i < sizeof(Counters) / sizeof(Counters[0]); i++) {
+        out << "# HELP " << Counters[i].name << " " << Counters[i].help << "\n";
+        out << "# TYPE " << Counters[i].name << " counter\n";
+        out << Counters[i].name << " " << totals[Counters[i].id] << "\n";
+    }
+    gauge(out, "mqtt_topic_nodes", "Nodes in the topic tree.", totals[STAT_TOPIC_NODES_CREATED] - totals[STAT_TOPIC_NODES_DELETED]);
+
+#if MQTT_STAGE_LATENCY
+    const char* latency = "mqtt_publish_stage_latency_seconds";
+    out << "# HELP " << latency << " Time spent by sampled publishes in each stage of routing.\n";
+    out << "# TYPE " << latency << " summary\n";
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (int stage = 0; stage < STAGE_COUNT; stage++) {
+        LatencyHistogram h;
+        latencySnapshot((LatencyStage)stage, &h);
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+            out << latency << "{stage=\"" << StageName[stage] << "\",quantile=\"" << quantiles[q] << "\"} " << h.percentile(quantiles[q] * 100) / 1e9 << "\n";
+        }
+        out << latency << "_count{stage=\"" << StageName[stage] << "\"} " << h.count() << "\n";
+    }
+#endif
+
+    if (gauges == NULL) {
+        return out.str();
+    }
+    gauge(out, "mqtt_clients_connected", "Connected clients.", gauges->connected);
+    gauge(out, "mqtt_sessions", "Sessions, connected or kept for a returning client.", gauges->sessions);
+    gauge(out, "mqtt_subscriptions", "Subscriptions of all sessions.", gauges->subscriptions);
+    gauge(out, "mqtt_retained_messages", "Retained messages.", gauges->retained);
+    gauge(out, "mqtt_inflight_messages", "QoS1/2 messages sent and not acknowledged yet.", gauges->inflight);
+    gauge(out, "mqtt_outbound_queued_bytes", "Bytes waiting in the outbound queues of all connections.", gauges->outboundBytes);
+    gauge(out, "mqtt_outbound_queued_bytes_max", "Bytes waiting in the fullest outbound queue.", gauges->outboundMaxBytes);
+    gauge(out, "mqtt_offline_queued_messages", "Messages queued for disconnected or slow sessions.", gauges->offlineMessages);
+    gauge(out, "mqtt_slow_consumers", "Connections flagged as slow consumers.", gauges->slowConsumers);
+    gauge(out, "mqtt_session_memory_bytes", "Bytes accounted to sessions.", gauges->sessionMemory);
+    gauge(out, "mqtt_session_memory_bytes_max", "Bytes accounted to the largest session.", gauges->sessionMemoryMax);
+    gauge(out, "mqtt_shedding_load", "1 while QoS0 deliveries and new connections are refused for memory.", gauges->shedding);
+    gauge(out, "mqtt_heap_inuse_bytes", "Bytes allocated from the malloc arenas.", gauges->heapInUse);
+    gauge(out, "mqtt_heap_free_bytes", "Free bytes held by the malloc arenas.", gauges->heapFree);
+    gauge(out, "mqtt_heap_mapped_bytes", "Bytes in blocks malloc mapped on their own.", gauges->heapMapped);
+    gauge(out, "mqtt_resident_bytes", "Resident set size of the process.", gauges->resident);
+    gauge(out, "mqtt_gauges_timestamp_ms", "Monotonic time the gauges were taken at.", gauges->takenAt);
+    return out.str();
+}
+
+MetricsServer::MetricsServer(Broker* broker) : broker(broker), listener(-1) {}
+
+MetricsServer::~MetricsServer() {
+    if (this->listener < 0) {
+        return;
+    }
+    // wakes the blocked accept
+    shutdown(this->listener, SHUT_RDWR);
+    this->server.join();
+    close(this->listener);
+}
+
+MQTT_ERROR MetricsServer::start(const std::string address, uint16_t port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+        return METRICS_LISTEN_FAILED;
+    }
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        return METRICS_LISTEN_FAILED;
+    }
+    int on = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 16) != 0) {
+        close(sock);
+        return METRICS_LISTEN_FAILED;
+    }
+    this->listener = sock;
+    this->server = std::thread(&MetricsServer::serveLoop, this);
+    return NO_ERROR;
+}
+
+uint16_t MetricsServer::port() {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (this->listener < 0 || getsockname(this->listener, (struct sockaddr *)&addr, &len) != 0) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+void MetricsServer::serveLoop() {
+    while (true) {
+        int sock = accept(this->listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        // a scraper that never sends its request must not hold the endpoint
+        struct timeval timeout = {5, 0};
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        this->serve(sock);
+        close(sock);
+    }
+}
+
+void MetricsServer::serve(int sock) {
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+        ssize_t n = recv(sock, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            return;
+        }
+        request.append(buf, n);
+    }
+    std::string status = "200 OK";
+    std::string contentType = "text/plain; version=0.0.4";
+    std::string body;
+    if (request.compare(0, 13, "GET /metrics ") == 0) {
+        std::shared_ptr<const BrokerGauges> gauges = std::atomic_load(&this->broker->gauges);
+        body = renderMetrics(gauges.get());
+    } else if (request.compare(0, 11, "GET /trace ") == 0) {
+        contentType = "application/json";
+        body = traceDump();
+    } else {
+        status = "404 Not Found";
+        body = "only /metrics and /trace are served\n";
+    }
+    std::stringstream resp;
+    resp << "HTTP/1.1 " << status << "\r\n";
+    resp << "Content-Type: " << contentType << "\r\n";
+    resp << "Content-Length: " << body.size() << "\r\n";
+    resp << "Connection: close\r\n\r\n";
+    resp << body;
+    std::string wire = resp.str();
+    const char* p = wire.data();
+    size_t left = wire.size();
+    while (left > 0) {
+        ssize_t n = send(sock, p, left, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return;
+        }
+        p += n;
+        left -= n;
+    }
+}
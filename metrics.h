@@ -0,0 +1,56 @@
+#ifndef MQTT_METRICS_H_
+#define MQTT_METRICS_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+// values that need Broker::mtx to read, taken by the stats timer and replaced
+// as a whole so readers never lock anything the data path holds
+struct BrokerGauges {
+    BrokerGauges() : takenAt(0), connected(0), sessions(0), subscriptions(0), retained(0), inflight(0), outboundBytes(0), outboundMaxBytes(0), offlineMessages(0), slowConsumers(0), sessionMemory(0), sessionMemoryMax(0), shedding(0), heapInUse(0), heapFree(0), heapMapped(0), resident(0) {};
+    uint32_t takenAt; // ms, monotonic
+    uint64_t connected;
+    uint64_t sessions;
+    uint64_t subscriptions;
+    uint64_t retained;
+    uint64_t inflight;
+    uint64_t outboundBytes; // queued in every outbox
+    uint64_t outboundMaxBytes; // in the fullest one
+    uint64_t offlineMessages;
+    uint64_t slowConsumers;
+    uint64_t sessionMemory; // accounted, see BrokerSideClient::heldBytes
+    uint64_t sessionMemoryMax;
+    uint64_t shedding;
+    uint64_t heapInUse; // malloc arenas, the sessions' held bytes where mallinfo2 is missing
+    uint64_t heapFree;
+    uint64_t heapMapped; // large blocks mmapped by malloc
+    uint64_t resident;
+};
+
+// Prometheus text exposition of the thread counters, the stage latencies and
+// the last gauges
+std::string renderMetrics(const BrokerGauges* gauges);
+
+class Broker;
+
+// plain HTTP on its own thread, one request per connection. Only GET /metrics
+// and GET /trace (Chrome trace JSON of sampled messages) are served, everything
+// is read from snapshots.
+class MetricsServer {
+    Broker* broker;
+    int listener;
+    std::thread server;
+    void serveLoop();
+    void serve(int sock);
+public:
+    MetricsServer(Broker* broker);
+    ~MetricsServer();
+    MQTT_ERROR start(const std::string address, uint16_t port);
+    uint16_t port(); // bound port, for port 0
+};
+
+#endif // MQTT_METRICS_H_
@@ -35,6 +35,14 @@ enum MQTT_ERROR {
     SEND_ERROR,
     READ_ERROR,
     PEER_CLOSED,
+    MALFORMED_SHARED_SUBSCRIPTION,
+    STORE_IO_ERROR,
+    STORE_CORRUPTED,
+    OFFLINE_QUEUE_FULL,
+    OUTBOUND_QUEUE_FULL,
+    METRICS_LISTEN_FAILED,
+    CONNECTION_REFUSED,
+    MEMORY_LIMIT_EXCEEDED,
 };
 
 static const std::string ErrorString[] = {
@@ -68,6 +76,14 @@ static const std::string ErrorString[] = {
    "SEND_ERROR",
    "READ_ERROR",
    "PEER_CLOSED",
+   "MALFORMED_SHARED_SUBSCRIPTION",
+   "STORE_IO_ERROR",
+   "STORE_CORRUPTED",
+   "OFFLINE_QUEUE_FULL",
+   "OUTBOUND_QUEUE_FULL",
+   "METRICS_LISTEN_FAILED",
+   "CONNECTION_REFUSED",
+   "MEMORY_LIMIT_EXCEEDED",
 };
 
 #endif // MQTT_ERROR_H_
@@ -0,0 +1,258 @@
+#include "offlineQueue.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// a new segment is started past this size so drained ones can be closed
+const static uint64_t SEGMENT_SIZE = 64 * 1024 * 1024;
+const static uint64_t READ_CHUNK = 1024 * 1024;
+
+OfflineQueue::OfflineQueue() : memoryBytes(0), diskBytes(0), count(0), memoryLimit(1024 * 1024), diskLimit(256 * 1024 * 1024), spillDir("/tmp"), durable(false) {}
+
+OfflineQueue::~OfflineQueue() {
+    this->clear();
+}
+
+void OfflineQueue::swap(OfflineQueue& q) {
+    this->memory.swap(q.memory);
+    this->segments.swap(q.segments);
+    std::swap(this->memoryBytes, q.memoryBytes);
+    std::swap(this->diskBytes, q.diskBytes);
+    std::swap(this->count, q.count);
+    this->retired.swap(q.retired);
+    std::swap(this->durable, q.durable);
+}
+
+void OfflineQueue::closeSegment(SpillSegment& seg, bool retire) {
+    close(seg.fd);
+    if (seg.path.size() == 0) {
+        return;
+    }
+    if (retire) {
+        this->retired.push_back(seg.path);
+    } else {
+        unlink(seg.path.c_str());
+    }
+}
+
+void OfflineQueue::clear() {
+    for (std::list<SpillSegment>::iterator it = this->segments.begin(); it != this->segments.end(); it++) {
+        this->closeSegment(*it, false);
+    }
+    this->segments.clear();
+    this->releaseRetired();
+    this->memory.clear();
+    this->memoryBytes = 0;
+    this->diskBytes = 0;
+    this->count = 0;
+}
+
+MQTT_ERROR OfflineQueue::push(const std::string& wire) {
+    // once spilled, newer messages go to disk as well until it is drained
+    if (this->segments.size() == 0 && this->memoryBytes + wire.size() <= this->memoryLimit) {
+        this->memory.push_back(wire);
+        this->memoryBytes += wire.size();
+        this->count++;
+        return NO_ERROR;
+    }
+    if (this->diskBytes + wire.size() > this->diskLimit) {
+        return OFFLINE_QUEUE_FULL;
+    }
+    MQTT_ERROR err = this->spill(wire);
+    if (err == NO_ERROR) {
+        this->count++;
+    }
+    return err;
+}
+
+MQTT_ERROR OfflineQueue::spill(const std::string& wire) {
+    if (this->segments.size() == 0 || this->segments.back().writeOffset >= SEGMENT_SIZE) {
+        std::string path = this->spillDir + "/mqttcc_offline_XXXXXX";
+        int fd = mkstemp(&path[0]);
+        if (fd == -1) {
+            return STORE_IO_ERROR;
+        }
+        if (!this->durable) {
+            // the file lives as long as the descriptor
+            unlink(path.c_str());
+            path = "";
+        }
+        this->segments.push_back(SpillSegment(fd, path));
+    }
+    SpillSegment& seg = this->segments.back();
+    std::string rec(4, '\0');
+    rec[0] = (char)(wire.size() >> 24);
+    rec[1] = (char)(wire.size() >> 16);
+    rec[2] = (char)(wire.size() >> 8);
+    rec[3] = (char)wire.size();
+    rec.append(wire);
+    if (pwrite(seg.fd, rec.data(), rec.size(), seg.writeOffset) != (ssize_t)rec.size()) {
+        return STORE_IO_ERROR;
+    }
+    seg.writeOffset += rec.size();
+    seg.count++;
+    this->diskBytes += wire.size();
+    return NO_ERROR;
+}
+
+MQTT_ERROR OfflineQueue::readSegment(SpillSegment& seg, uint32_t max, std::vector<std::string>* resp, bool consume) {
+    uint64_t offset = seg.readOffset;
+    std::string chunk;
+    uint32_t n = 0;
+    while (n < max && offset < seg.writeOffset) {
+        chunk.resize(seg.writeOffset - offset < READ_CHUNK ? seg.writeOffset - offset : READ_CHUNK);
+        if (pread(seg.fd, &chunk[0], chunk.size(), offset) != (ssize_t)chunk.size()) {
+            return STORE_IO_ERROR;
+        }
+        const uint8_t* buf = (const uint8_t*)chunk.data();
+        uint64_t used = 0;
+        while (n < max && used + 4 <= chunk.size()) {
+            uint32_t len = (uint32_t)buf[used] << 24 | (uint32_t)buf[used + 1] << 16 | (uint32_t)buf[used + 2] << 8 | buf[used + 3];
+            if (used + 4 + len > chunk.size()) {
+                if (used == 0) {
+                    // a record larger than the chunk
+                    chunk.resize(4 + len);
+                    if (pread(seg.fd, &chunk[0], chunk.size(), offset) != (ssize_t)chunk.size()) {
+                        return STORE_IO_ERROR;
+                    }
+                    buf = (const uint8_t*)chunk.data();
+                } else {
+                    break;
+                }
+            }
+            resp->push_back(chunk.substr(used + 4, len));
+            used += 4 + len;
+            n++;
+            if (consume) {
+                this->diskBytes -= len;
+            }
+        }
+        if (used == 0) {
+            return STORE_CORRUPTED;
+        }
+        offset += used;
+    }
+    if (consume) {
+        seg.readOffset = offset;
+        seg.count -= n;
+    }
+    return NO_ERROR;
+}
+
+MQTT_ERROR OfflineQueue::pop(uint32_t max, std::vector<std::string>* resp) {
+    uint32_t n = 0;
+    while (n < max && this->memory.size() > 0) {
+        this->memoryBytes -= this->memory.front().size();
+        resp->push_back(std::string());
+        resp->back().swap(this->memory.front());
+        this->memory.pop_front();
+        n++;
+    }
+    while (n < max && this->segments.size() > 0) {
+        SpillSegment& seg = this->segments.front();
+        size_t before = resp->size();
+        MQTT_ERROR err = this->readSegment(seg, max - n, resp, true);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        n += resp->size() - before;
+        if (seg.readOffset < seg.writeOffset) {
+            break;
+        }
+        this->closeSegment(seg, true);
+        this->segments.pop_front();
+    }
+    this->count -= n;
+    return NO_ERROR;
+}
+
+// every queued message in order, without removing them
+MQTT_ERROR OfflineQueue::peekAll(std::vector<std::string>* resp) {
+    resp->insert(resp->end(), this->memory.begin(), this->memory.end());
+    for (std::list<SpillSegment>::iterator it = this->segments.begin(); it != this->segments.end(); it++) {
+        MQTT_ERROR err = this->readSegment(*it, 0xffffffff, resp, false);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    return NO_ERROR;
+}
+
+// the queue for a session checkpoint: messages in memory inline, spilled ones
+// as ranges of their segments, synced first. Segments that are not linked are
+// read back and stored inline as well.
+MQTT_ERROR OfflineQueue::checkpoint(std::list<OfflineRef>* resp) {
+    for (std::list<std::string>::iterator it = this->memory.begin(); it != this->memory.end(); it++) {
+        resp->push_back(OfflineRef(*it));
+    }
+    for (std::list<SpillSegment>::iterator it = this->segments.begin(); it != this->segments.end(); it++) {
+        if (it->path.size() > 0) {
+            if (fdatasync(it->fd) != 0) {
+                return STORE_IO_ERROR;
+            }
+            resp->push_back(OfflineRef(it->path, it->readOffset, it->writeOffset, it->count, 0));
+            continue;
+        }
+        std::vector<std::string> queued;
+        MQTT_ERROR err = this->readSegment(*it, 0xffffffff, &queued, false);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        for (std::vector<std::string>::iterator m = queued.begin(); m != queued.end(); m++) {
+            resp->push_back(OfflineRef(*m));
+        }
+    }
+    return NO_ERROR;
+}
+
+// appends what a checkpoint stored, a referenced segment is taken over as it is
+MQTT_ERROR OfflineQueue::restore(const OfflineRef& ref) {
+    if (ref.segment.size() == 0) {
+        return this->push(ref.wire);
+    }
+    if (ref.skip >= ref.count) {
+        unlink(ref.segment.c_str());
+        return NO_ERROR;
+    }
+    int fd = open(ref.segment.c_str(), O_RDWR);
+    if (fd < 0) {
+        return STORE_IO_ERROR;
+    }
+    SpillSegment seg(fd, ref.segment);
+    seg.readOffset = ref.readOffset;
+    seg.writeOffset = ref.writeOffset;
+    seg.count = ref.count;
+    this->segments.push_back(seg);
+    this->diskBytes += ref.writeOffset - ref.readOffset - 4 * (uint64_t)ref.count;
+    this->count += ref.count;
+    if (ref.skip > 0) {
+        std::vector<std::string> taken;
+        MQTT_ERROR err = this->readSegment(this->segments.back(), ref.skip, &taken, true);
+        if (err != NO_ERROR) {
+            return err;
+        }
+        this->count -= taken.size();
+    }
+    return NO_ERROR;
+}
+
+// once a checkpoint without them is durable
+void OfflineQueue::releaseRetired() {
+    for (std::vector<std::string>::iterator it = this->retired.begin(); it != this->retired.end(); it++) {
+        unlink(it->c_str());
+    }
+    this->retired.clear();
+}
+
+uint32_t OfflineQueue::size() {
+    return this->count;
+}
+
+uint64_t OfflineQueue::bytes() {
+    return this->memoryBytes + this->diskBytes;
+}
+
+uint64_t OfflineQueue::memoryUsed() {
+    return this->memoryBytes;
+}
@@ -0,0 +1,68 @@
+#ifndef MQTT_OFFLINEQUEUE_H_
+#define MQTT_OFFLINEQUEUE_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <list>
+#include <string>
+#include <vector>
+
+struct SpillSegment {
+    SpillSegment(int fd, const std::string& path) : fd(fd), path(path), readOffset(0), writeOffset(0), count(0) {};
+    int fd;
+    std::string path; // empty once unlinked
+    uint64_t readOffset;
+    uint64_t writeOffset;
+    uint32_t count; // messages not read yet
+};
+
+// a queued message as a session checkpoint stores it: inline, or when segment
+// is set the count messages of that spill file from readOffset on, the first
+// skip of which have been taken since
+struct OfflineRef {
+    OfflineRef(const std::string& wire) : wire(wire), readOffset(0), writeOffset(0), count(1), skip(0) {};
+    OfflineRef(const std::string& segment, uint64_t readOffset, uint64_t writeOffset, uint32_t count, uint32_t skip) : segment(segment), readOffset(readOffset), writeOffset(writeOffset), count(count), skip(skip) {};
+    std::string wire;
+    std::string segment;
+    uint64_t readOffset;
+    uint64_t writeOffset;
+    uint32_t count;
+    uint32_t skip;
+};
+
+// FIFO of encoded QoS1/2 publishes for a session that is offline or still
+// catching up. Up to memoryLimit bytes stay in memory, the rest is appended to
+// segment files in spillDir and read back in large chunks. The segments of a
+// durable queue stay linked, so a checkpoint refers to them instead of copying
+// them, and a drained one is only unlinked once a newer checkpoint is written.
+class OfflineQueue {
+    std::list<std::string> memory;
+    std::list<SpillSegment> segments;
+    std::vector<std::string> retired; // drained segments the last checkpoint may still refer to
+    uint64_t memoryBytes;
+    uint64_t diskBytes;
+    uint32_t count;
+    MQTT_ERROR spill(const std::string& wire);
+    MQTT_ERROR readSegment(SpillSegment& seg, uint32_t max, std::vector<std::string>* resp, bool consume);
+    void closeSegment(SpillSegment& seg, bool retire);
+public:
+    uint64_t memoryLimit;
+    uint64_t diskLimit;
+    std::string spillDir;
+    bool durable; // set before the first push that may spill
+    OfflineQueue();
+    ~OfflineQueue();
+    void swap(OfflineQueue& q);
+    MQTT_ERROR push(const std::string& wire);
+    MQTT_ERROR pop(uint32_t max, std::vector<std::string>* resp);
+    MQTT_ERROR peekAll(std::vector<std::string>* resp);
+    MQTT_ERROR checkpoint(std::list<OfflineRef>* resp);
+    MQTT_ERROR restore(const OfflineRef& ref);
+    void releaseRetired();
+    void clear();
+    uint32_t size();
+    uint64_t bytes();
+    uint64_t memoryUsed(); // the part of bytes not spilled
+};
+
+#endif // MQTT_OFFLINEQUEUE_H_
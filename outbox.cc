@@ -0,0 +1,199 @@
+#include "outbox.h"
+#include "util.h"
+#include "stats.h"
+#include "latency.h"
+#include <chrono>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <vector>
+
+// frames are coalesced into writes of about this size
+const static size_t WRITE_BATCH = 64 * 1024;
+const static uint8_t PUBLISH_TYPE = 3;
+// how long close waits for the control lane before the socket is shut down
+const static uint32_t CLOSE_DRAIN_MS = 100;
+
+Outbox::Outbox(int sock, uint64_t highWater, uint64_t lowWater, uint64_t limit, DropPolicy dropPolicy) : sock(sock), queuedBytes(0), congested(false), closed(false), sendingControl(false), droppedCount(0), writtenBytes(0), overflowed(false), highWater(highWater), lowWater(lowWater), limit(limit), dropPolicy(dropPolicy) {
+    this->writer = std::thread(&Outbox::writeLoop, this);
+}
+
+Outbox::~Outbox() {
+    this->close();
+    this->writer.join();
+}
+
+// publishes still queued are dropped, with drain control frames are written if
+// the peer takes them within CLOSE_DRAIN_MS. Wakes the writer even if it is
+// blocked on a peer that stopped reading.
+void Outbox::close(bool drain) {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    if (this->closed) {
+        return;
+    }
+    this->closed = true;
+    this->frames.clear();
+    this->cv.notify_all();
+    if (drain) {
+        this->cv.wait_for(lock, std::chrono::milliseconds(CLOSE_DRAIN_MS), [this]{return this->control.size() == 0 && !this->sendingControl;});
+    }
+    this->control.clear();
+    this->queuedBytes = 0;
+    shutdown(this->sock, SHUT_RDWR);
+    this->cv.notify_all();
+}
+
+bool Outbox::dropOldest() {
+    for (std::deque<OutboundFrame>::iterator it = this->frames.begin(); it != this->frames.end(); it++) {
+        if (it->droppable) {
+            this->queuedBytes -= it->wire.size();
+            this->frames.erase(it);
+            return true;
+        }
+    }
+    return false;
+}
+
+// frames pushed after the connection is closed are discarded like a write to a dead socket
+MQTT_ERROR Outbox::push(const uint8_t* wire, uint32_t len, bool droppable) {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    if (this->closed) {
+        return NO_ERROR;
+    }
+    if (!this->congested && this->queuedBytes + len > this->highWater) {
+        this->congested = true;
+    }
+    if (this->congested && droppable) {
+        this->droppedCount++;
+        statAdd(STAT_PUBLISHES_DROPPED, 1);
+        if (this->dropPolicy == DROP_NEWEST || !this->dropOldest()) {
+            return NO_ERROR;
+        }
+    }
+    if (this->queuedBytes + len > this->limit) {
+        this->overflowed = true;
+        lock.unlock();
+        emitError(OUTBOUND_QUEUE_FULL);
+        // runs on whichever thread is sending, often a publisher holding the
+        // broker lock, and a peer this far behind would not take the control
+        // lane either
+        this->close(false);
+        return OUTBOUND_QUEUE_FULL;
+    }
+    if (len > 0 && wire[0] >> 4 != PUBLISH_TYPE) {
+        this->control.push_back(OutboundFrame(wire, len, false, monotonicMicros()));
+    } else {
+        this->frames.push_back(OutboundFrame(wire, len, droppable, MQTT_STAGE_LATENCY && latencySampled() ? monotonicMicros() : 0));
+        this->frames.back().tag = traceCurrent();
+        statAdd(STAT_PUBLISHES_SENT, 1);
+    }
+    statAdd(STAT_MESSAGES_SENT, 1);
+    statAdd(STAT_BYTES_SENT, len);
+    this->queuedBytes += len;
+    this->cv.notify_one();
+    return NO_ERROR;
+}
+
+void Outbox::writeLoop() {
+    std::unique_lock<std::mutex> lock(this->mtx);
+    std::string batch;
+    std::vector<uint64_t> stamps;
+    std::vector<uint64_t> publishStamps;
+    std::vector<TraceTag> traced;
+    while (true) {
+        this->cv.wait(lock, [this]{return this->control.size() > 0 || this->frames.size() > 0 || this->closed;});
+        if (this->closed && this->control.size() == 0) {
+            return;
+        }
+        batch.clear();
+        stamps.clear();
+        publishStamps.clear();
+        traced.clear();
+        while (this->control.size() > 0) {
+            batch.append(this->control.front().wire);
+            stamps.push_back(this->control.front().queuedAt);
+            this->control.pop_front();
+        }
+        while (this->frames.size() > 0 && batch.size() < WRITE_BATCH) {
+            batch.append(this->frames.front().wire);
+            if (this->frames.front().queuedAt != 0) {
+                publishStamps.push_back(this->frames.front().queuedAt);
+            }
+            if (this->frames.front().tag.trace != 0) {
+                traced.push_back(this->frames.front().tag);
+            }
+            this->frames.pop_front();
+        }
+        this->sendingControl = stamps.size() > 0;
+        lock.unlock();
+
+        const char* p = batch.data();
+        size_t left = batch.size();
+        while (left > 0) {
+            // a vanished peer must not raise SIGPIPE
+            ssize_t n = send(this->sock, p, left, MSG_NOSIGNAL);
+            if (n < 0) {
+                break;
+            }
+            p += n;
+            left -= n;
+        }
+
+        lock.lock();
+        this->sendingControl = false;
+        this->cv.notify_all();
+        if (left > 0) {
+            // the read loop sees the broken connection and ends the session
+            this->closed = true;
+            this->control.clear();
+            this->frames.clear();
+            this->queuedBytes = 0;
+            return;
+        }
+        if (this->closed) {
+            continue;
+        }
+        this->queuedBytes -= batch.size();
+        this->writtenBytes += batch.size();
+        uint64_t now = monotonicMicros();
+        for (size_t i = 0; i < stamps.size(); i++) {
+            uint64_t us = now - stamps[i];
+            this->controlStats.count++;
+            this->controlStats.totalUs += us;
+            if (us > this->controlStats.maxUs) {
+                this->controlStats.maxUs = us;
+            }
+        }
+        for (size_t i = 0; i < traced.size(); i++) {
+            tracePoint(TRACE_WRITTEN, traced[i], "", 0);
+        }
+        for (size_t i = 0; i < publishStamps.size(); i++) {
+            latencyRecord(STAGE_WRITE, (now - publishStamps[i]) * 1000);
+        }
+        if (this->congested && this->queuedBytes <= this->lowWater) {
+            this->congested = false;
+        }
+    }
+}
+
+uint64_t Outbox::bytes() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->queuedBytes;
+}
+
+uint64_t Outbox::dropped() {
+    return this->droppedCount.load();
+}
+
+// bytes handed to the socket so far, sampled to get a drain rate
+uint64_t Outbox::written() {
+    return this->writtenBytes.load();
+}
+
+bool Outbox::overflow() {
+    return this->overflowed.load();
+}
+
+LatencyStats Outbox::controlLatency() {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    return this->controlStats;
+}
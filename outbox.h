@@ -0,0 +1,77 @@
+#ifndef MQTT_OUTBOX_H_
+#define MQTT_OUTBOX_H_
+
+#include "mqttError.h"
+#include "trace.h"
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum DropPolicy {
+    DROP_NEWEST, // the QoS0 message being sent is discarded
+    DROP_OLDEST, // the oldest QoS0 message still queued makes room for it
+};
+
+struct OutboundFrame {
+    OutboundFrame(const uint8_t* wire, uint32_t len, bool droppable, uint64_t queuedAt) : wire((const char*)wire, len), droppable(droppable), queuedAt(queuedAt) {};
+    std::string wire;
+    bool droppable; // QoS0 PUBLISH
+    uint64_t queuedAt; // us, monotonic, PUBLISH only when timed by latency.h
+    TraceTag tag; // PUBLISH of a sampled message
+};
+
+struct LatencyStats {
+    LatencyStats() : count(0), totalUs(0), maxUs(0) {};
+    uint64_t count;
+    uint64_t totalUs;
+    uint64_t maxUs;
+};
+
+// per connection send queue drained by its own writer thread, so a peer that
+// reads slowly only ever blocks that thread. Above highWater QoS0 publishes are
+// dropped until the queue is back under lowWater. Other frames are always
+// queued, and once they pass limit the connection is shut down: the read loop
+// ends the session and QoS1/2 messages come back from the inflight window on
+// resume, as they would after any broken connection.
+// Everything but PUBLISH goes to a control lane that is always written first,
+// so acks and PINGRESP do not wait behind a burst of large payloads. Closing
+// still gives the control lane a short while to reach the peer, so a refusing
+// CONNACK is not lost with the socket; an overflow closes without waiting.
+class Outbox {
+    int sock;
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<OutboundFrame> control;
+    std::deque<OutboundFrame> frames;
+    LatencyStats controlStats; // from push to the end of the write that carried it
+    uint64_t queuedBytes;
+    bool congested;
+    bool closed;
+    bool sendingControl; // the writer holds control frames that are not on the wire yet
+    std::atomic<uint64_t> droppedCount;
+    std::atomic<uint64_t> writtenBytes;
+    std::atomic<bool> overflowed;
+    std::thread writer;
+    void writeLoop();
+    bool dropOldest();
+public:
+    uint64_t highWater;
+    uint64_t lowWater;
+    uint64_t limit;
+    DropPolicy dropPolicy;
+    Outbox(int sock, uint64_t highWater, uint64_t lowWater, uint64_t limit, DropPolicy dropPolicy);
+    ~Outbox();
+    MQTT_ERROR push(const uint8_t* wire, uint32_t len, bool droppable);
+    void close(bool drain = true);
+    uint64_t bytes();
+    uint64_t dropped();
+    uint64_t written();
+    bool overflow();
+    LatencyStats controlLatency();
+};
+
+#endif // MQTT_OUTBOX_H_
@@ -0,0 +1,127 @@
+#include "packetID.h"
+#include <string.h>
+
+PacketIDPool::PacketIDPool() : groups(NULL), count(0), cursor(1) {
+    memset(this->full, 0, sizeof(this->full));
+}
+
+PacketIDPool::PacketIDPool(const PacketIDPool& p) : groups(NULL), count(0), cursor(1) {
+    *this = p;
+}
+
+PacketIDPool& PacketIDPool::operator=(const PacketIDPool& p) {
+    if (this == &p) {
+        return *this;
+    }
+    this->freeGroups();
+    if (p.groups != NULL) {
+        for (uint32_t g = 0; g < 16; g++) {
+            if (p.groups[g] != NULL) {
+                memcpy(this->group(g), p.groups[g], sizeof(uint64_t) * 64);
+            }
+        }
+    }
+    memcpy(this->full, p.full, sizeof(this->full));
+    this->count = p.count;
+    this->cursor = p.cursor;
+    return *this;
+}
+
+PacketIDPool::~PacketIDPool() {
+    this->freeGroups();
+}
+
+uint64_t* PacketIDPool::group(uint32_t g) {
+    if (this->groups == NULL) {
+        this->groups = new uint64_t*[16];
+        memset(this->groups, 0, sizeof(uint64_t*) * 16);
+    }
+    if (this->groups[g] == NULL) {
+        this->groups[g] = new uint64_t[64];
+        memset(this->groups[g], 0, sizeof(uint64_t) * 64);
+        if (g == 0) {
+            this->groups[g][0] = 1;
+        }
+    }
+    return this->groups[g];
+}
+
+void PacketIDPool::freeGroups() {
+    if (this->groups == NULL) {
+        return;
+    }
+    for (uint32_t g = 0; g < 16; g++) {
+        delete[] this->groups[g];
+    }
+    delete[] this->groups;
+    this->groups = NULL;
+}
+
+bool PacketIDPool::acquire(uint16_t* id) {
+    if (this->count == 65535) {
+        return false;
+    }
+    uint32_t startWord = (this->cursor >> 6) & 1023;
+    uint32_t startSummary = startWord >> 6;
+    // the 17th round revisits the first summary word for the words before startWord
+    for (uint32_t n = 0; n <= 16; n++) {
+        uint32_t s = (startSummary + n) & 15;
+        uint64_t avail = ~this->full[s];
+        if (n == 0) {
+            avail &= ~0ULL << (startWord & 63);
+        }
+        if (avail == 0) {
+            continue;
+        }
+        uint32_t w = (s << 6) + __builtin_ctzll(avail);
+        uint64_t* word = this->group(s) + (w & 63);
+        uint32_t bit = __builtin_ctzll(~*word);
+        *word |= 1ULL << bit;
+        if (*word == ~0ULL) {
+            this->full[s] |= 1ULL << (w & 63);
+        }
+        this->count++;
+        *id = (uint16_t)((w << 6) + bit);
+        this->cursor = *id + 1;
+        return true;
+    }
+    return false;
+}
+
+void PacketIDPool::mark(uint16_t id) {
+    if (id == 0 || this->isUsed(id)) {
+        return;
+    }
+    uint32_t w = id >> 6;
+    uint64_t* word = this->group(w >> 6) + (w & 63);
+    *word |= 1ULL << (id & 63);
+    if (*word == ~0ULL) {
+        this->full[w >> 6] |= 1ULL << (w & 63);
+    }
+    this->count++;
+}
+
+void PacketIDPool::release(uint16_t id) {
+    if (id == 0 || !this->isUsed(id)) {
+        return;
+    }
+    uint32_t w = id >> 6;
+    this->groups[w >> 6][w & 63] &= ~(1ULL << (id & 63));
+    this->full[w >> 6] &= ~(1ULL << (w & 63));
+    this->count--;
+    if (this->count == 0) {
+        this->freeGroups();
+    }
+}
+
+bool PacketIDPool::isUsed(uint16_t id) {
+    uint32_t g = id >> 12;
+    if (this->groups == NULL || this->groups[g] == NULL) {
+        return id == 0;
+    }
+    return (this->groups[g][(id >> 6) & 63] >> (id & 63)) & 1;
+}
+
+uint32_t PacketIDPool::size() {
+    return this->count;
+}
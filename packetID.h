@@ -0,0 +1,29 @@
+#ifndef MQTT_PACKETID_H_
+#define MQTT_PACKETID_H_
+
+#include <stdint.h>
+
+// two level bitmap of the 16bit packet ID space, id 0 is never handed out.
+// acquire looks at 16 summary words and one leaf word, so it is O(1) at any occupancy.
+// Leaf words are allocated in groups of 64 once an id in the group is taken and
+// freed when the pool empties, so an idle session costs no more than the object.
+class PacketIDPool {
+    uint64_t** groups;    // 16 groups of 64 words, bit set = id in use
+    uint64_t full[16];    // bit set = word i of the group has no free id
+    uint32_t count;
+    uint32_t cursor;      // search starts here so freed ids are not reused right away
+    uint64_t* group(uint32_t g);
+    void freeGroups();
+public:
+    PacketIDPool();
+    PacketIDPool(const PacketIDPool& p);
+    PacketIDPool& operator=(const PacketIDPool& p);
+    ~PacketIDPool();
+    bool acquire(uint16_t* id);
+    void mark(uint16_t id);
+    void release(uint16_t id);
+    bool isUsed(uint16_t id);
+    uint32_t size();
+};
+
+#endif // MQTT_PACKETID_H_
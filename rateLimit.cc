@@ -0,0 +1,30 @@
+#include "rateLimit.h"
+#include <algorithm>
+
+TokenBucket::TokenBucket(double rate, double burst) : rate(rate), burst(burst), tokens(burst), last(0) {}
+
+uint64_t TokenBucket::take(double n, uint64_t now) {
+    if (now > this->last) {
+        this->tokens = std::min(this->burst, this->tokens + (now - this->last) * this->rate / 1000000);
+        this->last = now;
+    }
+    this->tokens -= n;
+    if (this->tokens >= 0 || this->rate <= 0) {
+        return 0;
+    }
+    return (uint64_t)(-this->tokens * 1000000 / this->rate);
+}
+
+RateLimiter::RateLimiter(const RateLimit& limit) : messages(limit.messages, limit.messages), bytes(limit.bytes, limit.bytes), limitMessages(limit.messages > 0), limitBytes(limit.bytes > 0) {}
+
+uint64_t RateLimiter::admit(uint32_t length, uint64_t now) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    uint64_t wait = 0;
+    if (this->limitMessages) {
+        wait = this->messages.take(1, now);
+    }
+    if (this->limitBytes) {
+        wait = std::max(wait, this->bytes.take(length, now));
+    }
+    return wait;
+}
@@ -0,0 +1,41 @@
+#ifndef MQTT_RATELIMIT_H_
+#define MQTT_RATELIMIT_H_
+
+#include <stdint.h>
+#include <mutex>
+
+// fills at rate tokens per second up to burst. take always succeeds and may
+// leave the bucket in debt, the answer is how long until the debt is paid.
+class TokenBucket {
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t last; // us
+public:
+    TokenBucket(double rate, double burst);
+    uint64_t take(double n, uint64_t now); // us to wait, 0 if the tokens were there
+};
+
+// 0 is unlimited
+struct RateLimit {
+    RateLimit() : messages(0), bytes(0) {};
+    RateLimit(uint32_t messages, uint32_t bytes) : messages(messages), bytes(bytes) {};
+    uint32_t messages; // PUBLISH packets per second, also the burst
+    uint32_t bytes; // bytes of PUBLISH packets per second, also the burst
+    bool limited() const {return this->messages > 0 || this->bytes > 0;};
+};
+
+// a message and a byte bucket, shared by every connection of a user or owned
+// by one connection
+class RateLimiter {
+    std::mutex mtx;
+    TokenBucket messages;
+    TokenBucket bytes;
+    bool limitMessages;
+    bool limitBytes;
+public:
+    RateLimiter(const RateLimit& limit);
+    uint64_t admit(uint32_t length, uint64_t now); // us to wait before reading on
+};
+
+#endif // MQTT_RATELIMIT_H_
@@ -0,0 +1,415 @@
+#include "retainStore.h"
+#include "util.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// segment layout: magic, then records of
+// [remaining length(4)][qos(1)][topic length(2)][topic][payload], an empty payload removes the topic
+const static char SEGMENT_MAGIC[8] = {'M', 'Q', 'T', 'T', 'R', 'E', 'T', '1'};
+const static uint32_t RECORD_HEADER = 7;
+
+static uint64_t recordSize(const std::string& topic, uint32_t payloadLen) {
+    return RECORD_HEADER + topic.size() + payloadLen;
+}
+
+static bool memoryOnly(const std::string& topic) {
+    return topic.compare(0, 5, "$SYS/") == 0;
+}
+
+static uint32_t payloadSize(const RetainedMessage& m) {
+    return m.length > 0 ? m.length : m.payload.size();
+}
+
+RetainStore::RetainStore() : loadedLive(0), loadedEnd(0), indexEnd(0), loadDone(false), path(""), fd(-1), mapped(NULL), mappedSize(0), fileSize(0), liveBytes(0), indexed(true), compactThreshold(64*1024*1024) {}
+
+RetainStore::~RetainStore() {
+    if (this->loader.joinable()) {
+        this->loader.join();
+    }
+    if (this->mapped != NULL) {
+        munmap((void*)this->mapped, this->mappedSize);
+    }
+    if (this->fd >= 0) {
+        ::close(this->fd);
+    }
+}
+
+MQTT_ERROR RetainStore::open(const std::string path) {
+    this->ensureIndexed();
+    this->path = path;
+    this->fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (this->fd < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return STORE_IO_ERROR;
+    }
+    if (st.st_size == 0) {
+        if (write(this->fd, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != sizeof(SEGMENT_MAGIC)) {
+            return STORE_IO_ERROR;
+        }
+    }
+    MQTT_ERROR err = this->remap();
+    if (err != NO_ERROR) {
+        return err;
+    }
+    if (this->mappedSize < sizeof(SEGMENT_MAGIC) || memcmp(this->mapped, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0) {
+        return STORE_CORRUPTED;
+    }
+    this->messages.clear();
+    this->liveBytes = 0;
+    if (this->mappedSize == sizeof(SEGMENT_MAGIC)) {
+        return NO_ERROR;
+    }
+    this->indexed = false;
+    this->indexEnd = this->mappedSize;
+    this->loadDone = false;
+    this->loader = std::thread(&RetainStore::load, this);
+    return NO_ERROR;
+}
+
+MQTT_ERROR RetainStore::remap() {
+    if (this->mapped != NULL) {
+        munmap((void*)this->mapped, this->mappedSize);
+        this->mapped = NULL;
+    }
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return STORE_IO_ERROR;
+    }
+    this->mappedSize = st.st_size;
+    this->fileSize = st.st_size;
+    if (this->mappedSize == 0) {
+        return NO_ERROR;
+    }
+    void* p = mmap(NULL, this->mappedSize, PROT_READ, MAP_SHARED, this->fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        this->mappedSize = 0;
+        return STORE_IO_ERROR;
+    }
+    this->mapped = (const uint8_t*)p;
+    return NO_ERROR;
+}
+
+// runs on the loader thread, only reads the part of the mapping that existed at open
+void RetainStore::load() {
+    uint64_t pos = sizeof(SEGMENT_MAGIC);
+    while (pos + RECORD_HEADER <= this->indexEnd) {
+        const uint8_t* buf = this->mapped + pos;
+        uint32_t remain = (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+        uint8_t qos = buf[4];
+        uint16_t topicLen = (uint16_t)buf[5] << 8 | buf[6];
+        if (remain < 3 + (uint32_t)topicLen || pos + 4 + remain > this->indexEnd) {
+            break;
+        }
+        std::string topic((const char*)buf + RECORD_HEADER, topicLen);
+        uint32_t payloadLen = remain - 3 - topicLen;
+        if (memoryOnly(topic)) {
+            // left by an older version, the value applied since open is newer
+            pos += 4 + remain;
+            continue;
+        }
+        std::map<std::string, RetainedMessage>::iterator it = this->loaded.find(topic);
+        if (it != this->loaded.end()) {
+            this->loadedLive -= recordSize(topic, payloadSize(it->second));
+            this->loaded.erase(it);
+        }
+        if (payloadLen > 0) {
+            this->loaded.insert(std::make_pair(topic, RetainedMessage(qos, pos + RECORD_HEADER + topicLen, payloadLen)));
+            this->loadedLive += recordSize(topic, payloadLen);
+        }
+        pos += 4 + remain;
+    }
+    this->loadedEnd = pos;
+    this->loadDone = true;
+}
+
+bool RetainStore::ready() {
+    if (!this->indexed && this->loadDone) {
+        this->ensureIndexed();
+    }
+    return this->indexed;
+}
+
+// waits for the loader and puts what was applied since open over its index
+void RetainStore::ensureIndexed() {
+    if (this->indexed) {
+        return;
+    }
+    this->loader.join();
+    for (std::set<std::string>::iterator t = this->touched.begin(); t != this->touched.end(); t++) {
+        std::map<std::string, RetainedMessage>::iterator it = this->loaded.find(*t);
+        if (it != this->loaded.end()) {
+            this->loadedLive -= recordSize(*t, payloadSize(it->second));
+            this->loaded.erase(it);
+        }
+    }
+    for (std::map<std::string, RetainedMessage>::iterator it = this->messages.begin(); it != this->messages.end(); it++) {
+        std::pair<std::map<std::string, RetainedMessage>::iterator, bool> res = this->loaded.insert(*it);
+        if (!res.second) {
+            res.first->second = it->second;
+        }
+    }
+    this->messages.swap(this->loaded);
+    this->loaded.clear();
+    this->touched.clear();
+    this->liveBytes += this->loadedLive;
+    this->loadedLive = 0;
+    this->indexed = true;
+    if (this->loadedEnd != this->indexEnd) {
+        // torn record from a crash while appending, records applied since open come after it
+        MQTT_ERROR err = this->compact();
+        if (err != NO_ERROR) {
+            emitError(err);
+        }
+    }
+}
+
+std::string RetainStore::payloadOf(const RetainedMessage& m) {
+    if (m.length > 0) {
+        return std::string((const char*)this->mapped + m.offset, m.length);
+    }
+    return m.payload;
+}
+
+MQTT_ERROR RetainStore::append(const std::string topic, uint8_t qos, const std::string payload) {
+    std::string rec;
+    uint32_t remain = 3 + topic.size() + payload.size();
+    rec.reserve(4 + remain);
+    rec.push_back((char)(remain >> 24));
+    rec.push_back((char)(remain >> 16));
+    rec.push_back((char)(remain >> 8));
+    rec.push_back((char)remain);
+    rec.push_back((char)qos);
+    rec.push_back((char)(topic.size() >> 8));
+    rec.push_back((char)topic.size());
+    rec += topic;
+    rec += payload;
+    if (write(this->fd, rec.data(), rec.size()) != (ssize_t)rec.size()) {
+        perror("write");
+        return STORE_IO_ERROR;
+    }
+    this->fileSize += rec.size();
+    return NO_ERROR;
+}
+
+// appends are only written, the publish log holds what they came from until this
+MQTT_ERROR RetainStore::sync() {
+    if (this->fd < 0) {
+        return NO_ERROR;
+    }
+    if (fdatasync(this->fd) != 0) {
+        perror("fdatasync");
+        return STORE_IO_ERROR;
+    }
+    return NO_ERROR;
+}
+
+MQTT_ERROR RetainStore::compact() {
+    if (this->fd < 0) {
+        return NO_ERROR;
+    }
+    this->ensureIndexed();
+    std::string tmpPath = this->path + ".compact";
+    int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    std::string buf(SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    uint64_t written = 0;
+    std::vector<uint64_t> offsets;
+    offsets.reserve(this->messages.size());
+    for (std::map<std::string, RetainedMessage>::iterator it = this->messages.begin(); it != this->messages.end(); it++) {
+        if (memoryOnly(it->first)) {
+            continue;
+        }
+        std::string payload = this->payloadOf(it->second);
+        uint32_t remain = 3 + it->first.size() + payload.size();
+        buf.push_back((char)(remain >> 24));
+        buf.push_back((char)(remain >> 16));
+        buf.push_back((char)(remain >> 8));
+        buf.push_back((char)remain);
+        buf.push_back((char)it->second.qos);
+        buf.push_back((char)(it->first.size() >> 8));
+        buf.push_back((char)it->first.size());
+        buf += it->first;
+        offsets.push_back(written + buf.size());
+        buf += payload;
+        if (buf.size() >= 1024*1024) {
+            if (write(out, buf.data(), buf.size()) != (ssize_t)buf.size()) {
+                ::close(out);
+                return STORE_IO_ERROR;
+            }
+            written += buf.size();
+            buf.clear();
+        }
+    }
+    if (write(out, buf.data(), buf.size()) != (ssize_t)buf.size() || fsync(out) != 0) {
+        ::close(out);
+        return STORE_IO_ERROR;
+    }
+    ::close(out);
+    if (rename(tmpPath.c_str(), this->path.c_str()) != 0) {
+        perror("rename");
+        return STORE_IO_ERROR;
+    }
+    if (syncDirectory(this->path) != NO_ERROR) {
+        return STORE_IO_ERROR;
+    }
+    ::close(this->fd);
+    this->fd = ::open(this->path.c_str(), O_RDWR | O_APPEND);
+    if (this->fd < 0) {
+        return STORE_IO_ERROR;
+    }
+    MQTT_ERROR err = this->remap();
+    if (err != NO_ERROR) {
+        return err;
+    }
+    // every payload now lives in the new mapping
+    std::vector<uint64_t>::iterator off = offsets.begin();
+    for (std::map<std::string, RetainedMessage>::iterator it = this->messages.begin(); it != this->messages.end(); it++) {
+        if (memoryOnly(it->first)) {
+            continue;
+        }
+        it->second.length = payloadSize(it->second);
+        it->second.offset = *off++;
+        std::string().swap(it->second.payload);
+    }
+    this->liveBytes = this->fileSize - sizeof(SEGMENT_MAGIC);
+    return NO_ERROR;
+}
+
+MQTT_ERROR RetainStore::apply(const std::string topic, uint8_t qos, const std::string payload) {
+    if (topic.find_first_of("+#") != std::string::npos) {
+        return WILDCARD_CHARACTERS_IN_PUBLISH;
+    }
+    // the segment is neither read nor written for a memory only topic
+    bool persisted = !memoryOnly(topic);
+    if (persisted && !this->indexed) {
+        // an older value the loader finds is superseded, removing one it may find is logged
+        this->touched.insert(topic);
+    }
+    std::map<std::string, RetainedMessage>::iterator it = this->messages.find(topic);
+    if (this->fd >= 0 && persisted && (payload.size() > 0 || it != this->messages.end() || !this->indexed)) {
+        MQTT_ERROR err = this->append(topic, qos, payload);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+    if (it != this->messages.end() && persisted) {
+        this->liveBytes -= recordSize(topic, payloadSize(it->second));
+    }
+    if (payload.size() == 0) {
+        if (it != this->messages.end()) {
+            this->messages.erase(it);
+        }
+    } else if (it == this->messages.end()) {
+        this->messages.insert(std::make_pair(topic, RetainedMessage(qos, payload)));
+    } else {
+        it->second.qos = qos;
+        it->second.payload = payload;
+        it->second.length = 0;
+    }
+    if (payload.size() > 0 && persisted) {
+        this->liveBytes += recordSize(topic, payload.size());
+    }
+    return NO_ERROR;
+}
+
+// only known once indexed, a compaction copies every live record
+bool RetainStore::needsCompaction() {
+    if (this->fd < 0 || !this->indexed) {
+        return false;
+    }
+    uint64_t dead = this->fileSize - sizeof(SEGMENT_MAGIC) - this->liveBytes;
+    return dead > this->compactThreshold && dead > this->liveBytes;
+}
+
+const RetainedMessage* RetainStore::find(const std::string topic) {
+    if (!memoryOnly(topic)) {
+        this->ensureIndexed();
+    }
+    std::map<std::string, RetainedMessage>::iterator it = this->messages.find(topic);
+    if (it == this->messages.end()) {
+        return NULL;
+    }
+    if (it->second.length > 0) {
+        // single lookups keep their payload, scans do not
+        it->second.payload = this->payloadOf(it->second);
+        it->second.length = 0;
+    }
+    return &it->second;
+}
+
+size_t RetainStore::size() {
+    this->ensureIndexed();
+    return this->messages.size();
+}
+
+size_t RetainStore::indexedSize() {
+    return this->messages.size();
+}
+
+bool RetainStore::scan(const std::string filter, const std::string after, size_t max, std::vector<RetainedMatch>* resp) {
+    this->ensureIndexed();
+    std::string prefix = filter.substr(0, filter.find_first_of("+#"));
+    if (prefix.size() > 0 && prefix[prefix.size()-1] == '/') {
+        // "a/#" has to see "a" too
+        prefix.erase(prefix.size()-1);
+    }
+    std::map<std::string, RetainedMessage>::iterator it;
+    if (after.size() > 0) {
+        it = this->messages.upper_bound(after);
+    } else {
+        it = this->messages.lower_bound(prefix);
+    }
+    size_t found = 0;
+    for (; it != this->messages.end(); it++) {
+        if (it->first.compare(0, prefix.size(), prefix) != 0) {
+            return true;
+        }
+        if (!topicMatch(filter, it->first)) {
+            continue;
+        }
+        if (found == max) {
+            return false;
+        }
+        resp->push_back(RetainedMatch(it->first, it->second.qos, this->payloadOf(it->second)));
+        found++;
+    }
+    return true;
+}
+
+bool topicMatch(const std::string& filter, const std::string& topic) {
+    if (topic.size() > 0 && topic[0] == '$' && (filter.size() == 0 || filter[0] == '+' || filter[0] == '#')) {
+        return false;
+    }
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+        if (filter[f] == '#') {
+            return true;
+        }
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') {
+                t++;
+            }
+            f++;
+        } else {
+            if (t >= topic.size() || filter[f] != topic[t]) {
+                // "a/#" matches "a" as well
+                return t == topic.size() && filter.compare(f, std::string::npos, "/#") == 0;
+            }
+            f++;
+            t++;
+        }
+    }
+    return t == topic.size();
+}
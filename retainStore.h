@@ -0,0 +1,82 @@
+#ifndef MQTT_RETAINSTORE_H_
+#define MQTT_RETAINSTORE_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct RetainedMessage {
+    RetainedMessage(uint8_t qos, std::string payload) : qos(qos), payload(payload), offset(0), length(0) {};
+    RetainedMessage(uint8_t qos, uint64_t offset, uint32_t length) : qos(qos), payload(""), offset(offset), length(length) {};
+    uint8_t qos;
+    std::string payload;
+    // payload still in the mapped segment when length > 0
+    uint64_t offset;
+    uint32_t length;
+};
+
+struct RetainedMatch {
+    RetainedMatch(std::string topic, uint8_t qos, std::string payload) : topic(topic), qos(qos), payload(payload) {};
+    std::string topic;
+    uint8_t qos;
+    std::string payload;
+};
+
+// retained messages ordered by topic name, kept apart from the routing tree
+// so that a wildcard subscribe is a range scan over the literal prefix.
+// With open(), every change is appended to a segment file; on restart the
+// segment is mapped and indexed by a background thread, payloads stay in the
+// mapping until they are read. Until ready() has merged that index, changes
+// go to an overlay and only lookups of persisted topics wait for it.
+// Compaction is left to the owner, see needsCompaction(). $SYS/ topics are
+// republished by the broker itself and never go to the segment.
+class RetainStore {
+    std::map<std::string, RetainedMessage> messages;
+    // the loader's index of the segment as it was at open
+    std::map<std::string, RetainedMessage> loaded;
+    std::set<std::string> touched; // applied since open, newer than anything loaded
+    uint64_t loadedLive;
+    uint64_t loadedEnd; // end of the last complete record the loader found
+    uint64_t indexEnd; // segment size at open, the loader reads no further
+    std::thread loader;
+    std::atomic<bool> loadDone;
+    std::string path;
+    int fd;
+    const uint8_t* mapped;
+    uint64_t mappedSize;
+    uint64_t fileSize;
+    uint64_t liveBytes;
+    bool indexed;
+    void load();
+    void ensureIndexed();
+    std::string payloadOf(const RetainedMessage& m);
+    MQTT_ERROR append(const std::string topic, uint8_t qos, const std::string payload);
+    MQTT_ERROR remap();
+public:
+    uint64_t compactThreshold; // compact once dead records exceed this many bytes and the live data
+    RetainStore();
+    ~RetainStore();
+    MQTT_ERROR open(const std::string path);
+    MQTT_ERROR compact();
+    bool needsCompaction();
+    MQTT_ERROR sync();
+    // merges the index once the loader is done, never waits for it
+    bool ready();
+    MQTT_ERROR apply(const std::string topic, uint8_t qos, const std::string payload);
+    const RetainedMessage* find(const std::string topic);
+    size_t size();
+    // without waiting for the index, so before ready() only what was applied since open
+    size_t indexedSize();
+    // appends up to max matches of filter whose topic sorts after 'after',
+    // returns true when there is nothing left to scan
+    bool scan(const std::string filter, const std::string after, size_t max, std::vector<RetainedMatch>* resp);
+};
+
+bool topicMatch(const std::string& filter, const std::string& topic);
+
+#endif // MQTT_RETAINSTORE_H_
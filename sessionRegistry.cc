@@ -0,0 +1,91 @@
+#include "sessionRegistry.h"
+#include <functional>
+
+SessionRegistry::SessionRegistry(uint32_t shardCount) : count(0) {
+    // rounded up to a power of two so a shard is picked with a mask
+    uint32_t n = 1;
+    while (n < shardCount) {
+        n <<= 1;
+    }
+    this->shards = new RegistryShard[n];
+    this->mask = n - 1;
+}
+
+SessionRegistry::~SessionRegistry() {
+    delete[] this->shards;
+}
+
+RegistryShard& SessionRegistry::shardOf(const std::string& id) {
+    return this->shards[std::hash<std::string>()(id) & this->mask];
+}
+
+BrokerSideClient* SessionRegistry::find(const std::string& id) {
+    RegistryShard& s = this->shardOf(id);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    std::unordered_map<std::string, BrokerSideClient*>::iterator it = s.clients.find(id);
+    return it == s.clients.end() ? NULL : it->second;
+}
+
+// *previous is the session registered under id before, NULL when there was none
+void SessionRegistry::takeOver(const std::string& id, BrokerSideClient* bc, BrokerSideClient** previous) {
+    RegistryShard& s = this->shardOf(id);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    std::pair<std::unordered_map<std::string, BrokerSideClient*>::iterator, bool> res = s.clients.insert(std::make_pair(id, bc));
+    if (res.second) {
+        this->count++;
+        *previous = NULL;
+        return;
+    }
+    *previous = res.first->second;
+    res.first->second = bc;
+    if (*previous != bc) {
+        s.superseded.insert(*previous);
+    }
+}
+
+BrokerSideClient* SessionRegistry::exchange(const std::string& id, BrokerSideClient* bc) {
+    BrokerSideClient* previous;
+    this->takeOver(id, bc, &previous);
+    return previous;
+}
+
+// only removes id while it still maps to expected, a session that was taken over stays
+bool SessionRegistry::remove(const std::string& id, BrokerSideClient* expected) {
+    RegistryShard& s = this->shardOf(id);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    std::unordered_map<std::string, BrokerSideClient*>::iterator it = s.clients.find(id);
+    if (it == s.clients.end() || it->second != expected) {
+        return false;
+    }
+    s.clients.erase(it);
+    this->count--;
+    return true;
+}
+
+// the session bc was replaced under id has been handed over
+void SessionRegistry::release(const std::string& id, BrokerSideClient* bc) {
+    RegistryShard& s = this->shardOf(id);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    s.superseded.erase(bc);
+}
+
+// whether bc is registered under id or replaced there and not released yet
+bool SessionRegistry::holds(const std::string& id, BrokerSideClient* bc) {
+    RegistryShard& s = this->shardOf(id);
+    std::lock_guard<std::mutex> lock(s.mtx);
+    std::unordered_map<std::string, BrokerSideClient*>::iterator it = s.clients.find(id);
+    return (it != s.clients.end() && it->second == bc) || s.superseded.count(bc) > 0;
+}
+
+// copies every entry out, one shard locked at a time
+void SessionRegistry::entries(std::vector<std::pair<std::string, BrokerSideClient*> >* resp) {
+    resp->reserve(resp->size() + this->size());
+    for (uint32_t i = 0; i <= this->mask; i++) {
+        std::lock_guard<std::mutex> lock(this->shards[i].mtx);
+        resp->insert(resp->end(), this->shards[i].clients.begin(), this->shards[i].clients.end());
+    }
+}
+
+uint64_t SessionRegistry::size() {
+    return this->count.load();
+}
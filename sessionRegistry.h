@@ -0,0 +1,45 @@
+#ifndef MQTT_SESSIONREGISTRY_H_
+#define MQTT_SESSIONREGISTRY_H_
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class BrokerSideClient;
+
+struct RegistryShard {
+    std::mutex mtx;
+    std::unordered_map<std::string, BrokerSideClient*> clients;
+    std::unordered_set<BrokerSideClient*> superseded; // replaced, not handed over yet
+};
+
+// clientID -> session, split over independently locked shards so lookups and
+// CONNECTs of different clients do not wait on each other or on Broker::mtx.
+// takeOver installs a new connection and hands back the one it replaces in
+// one step; the replaced one stays held by the registry until release(), so
+// it is not freed before the newer CONNECT has taken its session over.
+class SessionRegistry {
+    RegistryShard* shards;
+    uint32_t mask;
+    std::atomic<uint64_t> count;
+    RegistryShard& shardOf(const std::string& id);
+public:
+    SessionRegistry(uint32_t shardCount = 64);
+    ~SessionRegistry();
+    BrokerSideClient* find(const std::string& id);
+    // *previous is written while the shard is locked, the next takeOver of id sees it
+    void takeOver(const std::string& id, BrokerSideClient* bc, BrokerSideClient** previous);
+    BrokerSideClient* exchange(const std::string& id, BrokerSideClient* bc);
+    bool remove(const std::string& id, BrokerSideClient* expected);
+    void release(const std::string& id, BrokerSideClient* bc);
+    bool holds(const std::string& id, BrokerSideClient* bc);
+    void entries(std::vector<std::pair<std::string, BrokerSideClient*> >* resp);
+    uint64_t size();
+};
+
+#endif // MQTT_SESSIONREGISTRY_H_
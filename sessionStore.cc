@@ -0,0 +1,369 @@
+#include "sessionStore.h"
+#include "util.h"
+#include <algorithm>
+
+enum SessionRecordType {
+    SESSION_RECORD = 'S',
+    DROP_RECORD = 'D',
+    SUBSCRIBE_RECORD = 'B',
+    UNSUBSCRIBE_RECORD = 'U',
+    INFLIGHT_RECORD = 'I',
+    ACK_RECORD = 'A',
+    PENDING_RECORD = 'P',
+    POP_RECORD = 'O',
+    OFFLINE_RECORD = 'Q',
+    OFFLINE_POP_RECORD = 'R',
+    OFFLINE_SEGMENT_RECORD = 'G',
+    APPLIED_RECORD = 'W',
+    RECEIVED_RECORD = 'V',
+    RELEASED_RECORD = 'L',
+};
+
+// sessions are logged until the log is this much larger than the last snapshot
+const static uint64_t COMPACT_SLACK = 64 * 1024 * 1024;
+
+static void putString(std::string* rec, const std::string& s) {
+    rec->push_back((char)(s.size() >> 8));
+    rec->push_back((char)s.size());
+    rec->append(s);
+}
+
+static bool getString(const uint8_t** buf, const uint8_t* end, std::string* s) {
+    if (end - *buf < 2) {
+        return false;
+    }
+    uint16_t len = (uint16_t)(*buf)[0] << 8 | (*buf)[1];
+    if (end - *buf < 2 + len) {
+        return false;
+    }
+    s->assign((const char*)*buf + 2, len);
+    *buf += 2 + len;
+    return true;
+}
+
+static void putU32(std::string* rec, uint32_t v) {
+    rec->push_back((char)(v >> 24));
+    rec->push_back((char)(v >> 16));
+    rec->push_back((char)(v >> 8));
+    rec->push_back((char)v);
+}
+
+static uint32_t getU32(const uint8_t* buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+static std::string record(SessionRecordType type, const std::string& id) {
+    std::string rec;
+    rec.push_back((char)type);
+    putString(&rec, id);
+    return rec;
+}
+
+std::string messageWire(Message* m) {
+    std::string wire(m->fh->length + 5, '\0');
+    int64_t len = m->getWire((uint8_t*)&wire[0]);
+    wire.resize(len < 0 ? 0 : len);
+    return wire;
+}
+
+Message* parseStoredMessage(const std::string& wire, MQTT_ERROR& err) {
+    const uint8_t* buf = (const uint8_t*)wire.data();
+    FixedHeader* fh = new FixedHeader();
+    int64_t len = fh->parseHeader(buf, err);
+    if (err != NO_ERROR) {
+        delete fh;
+        return NULL;
+    }
+    switch (fh->type) {
+    case PUBLISH_MESSAGE_TYPE:
+        return new PublishMessage(fh, buf + len, err);
+    case PUBREC_MESSAGE_TYPE:
+        return new PubrecMessage(fh, buf + len, err);
+    case PUBREL_MESSAGE_TYPE:
+        return new PubrelMessage(fh, buf + len, err);
+    default:
+        delete fh;
+        err = STORE_CORRUPTED;
+        return NULL;
+    }
+}
+
+// inflight messages of one session while the log is folded, keyed by packet ID
+// so an ACK finds its message without a scan, seq keeps the send order
+struct LoadingInflight {
+    std::map<uint64_t, StoredMessage> bySeq;
+    std::unordered_map<uint16_t, uint64_t> seqOf;
+};
+
+SessionStore::SessionStore(uint32_t commitWindowUs) : log(commitWindowUs), compactedSize(0), applied(0) {}
+
+MQTT_ERROR SessionStore::open(const std::string path) {
+    return this->log.open(path);
+}
+
+MQTT_ERROR SessionStore::load(std::unordered_map<std::string, StoredSession>* resp) {
+    std::unordered_map<std::string, LoadingInflight> inflight;
+    uint64_t seq = 0;
+    MQTT_ERROR err = this->log.replay([this, resp, &inflight, &seq](const uint8_t* data, uint32_t len) {
+        const uint8_t* end = data + len;
+        const uint8_t* buf = data + 1;
+        std::string id;
+        if (len < 1 || !getString(&buf, end, &id)) {
+            return;
+        }
+        SessionRecordType type = (SessionRecordType)data[0];
+        if (type == APPLIED_RECORD) {
+            if (end - buf >= 8) {
+                this->applied = (uint64_t)getU32(buf) << 32 | getU32(buf + 4);
+            }
+            return;
+        }
+        if (type == DROP_RECORD) {
+            resp->erase(id);
+            inflight.erase(id);
+            return;
+        }
+        StoredSession& s = (*resp)[id];
+        s.clientID = id;
+        std::string str;
+        switch (type) {
+        case SUBSCRIBE_RECORD:
+            if (getString(&buf, end, &str) && buf < end) {
+                s.subscriptions[str] = *buf;
+            }
+            break;
+        case UNSUBSCRIBE_RECORD:
+            if (getString(&buf, end, &str)) {
+                s.subscriptions.erase(str);
+            }
+            break;
+        case INFLIGHT_RECORD:
+        case ACK_RECORD:
+        {
+            if (end - buf < 2) {
+                break;
+            }
+            uint16_t pid = (uint16_t)buf[0] << 8 | buf[1];
+            LoadingInflight& l = inflight[id];
+            std::unordered_map<uint16_t, uint64_t>::iterator it = l.seqOf.find(pid);
+            if (it != l.seqOf.end()) {
+                l.bySeq.erase(it->second);
+                l.seqOf.erase(it);
+            }
+            if (type == INFLIGHT_RECORD) {
+                l.bySeq.insert(std::make_pair(seq, StoredMessage(pid, std::string((const char*)buf + 2, end - buf - 2))));
+                l.seqOf[pid] = seq++;
+            }
+            break;
+        }
+        case PENDING_RECORD:
+            s.pending.push_back(std::string((const char*)buf, end - buf));
+            break;
+        case POP_RECORD:
+            if (s.pending.size() > 0) {
+                s.pending.pop_front();
+            }
+            break;
+        case RECEIVED_RECORD:
+        case RELEASED_RECORD:
+        {
+            if (end - buf < 2) {
+                break;
+            }
+            uint16_t pid = (uint16_t)buf[0] << 8 | buf[1];
+            std::vector<uint16_t>::iterator it = std::find(s.received.begin(), s.received.end(), pid);
+            if (type == RECEIVED_RECORD && it == s.received.end()) {
+                s.received.push_back(pid);
+            } else if (type == RELEASED_RECORD && it != s.received.end()) {
+                s.received.erase(it);
+            }
+            break;
+        }
+        case OFFLINE_RECORD:
+            s.offline.push_back(OfflineRef(std::string((const char*)buf, end - buf)));
+            break;
+        case OFFLINE_SEGMENT_RECORD:
+        {
+            if (!getString(&buf, end, &str) || end - buf < 24) {
+                break;
+            }
+            uint64_t readOffset = (uint64_t)getU32(buf) << 32 | getU32(buf + 4);
+            uint64_t writeOffset = (uint64_t)getU32(buf + 8) << 32 | getU32(buf + 12);
+            s.offline.push_back(OfflineRef(str, readOffset, writeOffset, getU32(buf + 16), getU32(buf + 20)));
+            break;
+        }
+        case OFFLINE_POP_RECORD:
+        {
+            if (end - buf < 4) {
+                break;
+            }
+            // a drained segment stays listed, restoring it removes the file
+            std::list<OfflineRef>::iterator it = s.offline.begin();
+            for (uint32_t n = getU32(buf); n > 0 && it != s.offline.end(); ) {
+                if (it->segment.size() == 0) {
+                    it = s.offline.erase(it);
+                    n--;
+                } else if (it->skip < it->count) {
+                    it->skip++;
+                    n--;
+                } else {
+                    it++;
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    });
+    for (std::unordered_map<std::string, LoadingInflight>::iterator it = inflight.begin(); it != inflight.end(); it++) {
+        std::unordered_map<std::string, StoredSession>::iterator s = resp->find(it->first);
+        if (s == resp->end()) {
+            continue;
+        }
+        s->second.inflight.reserve(it->second.bySeq.size());
+        for (std::map<uint64_t, StoredMessage>::iterator m = it->second.bySeq.begin(); m != it->second.bySeq.end(); m++) {
+            s->second.inflight.push_back(m->second);
+        }
+    }
+    return err;
+}
+
+MQTT_ERROR SessionStore::compact(const std::vector<StoredSession>& sessions) {
+    std::vector<std::string> records;
+    if (this->applied > 0) {
+        std::string rec = record(APPLIED_RECORD, "");
+        putU32(&rec, (uint32_t)(this->applied >> 32));
+        putU32(&rec, (uint32_t)this->applied);
+        records.push_back(rec);
+    }
+    for (std::vector<StoredSession>::const_iterator s = sessions.begin(); s != sessions.end(); s++) {
+        records.push_back(record(SESSION_RECORD, s->clientID));
+        for (std::map<std::string, uint8_t>::const_iterator it = s->subscriptions.begin(); it != s->subscriptions.end(); it++) {
+            std::string rec = record(SUBSCRIBE_RECORD, s->clientID);
+            putString(&rec, it->first);
+            rec.push_back((char)it->second);
+            records.push_back(rec);
+        }
+        for (std::vector<StoredMessage>::const_iterator it = s->inflight.begin(); it != s->inflight.end(); it++) {
+            std::string rec = record(INFLIGHT_RECORD, s->clientID);
+            rec.push_back((char)(it->id >> 8));
+            rec.push_back((char)it->id);
+            rec.append(it->wire);
+            records.push_back(rec);
+        }
+        for (std::list<std::string>::const_iterator it = s->pending.begin(); it != s->pending.end(); it++) {
+            records.push_back(record(PENDING_RECORD, s->clientID) + *it);
+        }
+        for (std::list<OfflineRef>::const_iterator it = s->offline.begin(); it != s->offline.end(); it++) {
+            if (it->segment.size() == 0) {
+                records.push_back(record(OFFLINE_RECORD, s->clientID) + it->wire);
+                continue;
+            }
+            std::string rec = record(OFFLINE_SEGMENT_RECORD, s->clientID);
+            putString(&rec, it->segment);
+            putU32(&rec, (uint32_t)(it->readOffset >> 32));
+            putU32(&rec, (uint32_t)it->readOffset);
+            putU32(&rec, (uint32_t)(it->writeOffset >> 32));
+            putU32(&rec, (uint32_t)it->writeOffset);
+            putU32(&rec, it->count);
+            putU32(&rec, it->skip);
+            records.push_back(rec);
+        }
+        for (std::vector<uint16_t>::const_iterator it = s->received.begin(); it != s->received.end(); it++) {
+            std::string rec = record(RECEIVED_RECORD, s->clientID);
+            rec.push_back((char)(*it >> 8));
+            rec.push_back((char)*it);
+            records.push_back(rec);
+        }
+    }
+    MQTT_ERROR err = this->log.rewrite(records);
+    if (err == NO_ERROR) {
+        this->compactedSize = this->log.size();
+    }
+    return err;
+}
+
+bool SessionStore::needsCompaction() {
+    return this->log.size() > 2 * this->compactedSize + COMPACT_SLACK;
+}
+
+void SessionStore::markApplied(uint64_t seq) {
+    this->applied = seq;
+    std::string rec = record(APPLIED_RECORD, "");
+    putU32(&rec, (uint32_t)(seq >> 32));
+    putU32(&rec, (uint32_t)seq);
+    this->log.append(rec);
+}
+
+uint64_t SessionStore::appliedPublishes() {
+    return this->applied;
+}
+
+void SessionStore::putSession(const std::string& id) {
+    this->log.append(record(SESSION_RECORD, id));
+}
+
+void SessionStore::dropSession(const std::string& id) {
+    this->log.append(record(DROP_RECORD, id));
+}
+
+void SessionStore::subscribe(const std::string& id, const std::string& topic, uint8_t qos) {
+    std::string rec = record(SUBSCRIBE_RECORD, id);
+    putString(&rec, topic);
+    rec.push_back((char)qos);
+    this->log.append(rec);
+}
+
+void SessionStore::unsubscribe(const std::string& id, const std::string& topic) {
+    std::string rec = record(UNSUBSCRIBE_RECORD, id);
+    putString(&rec, topic);
+    this->log.append(rec);
+}
+
+void SessionStore::storeInflight(const std::string& id, uint16_t packetID, Message* m) {
+    std::string rec = record(INFLIGHT_RECORD, id);
+    rec.push_back((char)(packetID >> 8));
+    rec.push_back((char)packetID);
+    rec.append(messageWire(m));
+    this->log.append(rec);
+}
+
+void SessionStore::removeInflight(const std::string& id, uint16_t packetID) {
+    std::string rec = record(ACK_RECORD, id);
+    rec.push_back((char)(packetID >> 8));
+    rec.push_back((char)packetID);
+    this->log.append(rec);
+}
+
+void SessionStore::pushPending(const std::string& id, Message* m) {
+    this->log.append(record(PENDING_RECORD, id) + messageWire(m));
+}
+
+void SessionStore::popPending(const std::string& id) {
+    this->log.append(record(POP_RECORD, id));
+}
+
+void SessionStore::pushOffline(const std::string& id, const std::string& wire) {
+    this->log.append(record(OFFLINE_RECORD, id) + wire);
+}
+
+void SessionStore::popOffline(const std::string& id, uint32_t n) {
+    std::string rec = record(OFFLINE_POP_RECORD, id);
+    putU32(&rec, n);
+    this->log.append(rec);
+}
+
+void SessionStore::markReceived(const std::string& id, uint16_t packetID) {
+    std::string rec = record(RECEIVED_RECORD, id);
+    rec.push_back((char)(packetID >> 8));
+    rec.push_back((char)packetID);
+    this->log.append(rec);
+}
+
+void SessionStore::releaseReceived(const std::string& id, uint16_t packetID) {
+    std::string rec = record(RELEASED_RECORD, id);
+    rec.push_back((char)(packetID >> 8));
+    rec.push_back((char)packetID);
+    this->log.append(rec);
+}
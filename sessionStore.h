@@ -0,0 +1,65 @@
+#ifndef MQTT_SESSIONSTORE_H_
+#define MQTT_SESSIONSTORE_H_
+
+#include "frame.h"
+#include "logFile.h"
+#include "mqttError.h"
+#include "offlineQueue.h"
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct StoredMessage {
+    StoredMessage(uint16_t id, std::string wire) : id(id), wire(wire) {};
+    uint16_t id;
+    std::string wire;
+};
+
+struct StoredSession {
+    std::string clientID;
+    std::map<std::string, uint8_t> subscriptions;
+    std::vector<StoredMessage> inflight; // in send order
+    std::list<std::string> pending;
+    std::list<OfflineRef> offline;
+    std::vector<uint16_t> received; // inbound QoS2 ids waiting for PUBREL
+};
+
+// durable state of cleanSession=false sessions. Every change is a small record
+// appended to a group committed LogFile; load() folds the log back into
+// sessions and compact() replaces it with one snapshot of the live state.
+class SessionStore {
+    LogFile log;
+    uint64_t compactedSize;
+    uint64_t applied;
+public:
+    SessionStore(uint32_t commitWindowUs);
+    ~SessionStore() {};
+    MQTT_ERROR open(const std::string path);
+    MQTT_ERROR load(std::unordered_map<std::string, StoredSession>* resp);
+    MQTT_ERROR compact(const std::vector<StoredSession>& sessions);
+    bool needsCompaction();
+    // publish log records up to seq have been routed and every session change
+    // they caused is in this log before the mark
+    void markApplied(uint64_t seq);
+    uint64_t appliedPublishes();
+    void putSession(const std::string& id);
+    void dropSession(const std::string& id);
+    void subscribe(const std::string& id, const std::string& topic, uint8_t qos);
+    void unsubscribe(const std::string& id, const std::string& topic);
+    void storeInflight(const std::string& id, uint16_t packetID, Message* m);
+    void removeInflight(const std::string& id, uint16_t packetID);
+    void pushPending(const std::string& id, Message* m);
+    void popPending(const std::string& id);
+    void pushOffline(const std::string& id, const std::string& wire);
+    void popOffline(const std::string& id, uint32_t n);
+    void markReceived(const std::string& id, uint16_t packetID);
+    void releaseReceived(const std::string& id, uint16_t packetID);
+};
+
+std::string messageWire(Message* m);
+Message* parseStoredMessage(const std::string& wire, MQTT_ERROR& err);
+
+#endif // MQTT_SESSIONSTORE_H_
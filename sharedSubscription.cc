@@ -0,0 +1,97 @@
+#include "sharedSubscription.h"
+#include <functional>
+
+size_t RoundRobinStrategy::pick(SharedGroup* g, const std::string&, SessionLoad* load) {
+    size_t n = g->members.size();
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = g->cursor++ % n;
+        if (load->isAvailable(g->members[idx].session)) {
+            return idx;
+        }
+    }
+    return n;
+}
+
+size_t LeastInflightStrategy::pick(SharedGroup* g, const std::string&, SessionLoad* load) {
+    size_t n = g->members.size();
+    size_t best = n;
+    uint32_t bestLoad = 0;
+    // start from the cursor so that ties are spread over the members
+    size_t start = g->cursor++;
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = (start + i) % n;
+        uint32_t session = g->members[idx].session;
+        if (!load->isAvailable(session)) {
+            continue;
+        }
+        uint32_t inflight = load->inflightCount(session);
+        if (best == n || inflight < bestLoad) {
+            best = idx;
+            bestLoad = inflight;
+            if (inflight == 0) {
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+size_t StickyHashStrategy::pick(SharedGroup* g, const std::string& topic, SessionLoad* load) {
+    size_t n = g->members.size();
+    if (n == 0) {
+        return n;
+    }
+    size_t start = std::hash<std::string>()(topic) % n;
+    for (size_t i = 0; i < n; i++) {
+        size_t idx = (start + i) % n;
+        if (load->isAvailable(g->members[idx].session)) {
+            return idx;
+        }
+    }
+    return n;
+}
+
+void SharedGroup::setMember(uint32_t session, uint8_t qos) {
+    for (std::vector<Subscriber>::iterator it = members.begin(); it != members.end(); it++) {
+        if (it->session == session) {
+            it->qos = qos;
+            return;
+        }
+    }
+    members.push_back(Subscriber(session, qos));
+}
+
+void SharedGroup::removeMember(uint32_t session) {
+    for (std::vector<Subscriber>::iterator it = members.begin(); it != members.end(); it++) {
+        if (it->session == session) {
+            members.erase(it);
+            return;
+        }
+    }
+}
+
+const Subscriber* SharedGroup::pick(const std::string& topic, ShareStrategy* strategy, SessionLoad* load) {
+    size_t idx = strategy->pick(this, topic, load);
+    if (idx >= members.size()) {
+        return NULL;
+    }
+    return &members[idx];
+}
+
+bool splitSharedTopic(const std::string topic, std::string* group, std::string* filter, MQTT_ERROR& err) {
+    if (topic.compare(0, SHARE_PREFIX.size(), SHARE_PREFIX) != 0) {
+        return false;
+    }
+    size_t sep = topic.find_first_of("/", SHARE_PREFIX.size());
+    if (sep == std::string::npos || sep == SHARE_PREFIX.size() || sep == topic.size() - 1) {
+        err = MALFORMED_SHARED_SUBSCRIPTION;
+        return true;
+    }
+    *group = topic.substr(SHARE_PREFIX.size(), sep - SHARE_PREFIX.size());
+    if (group->find_first_of("+#") != std::string::npos) {
+        err = MALFORMED_SHARED_SUBSCRIPTION;
+        return true;
+    }
+    *filter = topic.substr(sep + 1);
+    return true;
+}
@@ -0,0 +1,59 @@
+#ifndef MQTT_SHAREDSUBSCRIPTION_H_
+#define MQTT_SHAREDSUBSCRIPTION_H_
+
+#include "mqttError.h"
+#include "topicTree.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+const static std::string SHARE_PREFIX = "$share/";
+
+// implemented by whoever owns the sessions (Broker), lets strategies see member state
+class SessionLoad {
+public:
+    virtual ~SessionLoad() {};
+    virtual bool isAvailable(uint32_t session) = 0;
+    virtual uint32_t inflightCount(uint32_t session) = 0;
+};
+
+class SharedGroup;
+
+// picks one member of a group for a message, returns members.size() when nobody can take it
+class ShareStrategy {
+public:
+    virtual ~ShareStrategy() {};
+    virtual size_t pick(SharedGroup* g, const std::string& topic, SessionLoad* load) = 0;
+};
+
+class RoundRobinStrategy : public ShareStrategy {
+public:
+    size_t pick(SharedGroup* g, const std::string& topic, SessionLoad* load);
+};
+
+class LeastInflightStrategy : public ShareStrategy {
+public:
+    size_t pick(SharedGroup* g, const std::string& topic, SessionLoad* load);
+};
+
+class StickyHashStrategy : public ShareStrategy {
+public:
+    size_t pick(SharedGroup* g, const std::string& topic, SessionLoad* load);
+};
+
+class SharedGroup {
+public:
+    std::string name;
+    std::vector<Subscriber> members;
+    uint32_t cursor;
+    SharedGroup(std::string name) : name(name), cursor(0) {};
+    ~SharedGroup() {};
+    void setMember(uint32_t session, uint8_t qos);
+    void removeMember(uint32_t session);
+    const Subscriber* pick(const std::string& topic, ShareStrategy* strategy, SessionLoad* load);
+};
+
+// splits "$share/{group}/{filter}", returns false if the topic is not a shared one
+bool splitSharedTopic(const std::string topic, std::string* group, std::string* filter, MQTT_ERROR& err);
+
+#endif // MQTT_SHAREDSUBSCRIPTION_H_
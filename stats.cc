@@ -0,0 +1,51 @@
+#include "stats.h"
+#include <mutex>
+#include <vector>
+
+static std::mutex registryMtx;
+static std::vector<ThreadCounters*> live;
+static uint64_t retired[STAT_COUNT];
+
+ThreadCounters::ThreadCounters() {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        this->values[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+struct CounterSlot {
+    ThreadCounters counters;
+    CounterSlot() {
+        std::lock_guard<std::mutex> lock(registryMtx);
+        live.push_back(&this->counters);
+    };
+    ~CounterSlot() {
+        std::lock_guard<std::mutex> lock(registryMtx);
+        for (int i = 0; i < STAT_COUNT; i++) {
+            retired[i] += this->counters.values[i].load(std::memory_order_relaxed);
+        }
+        for (size_t i = 0; i < live.size(); i++) {
+            if (live[i] == &this->counters) {
+                live[i] = live.back();
+                live.pop_back();
+                break;
+            }
+        }
+    };
+};
+
+ThreadCounters* threadCounters() {
+    static thread_local CounterSlot slot;
+    return &slot.counters;
+}
+
+void statTotals(uint64_t totals[STAT_COUNT]) {
+    std::lock_guard<std::mutex> lock(registryMtx);
+    for (int i = 0; i < STAT_COUNT; i++) {
+        totals[i] = retired[i];
+    }
+    for (size_t t = 0; t < live.size(); t++) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            totals[i] += live[t]->values[i].load(std::memory_order_relaxed);
+        }
+    }
+}
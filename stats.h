@@ -0,0 +1,46 @@
+#ifndef MQTT_STATS_H_
+#define MQTT_STATS_H_
+
+#include <stdint.h>
+#include <atomic>
+
+enum StatID {
+    STAT_MESSAGES_RECEIVED,
+    STAT_MESSAGES_SENT,
+    STAT_BYTES_RECEIVED,
+    STAT_BYTES_SENT,
+    STAT_PUBLISHES_RECEIVED,
+    STAT_PUBLISHES_SENT,
+    STAT_PUBLISHES_DROPPED,
+    STAT_TOPIC_NODES_CREATED,
+    STAT_TOPIC_NODES_DELETED,
+    STAT_PUBLISHES_ROUTED,
+    STAT_FANOUT_DELIVERIES,
+    STAT_PUBLISHES_DENIED,
+    STAT_READ_PAUSES,
+    STAT_MEMORY_DISCONNECTS,
+    STAT_COUNT,
+};
+
+// written by its own thread only, so an update is a relaxed load and store
+// rather than a locked add. The aggregator reads them from other threads.
+struct ThreadCounters {
+    std::atomic<uint64_t> values[STAT_COUNT];
+    ThreadCounters();
+    void add(StatID id, uint64_t n) {
+        this->values[id].store(this->values[id].load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    };
+};
+
+// the calling thread's counters, registered on first use and folded into a
+// process wide total when the thread exits
+ThreadCounters* threadCounters();
+
+inline void statAdd(StatID id, uint64_t n) {
+    threadCounters()->add(id, n);
+}
+
+// sums every live thread and the threads that have exited
+void statTotals(uint64_t totals[STAT_COUNT]);
+
+#endif // MQTT_STATS_H_
@@ -2,55 +2,146 @@
 #include "mqttError.h"
 #include "util.h"
 #include "frame.h"
-#include <random>
-#include <chrono>
+#include "latency.h"
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
-Terminal::Terminal(const std::string id, const User* u, uint32_t keepAlive, const Will* w) : isConnecting(false), cleanSession(false), ID(id), user(u), will(w), keepAlive(keepAlive*1000000) {
-    std::random_device rnd;
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    mt(); // TODO: apply seed
-}
+Terminal::Terminal(const std::string id, const User* u, uint32_t keepAlive, const Will* w) : isConnecting(false), cleanSession(false), ID(id), user(u), will(w), keepAlive(keepAlive*1000000), maxInflight(65535), dispatchLock(NULL) {}
 
 Terminal::~Terminal() {
     delete this->user;
     delete this->will;
 }
 
+// ids of these types come from our own pool, the others echo the peer's id
+static bool ownsPacketID(Message* m) {
+    MessageType t = m->fh->type;
+    return t == PUBLISH_MESSAGE_TYPE || t == SUBSCRIBE_MESSAGE_TYPE || t == UNSUBSCRIBE_MESSAGE_TYPE;
+}
+
 MQTT_ERROR Terminal::ackMessage(uint16_t pID) {
-    if (this->packetIDMap.find(pID) == this->packetIDMap.end()) {
+    Message* m = this->inflight.remove(pID);
+    if (m == NULL) {
         return PACKET_ID_DOES_NOT_EXIST; // packet id does not exist
     }
-    Message* m = this->packetIDMap[pID];
     delete m;
-    this->packetIDMap.erase(pID);
-    return NO_ERROR;
+    if (this->tracedIDs.size() > 0) {
+        std::map<uint16_t, TraceTag>::iterator it = this->tracedIDs.find(pID);
+        if (it != this->tracedIDs.end()) {
+            tracePoint(TRACE_ACKED, it->second, "", pID);
+            this->tracedIDs.erase(it);
+        }
+    }
+    this->packetIDs.release(pID);
+    this->inflightRemoved(pID);
+    return this->drainPending();
 }
 
 MQTT_ERROR Terminal::sendMessage(Message* m) {
-    if (!this->isConnecting) {
-        return NOT_CONNECTED;
-    }
     uint16_t packetID = m->fh->packetID;
-    if (this->packetIDMap.find(packetID) != this->packetIDMap.end()) {
+    if (this->inflight.find(packetID) != NULL) {
         return PACKET_ID_IS_USED_ALREADY;
     }
-    MQTT_ERROR err = this->ct->sendMessage(m);
+    if (m->fh->type == PUBLISH_MESSAGE_TYPE && packetID > 0 && this->inflight.size() >= this->maxInflight) {
+        // window is full, an id is assigned again when the message leaves the queue
+        this->packetIDs.release(packetID);
+        m->fh->packetID = 0;
+        this->pendingPublishes.push_back(m);
+        this->pendingPushed(m);
+        return NO_ERROR;
+    }
+    MQTT_ERROR err = NOT_CONNECTED;
+    if (this->isConnecting) {
+        err = this->ct->sendMessage(m);
+    }
     if (err == NO_ERROR) {
-        if (m->fh->type == PUBLISH_MESSAGE_TYPE) {
-            if (packetID > 0) {
-                this->packetIDMap[packetID] = m;
-            } else {
-                delete m;
-            }
-        } else if (m->fh->type == PUBREC_MESSAGE_TYPE || m->fh->type == SUBSCRIBE_MESSAGE_TYPE || m->fh->type == UNSUBSCRIBE_MESSAGE_TYPE || m->fh->type == PUBREL_MESSAGE_TYPE) {
-            if (packetID == 0) {
-                return PACKET_ID_SHOULD_NOT_BE_ZERO;
+        err = this->trackSent(m);
+    } else if (err == OUTBOUND_QUEUE_FULL) {
+        // the connection is closed for it, a QoS1/2 message comes back on resume like any unacked one
+        this->trackSent(m);
+    } else if (ownsPacketID(m)) {
+        // the id was acquired for this message only
+        this->packetIDs.release(packetID);
+    }
+    return err;
+}
+
+MQTT_ERROR Terminal::sendMessages(std::vector<Message*>& ms) {
+    for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+        if (this->inflight.find((*it)->fh->packetID) != NULL) {
+            return PACKET_ID_IS_USED_ALREADY;
+        }
+    }
+    MQTT_ERROR err = NOT_CONNECTED;
+    if (this->isConnecting) {
+        err = this->ct->sendMessages(ms);
+    }
+    if (err != NO_ERROR) {
+        for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+            if (err == OUTBOUND_QUEUE_FULL) {
+                this->trackSent(*it);
+            } else if (ownsPacketID(*it)) {
+                this->packetIDs.release((*it)->fh->packetID);
             }
-            this->packetIDMap[packetID] = m;
-        } else if (m->fh->packetID == 0) {
+        }
+        return err;
+    }
+    for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+        MQTT_ERROR e = this->trackSent(*it);
+        if (e != NO_ERROR) {
+            err = e;
+        }
+    }
+    return err;
+}
+
+// keeps the message until it is acknowledged, or releases it when no ack is expected
+MQTT_ERROR Terminal::trackSent(Message* m) {
+    uint16_t packetID = m->fh->packetID;
+    if (m->fh->type == PUBLISH_MESSAGE_TYPE) {
+        if (packetID > 0) {
+            this->inflight.insert(packetID, m, monotonicMillis());
+            this->packetIDs.mark(packetID);
+            this->inflightStored(packetID, m);
+            this->inflightAdded();
+        } else {
+            delete m;
+        }
+    } else if (m->fh->type == SUBSCRIBE_MESSAGE_TYPE || m->fh->type == UNSUBSCRIBE_MESSAGE_TYPE || m->fh->type == PUBREL_MESSAGE_TYPE) {
+        if (packetID == 0) {
+            return PACKET_ID_SHOULD_NOT_BE_ZERO;
+        }
+        if (!this->inflight.insert(packetID, m, monotonicMillis())) {
             delete m;
+            return PACKET_ID_IS_USED_ALREADY;
+        }
+        this->packetIDs.mark(packetID);
+        this->inflightStored(packetID, m);
+        this->inflightAdded();
+    } else {
+        // PUBREC is not kept, a retransmitted PUBLISH is answered again instead
+        delete m;
+    }
+    return NO_ERROR;
+}
+
+// sends queued publishes while the inflight window has room
+MQTT_ERROR Terminal::drainPending() {
+    MQTT_ERROR err = NO_ERROR;
+    while (this->pendingPublishes.size() > 0 && this->inflight.size() < this->maxInflight && this->isConnecting) {
+        Message* m = this->pendingPublishes.front();
+        uint16_t id = 0;
+        if (this->getUsablePacketID(&id) != NO_ERROR) {
+            // every id is taken, try again on the next ack
+            return NO_ERROR;
+        }
+        this->pendingPublishes.pop_front();
+        this->pendingPopped();
+        m->fh->packetID = id;
+        err = this->sendMessage(m);
+        if (err != NO_ERROR) {
+            return err;
         }
     }
     return err;
@@ -58,29 +149,33 @@ MQTT_ERROR Terminal::sendMessage(Message* m) {
 
 MQTT_ERROR Terminal::redelivery() {
     MQTT_ERROR err;
-    if (!this->cleanSession && this->packetIDMap.size() > 0) {
-        for (std::map<uint16_t, Message*>::iterator itPair = this->packetIDMap.begin(); itPair != this->packetIDMap.end(); itPair++) {
-            if (itPair->second->fh->type == PUBLISH_MESSAGE_TYPE) {
-                itPair->second->fh->dup = true;
+    if (!this->cleanSession && this->inflight.size() > 0) {
+        // resent as they are, so they stay in the window
+        std::vector<uint16_t> ids;
+        for (uint16_t id = this->inflight.first(); id != 0; id = this->inflight.next(id)) {
+            Message* m = this->inflight.find(id);
+            if (m->fh->type == PUBLISH_MESSAGE_TYPE) {
+                m->fh->dup = true;
             }
-            err = this->sendMessage(itPair->second);
+            err = this->ct->sendMessage(m);
             if (err != NO_ERROR) {
                 return err;
             }
+            ids.push_back(id);
         }
+        uint32_t now = monotonicMillis();
+        for (std::vector<uint16_t>::iterator it = ids.begin(); it != ids.end(); it++) {
+            this->inflight.touch(*it, now);
+        }
+        this->inflightAdded();
     }
-    return NO_ERROR;
+    return this->drainPending();
 }
 
 MQTT_ERROR Terminal::getUsablePacketID(uint16_t* id) {
-    bool exists = true;
-    for (int trial = 0; exists; trial++) {
-        if (trial == 5) {
-            *id = -1;
-            return FAIL_TO_SET_PACKET_ID;
-        }
-        *id = randPacketID(mt);
-        exists = !(this->packetIDMap.find(*id) == this->packetIDMap.end());
+    if (!this->packetIDs.acquire(id)) {
+        *id = 0;
+        return FAIL_TO_SET_PACKET_ID;
     }
     return NO_ERROR;
 }
@@ -90,10 +185,48 @@ MQTT_ERROR Terminal::disconnectBase() {
         this->isConnecting = false;
         this->will = NULL;
     }
-    close(this->ct->sock);
+    // wakes up a readLoop blocked on this socket, the fd is closed once that loop
+    // has returned so it cannot be reused under it
+    this->ct->shutdown();
     return NO_ERROR;
 }
 
+// hands a decoded message to the handler of its type
+MQTT_ERROR dispatchMessage(Terminal* c, Message* m) {
+    switch (m->fh->type) {
+    case CONNECT_MESSAGE_TYPE:
+        return c->recvConnectMessage((ConnectMessage*)m);
+    case CONNACK_MESSAGE_TYPE:
+        return c->recvConnackMessage((ConnackMessage*)m);
+    case PUBLISH_MESSAGE_TYPE:
+        return c->recvPublishMessage((PublishMessage*)m);
+    case PUBACK_MESSAGE_TYPE:
+        return c->recvPubackMessage((PubackMessage*)m);
+    case PUBREC_MESSAGE_TYPE:
+        return c->recvPubrecMessage((PubrecMessage*)m);
+    case PUBREL_MESSAGE_TYPE:
+        return c->recvPubrelMessage((PubrelMessage*)m);
+    case PUBCOMP_MESSAGE_TYPE:
+        return c->recvPubcompMessage((PubcompMessage*)m);
+    case SUBSCRIBE_MESSAGE_TYPE:
+        return c->recvSubscribeMessage((SubscribeMessage*)m);
+    case SUBACK_MESSAGE_TYPE:
+        return c->recvSubackMessage((SubackMessage*)m);
+    case UNSUBSCRIBE_MESSAGE_TYPE:
+        return c->recvUnsubscribeMessage((UnsubscribeMessage*)m);
+    case UNSUBACK_MESSAGE_TYPE:
+        return c->recvUnsubackMessage((UnsubackMessage*)m);
+    case PINGREQ_MESSAGE_TYPE:
+        return c->recvPingreqMessage((PingreqMessage*)m);
+    case PINGRESP_MESSAGE_TYPE:
+        return c->recvPingrespMessage((PingrespMessage*)m);
+    case DISCONNECT_MESSAGE_TYPE:
+        return c->recvDisconnectMessage((DisconnectMessage*)m);
+    default:
+        return INVALID_MESSAGE_TYPE;
+    }
+}
+
 MQTT_ERROR readLoop(Terminal* c) {
     MQTT_ERROR err = NO_ERROR;
     bool first = true;
@@ -112,110 +245,109 @@ MQTT_ERROR readLoop(Terminal* c) {
             emitError(err);
             return err;
         }
+        traceRead(fh->type == PUBLISH_MESSAGE_TYPE);
+        // may pause for the rate limits, that is not part of routing it
+        c->frameReceived(fh, len + fh->length);
+        LATENCY_READ(fh->type == PUBLISH_MESSAGE_TYPE);
         Message* m;
         switch (fh->type) {
         case CONNECT_MESSAGE_TYPE:
         {
             m = new ConnectMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvConnectMessage((ConnectMessage*)m);
             break;
         }
         case CONNACK_MESSAGE_TYPE:
         {
             m = new ConnackMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvConnackMessage((ConnackMessage*)m);
             break;
         }
         case PUBLISH_MESSAGE_TYPE:
         {
             m = new PublishMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPublishMessage((PublishMessage*)m);
             break;
         }
         case PUBACK_MESSAGE_TYPE:
         {
             m = new PubackMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPubackMessage((PubackMessage*)m);
             break;
         }
         case PUBREC_MESSAGE_TYPE:
         {
             m = new PubrecMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPubrecMessage((PubrecMessage*)m);
             break;
         }
         case PUBREL_MESSAGE_TYPE:
         {
             m = new PubrelMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPubrelMessage((PubrelMessage*)m);
             break;
         }
         case PUBCOMP_MESSAGE_TYPE:
         {
             m = new PubcompMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPubcompMessage((PubcompMessage*)m);
             break;
         }
         case SUBSCRIBE_MESSAGE_TYPE:
         {
             m = new SubscribeMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvSubscribeMessage((SubscribeMessage*)m);
             break;
         }
         case SUBACK_MESSAGE_TYPE:
         {
             m = new SubackMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvSubackMessage((SubackMessage*)m);
             break;
         }
         case UNSUBSCRIBE_MESSAGE_TYPE:
         {
             m = new UnsubscribeMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvUnsubscribeMessage((UnsubscribeMessage*)m);
             break;
         }
         case UNSUBACK_MESSAGE_TYPE:
         {
             m = new UnsubackMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvUnsubackMessage((UnsubackMessage*)m);
             break;
         }
         case PINGREQ_MESSAGE_TYPE:
         {
             m = new PingreqMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPingreqMessage((PingreqMessage*)m);
             break;
         }
         case PINGRESP_MESSAGE_TYPE:
         {
             m = new PingrespMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvPingrespMessage((PingrespMessage*)m);
             break;
         }
         case DISCONNECT_MESSAGE_TYPE:
         {
             m = new DisconnectMessage(fh, c->ct->readBuff+len, err);
             std::cout << "[RECV]" << m->getString() << std::endl;
-            err = c->recvDisconnectMessage((DisconnectMessage*)m);
             break;
         }
         default:
-            err = INVALID_MESSAGE_TYPE;
-            break;
+            emitError(INVALID_MESSAGE_TYPE);
+            return INVALID_MESSAGE_TYPE;
+        }
+        LATENCY_DECODED();
+        c->messageDecoded(m);
+        std::unique_lock<std::recursive_mutex> dispatch;
+        if (c->dispatchLock != NULL) {
+            dispatch = std::unique_lock<std::recursive_mutex>(*c->dispatchLock);
         }
+        LATENCY_DISPATCHED();
+        c->packetReceived();
+        err = dispatchMessage(c, m);
         if (err != NO_ERROR) {
             emitError(err);
             return err;
@@ -4,8 +4,12 @@
 #include "frame.h"
 #include "mqttError.h"
 #include "transport.h"
+#include "packetID.h"
+#include "inflight.h"
+#include "trace.h"
+#include <list>
 #include <map>
-#include <random>
+#include <mutex>
 #include <thread>
 
 class Terminal {
@@ -18,18 +22,33 @@ public:
     const User* user;
     const Will* will;
     uint32_t keepAlive;
-    std::map<uint16_t, Message*> packetIDMap;
-    std::mt19937 mt;
-    std::uniform_int_distribution<> randPacketID;
+    InflightWindow inflight;
+    PacketIDPool packetIDs;
+    PacketIDPool receivedQoS2; // peer ids of QoS2 publishes answered with PUBREC and not released yet
+    uint32_t maxInflight; // QoS1/2 publishes beyond this wait in pendingPublishes
+    std::list<Message*> pendingPublishes;
+    std::map<uint16_t, TraceTag> tracedIDs; // inflight packet ids of sampled messages
+    std::recursive_mutex* dispatchLock; // held while a received message is handled, when set
 public:
     Terminal() {};
     Terminal(const std::string id, const User* user, uint32_t keepAlive, const Will* will);
     MQTT_ERROR ackMessage(uint16_t pID);
     MQTT_ERROR sendMessage(Message* m);
+    MQTT_ERROR sendMessages(std::vector<Message*>& ms);
+    MQTT_ERROR trackSent(Message* m);
     MQTT_ERROR redelivery();
+    MQTT_ERROR drainPending();
     MQTT_ERROR getUsablePacketID(uint16_t* id);
     MQTT_ERROR disconnectBase();
     virtual ~Terminal();
+    virtual void frameReceived(FixedHeader* fh, uint32_t length) {};
+    virtual void messageDecoded(Message* m) {}; // before the dispatch lock is taken
+    virtual void packetReceived() {};
+    virtual void inflightAdded() {};
+    virtual void inflightStored(uint16_t id, Message* m) {};
+    virtual void inflightRemoved(uint16_t id) {};
+    virtual void pendingPushed(Message* m) {};
+    virtual void pendingPopped() {};
     virtual MQTT_ERROR recvConnectMessage(ConnectMessage* m) = 0;
     virtual MQTT_ERROR recvConnackMessage(ConnackMessage* m) = 0;
     virtual MQTT_ERROR recvPublishMessage(PublishMessage* m) = 0;
@@ -47,6 +66,7 @@ public:
 };
 
 
+MQTT_ERROR dispatchMessage(Terminal* c, Message* m);
 MQTT_ERROR readLoop(Terminal* c);
 
 
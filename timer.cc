@@ -0,0 +1,122 @@
+#include "timer.h"
+#include <chrono>
+#include <vector>
+
+TimingWheel::TimingWheel(uint32_t tickMs, std::recursive_mutex* dispatchLock) : now(0), dispatchLock(dispatchLock), running(false), tickMs(tickMs) {}
+
+TimingWheel::~TimingWheel() {
+    this->stop();
+}
+
+void TimingWheel::unlink(TimerEntry* e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+    e->prev = e;
+    e->next = e;
+}
+
+void TimingWheel::place(TimerEntry* e) {
+    uint64_t diff = e->deadline - this->now;
+    int level = 0;
+    while (level < 3 && diff >= (1ULL << (8 * (level + 1)))) {
+        level++;
+    }
+    if (diff >= (1ULL << 32)) {
+        e->deadline = this->now + (1ULL << 32) - 1;
+    }
+    TimerEntry* head = &this->slots[level][(e->deadline >> (8 * level)) & 0xff];
+    e->prev = head->prev;
+    e->next = head;
+    head->prev->next = e;
+    head->prev = e;
+}
+
+void TimingWheel::schedule(TimerEntry* e, uint64_t delayMs) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (e->armed()) {
+        this->unlink(e);
+    }
+    uint64_t ticks = (delayMs + this->tickMs - 1) / this->tickMs;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+    e->deadline = this->now + ticks;
+    this->place(e);
+}
+
+void TimingWheel::cancel(TimerEntry* e) {
+    std::lock_guard<std::mutex> lock(this->mtx);
+    if (e->armed()) {
+        this->unlink(e);
+    }
+}
+
+// moves every entry of the current slot of 'level' one level down
+void TimingWheel::cascade(int level) {
+    TimerEntry* head = &this->slots[level][(this->now >> (8 * level)) & 0xff];
+    while (head->next != head) {
+        TimerEntry* e = head->next;
+        this->unlink(e);
+        this->place(e);
+    }
+}
+
+void TimingWheel::advance(uint64_t ticks) {
+    for (uint64_t t = 0; t < ticks; t++) {
+        std::vector<TimerEntry*> expired;
+        {
+            std::lock_guard<std::mutex> lock(this->mtx);
+            this->now++;
+            int top = 0;
+            while (top < 3 && (this->now & ((1ULL << (8 * (top + 1))) - 1)) == 0) {
+                top++;
+            }
+            // higher levels first, they may refill the lower slots due now
+            for (int level = top; level > 0; level--) {
+                this->cascade(level);
+            }
+            TimerEntry* head = &this->slots[0][this->now & 0xff];
+            while (head->next != head) {
+                TimerEntry* e = head->next;
+                this->unlink(e);
+                expired.push_back(e);
+            }
+        }
+        // the callbacks may schedule again, so the wheel is unlocked here
+        for (std::vector<TimerEntry*>::iterator it = expired.begin(); it != expired.end(); it++) {
+            (*it)->callback();
+        }
+    }
+}
+
+void TimingWheel::loop() {
+    std::chrono::steady_clock::time_point origin = std::chrono::steady_clock::now();
+    uint64_t done = 0;
+    while (this->running) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(this->tickMs));
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - origin).count() / this->tickMs;
+        if (this->dispatchLock != NULL) {
+            std::lock_guard<std::recursive_mutex> lock(*this->dispatchLock);
+            this->advance(elapsed - done);
+        } else {
+            this->advance(elapsed - done);
+        }
+        done = elapsed;
+    }
+}
+
+void TimingWheel::start() {
+    if (this->running) {
+        return;
+    }
+    this->running = true;
+    this->thread = std::thread(&TimingWheel::loop, this);
+}
+
+void TimingWheel::stop() {
+    if (!this->running) {
+        return;
+    }
+    this->running = false;
+    this->thread.join();
+}
@@ -0,0 +1,47 @@
+#ifndef MQTT_TIMER_H_
+#define MQTT_TIMER_H_
+
+#include <stdint.h>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// intrusive timer node, embedded in whatever owns the deadline
+class TimerEntry {
+public:
+    std::function<void()> callback;
+    uint64_t deadline;
+    TimerEntry* prev;
+    TimerEntry* next;
+    TimerEntry() : deadline(0), prev(this), next(this) {};
+    TimerEntry(std::function<void()> cb) : callback(cb), deadline(0), prev(this), next(this) {};
+    bool armed() {return this->next != this;};
+};
+
+// hierarchical timing wheel, 4 levels of 256 slots. schedule and cancel are O(1),
+// entries further away than one level are cascaded down as time goes by.
+// Callbacks run on the wheel's thread while dispatchLock is held, so an owner
+// that cancels under the same lock never sees its callback afterwards.
+class TimingWheel {
+    TimerEntry slots[4][256];
+    uint64_t now; // in ticks
+    std::mutex mtx;
+    std::recursive_mutex* dispatchLock;
+    std::thread thread;
+    bool running;
+    void place(TimerEntry* e);
+    void unlink(TimerEntry* e);
+    void cascade(int level);
+    void loop();
+public:
+    uint32_t tickMs;
+    TimingWheel(uint32_t tickMs, std::recursive_mutex* dispatchLock);
+    ~TimingWheel();
+    void schedule(TimerEntry* e, uint64_t delayMs);
+    void cancel(TimerEntry* e);
+    void advance(uint64_t ticks);
+    void start();
+    void stop();
+};
+
+#endif // MQTT_TIMER_H_
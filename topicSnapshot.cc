@@ -0,0 +1,401 @@
+#include "topicSnapshot.h"
+#include "sharedSubscription.h"
+#include "util.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+const static char SNAPSHOT_MAGIC[8] = {'M', 'Q', 'T', 'T', 'T', 'R', 'E', '1'};
+const static uint32_t SNAPSHOT_HEADER = 24; // magic, root offset, session table offset
+const static size_t WRITE_CHUNK = 4 * 1024 * 1024;
+
+static void putU16(std::string* out, uint16_t v) {
+    out->push_back((char)(v >> 8));
+    out->push_back((char)v);
+}
+
+static void putU32(std::string* out, uint32_t v) {
+    putU16(out, (uint16_t)(v >> 16));
+    putU16(out, (uint16_t)v);
+}
+
+static void putU64(std::string* out, uint64_t v) {
+    putU32(out, (uint32_t)(v >> 32));
+    putU32(out, (uint32_t)v);
+}
+
+static void putString(std::string* out, const std::string& s) {
+    putU16(out, (uint16_t)s.size());
+    out->append(s);
+}
+
+// bounds checked reads from the mapping, a short read poisons the reader
+struct SnapshotReader {
+    SnapshotReader(const uint8_t* p, const uint8_t* end) : p(p), end(end), ok(p <= end) {};
+    const uint8_t* p;
+    const uint8_t* end;
+    bool ok;
+    bool need(uint64_t n) {
+        if (!this->ok || (uint64_t)(this->end - this->p) < n) {
+            this->ok = false;
+        }
+        return this->ok;
+    }
+    uint8_t u8() {
+        return this->need(1) ? *(this->p++) : 0;
+    }
+    uint16_t u16() {
+        if (!this->need(2)) {
+            return 0;
+        }
+        uint16_t v = (uint16_t)this->p[0] << 8 | this->p[1];
+        this->p += 2;
+        return v;
+    }
+    uint32_t u32() {
+        uint32_t hi = this->u16();
+        return hi << 16 | this->u16();
+    }
+    uint64_t u64() {
+        uint64_t hi = this->u32();
+        return hi << 32 | this->u32();
+    }
+    std::string str() {
+        uint16_t len = this->u16();
+        if (!this->need(len)) {
+            return "";
+        }
+        std::string s((const char*)this->p, len);
+        this->p += len;
+        return s;
+    }
+};
+
+struct SnapshotWriter {
+    SnapshotWriter(int fd) : fd(fd), flushed(0), ok(true) {};
+    int fd;
+    std::string buf;
+    uint64_t flushed;
+    bool ok;
+    // returns the file offset of the record
+    uint64_t emit(const std::string& rec) {
+        uint64_t pos = this->flushed + this->buf.size();
+        this->buf.append(rec);
+        if (this->buf.size() >= WRITE_CHUNK) {
+            this->flush();
+        }
+        return pos;
+    }
+    void flush() {
+        if (::write(this->fd, this->buf.data(), this->buf.size()) != (ssize_t)this->buf.size()) {
+            this->ok = false;
+        }
+        this->flushed += this->buf.size();
+        this->buf.clear();
+    }
+};
+
+// name, path, subscribers and shared groups, the reader is left at the child list
+void TopicSnapshot::readFields(SnapshotReader& r, TopicNode* node) {
+    node->name = r.str();
+    node->fullPath = r.str();
+    uint32_t n = r.u32();
+    node->subscribers.reserve(n);
+    for (uint32_t i = 0; i < n && r.ok; i++) {
+        uint32_t session = r.u32();
+        node->subscribers.push_back(Subscriber(session, r.u8()));
+    }
+    node->indexSubscribers();
+    uint32_t groups = r.u32();
+    for (uint32_t i = 0; i < groups && r.ok; i++) {
+        SharedGroup* g = new SharedGroup(r.str());
+        g->cursor = r.u32();
+        uint32_t members = r.u32();
+        for (uint32_t m = 0; m < members && r.ok; m++) {
+            uint32_t session = r.u32();
+            g->members.push_back(Subscriber(session, r.u8()));
+        }
+        node->sharedGroups[g->name] = g;
+    }
+}
+
+static bool kept(const std::vector<bool>& keep, uint32_t session) {
+    return session < keep.size() && keep[session];
+}
+
+// copies the kept ones of n subscriber records, returns how many
+static uint32_t copySubscribers(SnapshotReader& r, uint32_t n, const std::vector<bool>& keep, std::string* out) {
+    uint32_t copied = 0;
+    for (uint32_t i = 0; i < n && r.ok; i++) {
+        uint32_t session = r.u32();
+        uint8_t qos = r.u8();
+        if (r.ok && kept(keep, session)) {
+            putU32(out, session);
+            out->push_back((char)qos);
+            copied++;
+        }
+    }
+    return copied;
+}
+
+static void copyChildren(SnapshotWriter& w, SnapshotReader& r, const uint8_t* base, const std::vector<bool>& keep, std::string* rec);
+
+// re-emits a subtree that was never loaded from the old mapping, without
+// building its nodes
+static uint64_t copyNode(SnapshotWriter& w, const uint8_t* base, const uint8_t* end, uint64_t offset, const std::vector<bool>& keep) {
+    SnapshotReader r(base + offset, end);
+    std::string rec;
+    putString(&rec, r.str());
+    putString(&rec, r.str());
+    std::string subs;
+    uint32_t n = copySubscribers(r, r.u32(), keep, &subs);
+    putU32(&rec, n);
+    rec.append(subs);
+    std::string groups;
+    uint32_t groupCount = 0;
+    uint32_t total = r.u32();
+    for (uint32_t i = 0; i < total && r.ok; i++) {
+        std::string name = r.str();
+        uint32_t cursor = r.u32();
+        std::string members;
+        n = copySubscribers(r, r.u32(), keep, &members);
+        if (n == 0) {
+            continue;
+        }
+        putString(&groups, name);
+        putU32(&groups, cursor);
+        putU32(&groups, n);
+        groups.append(members);
+        groupCount++;
+    }
+    putU32(&rec, groupCount);
+    rec.append(groups);
+    if (!r.ok) {
+        w.ok = false;
+        return 0;
+    }
+    copyChildren(w, r, base, keep, &rec);
+    return w.emit(rec);
+}
+
+static void copyChildren(SnapshotWriter& w, SnapshotReader& r, const uint8_t* base, const std::vector<bool>& keep, std::string* rec) {
+    uint32_t n = r.u32();
+    std::vector<uint64_t> children;
+    for (uint32_t i = 0; i < n && r.ok; i++) {
+        uint64_t offset = r.u64();
+        if (r.ok && offset < (uint64_t)(r.end - base)) {
+            children.push_back(copyNode(w, base, r.end, offset, keep));
+        }
+    }
+    putU32(rec, children.size());
+    for (size_t i = 0; i < children.size(); i++) {
+        putU64(rec, children[i]);
+    }
+}
+
+uint64_t TopicSnapshot::writeNode(SnapshotWriter& w, TopicNode* node, const std::vector<bool>& keep) {
+    std::string rec;
+    putString(&rec, node->name);
+    putString(&rec, node->fullPath);
+    std::string subs;
+    uint32_t n = 0;
+    for (std::vector<Subscriber>::iterator it = node->subscribers.begin(); it != node->subscribers.end(); it++) {
+        if (kept(keep, it->session)) {
+            putU32(&subs, it->session);
+            subs.push_back((char)it->qos);
+            n++;
+        }
+    }
+    putU32(&rec, n);
+    rec.append(subs);
+    std::string groups;
+    uint32_t groupCount = 0;
+    for (std::map<std::string, SharedGroup*>::iterator it = node->sharedGroups.begin(); it != node->sharedGroups.end(); it++) {
+        SharedGroup* g = it->second;
+        std::string members;
+        n = 0;
+        for (std::vector<Subscriber>::iterator m = g->members.begin(); m != g->members.end(); m++) {
+            if (kept(keep, m->session)) {
+                putU32(&members, m->session);
+                members.push_back((char)m->qos);
+                n++;
+            }
+        }
+        if (n == 0) {
+            continue;
+        }
+        putString(&groups, g->name);
+        putU32(&groups, g->cursor);
+        putU32(&groups, n);
+        groups.append(members);
+        groupCount++;
+    }
+    putU32(&rec, groupCount);
+    rec.append(groups);
+    if (node->lazyChildren != NULL) {
+        const TopicSnapshot* s = node->snapshot;
+        SnapshotReader r(node->lazyChildren, s->base + s->length);
+        copyChildren(w, r, s->base, keep, &rec);
+    } else {
+        std::vector<uint64_t> children;
+        for (std::map<std::string, TopicNode*>::iterator it = node->nodes.begin(); it != node->nodes.end(); it++) {
+            children.push_back(writeNode(w, it->second, keep));
+        }
+        putU32(&rec, children.size());
+        for (size_t i = 0; i < children.size(); i++) {
+            putU64(&rec, children[i]);
+        }
+    }
+    return w.emit(rec);
+}
+
+TopicSnapshot::TopicSnapshot() : fd(-1), base(NULL), length(0) {}
+
+TopicSnapshot::~TopicSnapshot() {
+    this->close();
+}
+
+void TopicSnapshot::close() {
+    if (this->base != NULL) {
+        munmap((void*)this->base, this->length);
+        this->base = NULL;
+    }
+    if (this->fd >= 0) {
+        ::close(this->fd);
+        this->fd = -1;
+    }
+}
+
+MQTT_ERROR TopicSnapshot::open(const std::string path, TopicNode** root, std::vector<SnapshotSession>* sessions) {
+    this->close();
+    this->fd = ::open(path.c_str(), O_RDONLY);
+    if (this->fd < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    struct stat st;
+    if (fstat(this->fd, &st) != 0) {
+        return STORE_IO_ERROR;
+    }
+    if (st.st_size < SNAPSHOT_HEADER) {
+        return STORE_CORRUPTED;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, this->fd, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return STORE_IO_ERROR;
+    }
+    this->base = (const uint8_t*)p;
+    this->length = st.st_size;
+    const uint8_t* end = this->base + this->length;
+    if (memcmp(this->base, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        return STORE_CORRUPTED;
+    }
+    SnapshotReader header(this->base + sizeof(SNAPSHOT_MAGIC), end);
+    uint64_t rootOffset = header.u64();
+    uint64_t tableOffset = header.u64();
+    if (rootOffset >= this->length || tableOffset >= this->length) {
+        return STORE_CORRUPTED;
+    }
+
+    SnapshotReader table(this->base + tableOffset, end);
+    uint32_t n = table.u32();
+    for (uint32_t i = 0; i < n && table.ok; i++) {
+        sessions->push_back(SnapshotSession());
+        SnapshotSession& s = sessions->back();
+        s.slot = table.u32();
+        s.clientID = table.str();
+        uint32_t subs = table.u32();
+        for (uint32_t j = 0; j < subs && table.ok; j++) {
+            std::string topic = table.str();
+            s.subscriptions.push_back(std::make_pair(topic, table.u8()));
+        }
+    }
+    SnapshotReader r(this->base + rootOffset, end);
+    TopicNode* node = new TopicNode("", "");
+    readFields(r, node);
+    if (!r.ok || !table.ok) {
+        delete node;
+        sessions->clear();
+        return STORE_CORRUPTED;
+    }
+    node->snapshot = this;
+    node->lazyChildren = r.p;
+    *root = node;
+    return NO_ERROR;
+}
+
+void TopicSnapshot::loadChildren(TopicNode* node) {
+    const TopicSnapshot* s = node->snapshot;
+    const uint8_t* end = s->base + s->length;
+    SnapshotReader r(node->lazyChildren, end);
+    node->lazyChildren = NULL;
+    uint32_t n = r.u32();
+    for (uint32_t i = 0; i < n && r.ok; i++) {
+        uint64_t offset = r.u64();
+        if (!r.ok || offset >= s->length) {
+            break;
+        }
+        SnapshotReader cr(s->base + offset, end);
+        TopicNode* child = new TopicNode("", "");
+        readFields(cr, child);
+        if (!cr.ok) {
+            delete child;
+            continue;
+        }
+        child->snapshot = s;
+        child->lazyChildren = cr.p;
+        node->nodes[child->name] = child;
+    }
+}
+
+// only subscribers whose slot is in sessions are written, the file is replaced atomically
+MQTT_ERROR TopicSnapshot::write(const std::string path, TopicNode* root, const std::vector<SnapshotSession>& sessions) {
+    std::string tmpPath = path + ".tmp";
+    int out = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    std::vector<bool> keep;
+    for (std::vector<SnapshotSession>::const_iterator it = sessions.begin(); it != sessions.end(); it++) {
+        if (it->slot >= keep.size()) {
+            keep.resize(it->slot + 1, false);
+        }
+        keep[it->slot] = true;
+    }
+    SnapshotWriter w(out);
+    w.emit(std::string(SNAPSHOT_HEADER, '\0'));
+    uint64_t rootOffset = writeNode(w, root, keep);
+    std::string rec;
+    putU32(&rec, sessions.size());
+    uint64_t tableOffset = w.emit(rec);
+    for (std::vector<SnapshotSession>::const_iterator it = sessions.begin(); it != sessions.end(); it++) {
+        rec.clear();
+        putU32(&rec, it->slot);
+        putString(&rec, it->clientID);
+        putU32(&rec, it->subscriptions.size());
+        for (size_t i = 0; i < it->subscriptions.size(); i++) {
+            putString(&rec, it->subscriptions[i].first);
+            rec.push_back((char)it->subscriptions[i].second);
+        }
+        w.emit(rec);
+    }
+    w.flush();
+    std::string header(SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    putU64(&header, rootOffset);
+    putU64(&header, tableOffset);
+    if (!w.ok || pwrite(out, header.data(), header.size(), 0) != (ssize_t)header.size() || fsync(out) != 0) {
+        ::close(out);
+        return STORE_IO_ERROR;
+    }
+    ::close(out);
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        perror("rename");
+        return STORE_IO_ERROR;
+    }
+    return syncDirectory(path);
+}
@@ -0,0 +1,39 @@
+#ifndef MQTT_TOPICSNAPSHOT_H_
+#define MQTT_TOPICSNAPSHOT_H_
+
+#include "mqttError.h"
+#include "topicTree.h"
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct SnapshotReader;
+struct SnapshotWriter;
+
+struct SnapshotSession {
+    uint32_t slot; // index into Broker::sessions the tree refers to
+    std::string clientID;
+    std::vector<std::pair<std::string, uint8_t> > subscriptions;
+};
+
+// memory-mapped image of a TopicNode tree. Nodes are written children first,
+// each with its subscribers, shared groups and the offsets of its children.
+// A tree opened from a snapshot only materializes the root, every other level
+// is built the first time getTopicNode walks into it. The mapping has to
+// outlive the tree.
+class TopicSnapshot {
+    int fd;
+    const uint8_t* base;
+    uint64_t length;
+    static void readFields(SnapshotReader& r, TopicNode* node);
+    static uint64_t writeNode(SnapshotWriter& w, TopicNode* node, const std::vector<bool>& keep);
+public:
+    TopicSnapshot();
+    ~TopicSnapshot();
+    MQTT_ERROR open(const std::string path, TopicNode** root, std::vector<SnapshotSession>* sessions);
+    void close();
+    static MQTT_ERROR write(const std::string path, TopicNode* root, const std::vector<SnapshotSession>& sessions);
+    static void loadChildren(TopicNode* node);
+};
+
+#endif // MQTT_TOPICSNAPSHOT_H_
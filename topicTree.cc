@@ -1,18 +1,35 @@
 #include "topicTree.h"
+#include "sharedSubscription.h"
+#include "topicSnapshot.h"
 #include "frame.h"
 #include "util.h"
+#include "stats.h"
 #include <map>
 #include <vector>
 
-TopicNode::TopicNode(std::string part, std::string fPath) : name(part), nodes(), fullPath(fPath), retainMessage(""), retainQoS(0), subscribers() {}
+TopicNode::TopicNode(std::string part, std::string fPath) : nodes(), name(part), positions(NULL), snapshot(NULL), lazyChildren(NULL), subscribers(), fullPath(fPath) {
+    statAdd(STAT_TOPIC_NODES_CREATED, 1);
+}
 
 TopicNode::~TopicNode() {
     for (std::map<std::string, TopicNode*>::iterator itPair = nodes.begin(); itPair != nodes.end(); itPair++) {
         delete itPair->second;
     }
+    for (std::map<std::string, SharedGroup*>::iterator itPair = sharedGroups.begin(); itPair != sharedGroups.end(); itPair++) {
+        delete itPair->second;
+    }
+    delete positions;
+    statAdd(STAT_TOPIC_NODES_DELETED, 1);
+}
+
+void TopicNode::hydrate() {
+    if (lazyChildren != NULL) {
+        TopicSnapshot::loadChildren(this);
+    }
 }
 
 MQTT_ERROR TopicNode::getNodesByNumberSign(std::vector<TopicNode*>* resp) {
+    hydrate();
     if (fullPath.find_last_of("/") != std::string::npos) {
         fullPath = fullPath.substr(0, fullPath.size()-1);
     }
@@ -41,6 +58,7 @@ MQTT_ERROR TopicNode::getTopicNode(const std::string topic, bool addNewNode, std
     std::string part;
     for (int i = 0; i < parts.size(); i++) {
         bef = nxt;
+        bef->hydrate();
         part = parts[i];
         if (part == "+") {
             for (std::map<std::string, TopicNode*>::iterator itPair = bef->nodes.begin(); itPair != bef->nodes.end(); itPair++) {
@@ -82,7 +100,82 @@ MQTT_ERROR TopicNode::getTopicNode(const std::string topic, bool addNewNode, std
     return err;
 }
 
-MQTT_ERROR TopicNode::applySubscriber(const std::string clientID, const std::string topic, uint8_t qos, std::vector<SubackCode>* resp) {
+// nodes with few subscribers are scanned, larger ones keep a position index
+const static uint32_t INDEXED_SUBSCRIBERS = 64;
+
+uint32_t TopicNode::findSubscriber(uint32_t session) {
+    if (positions != NULL) {
+        std::unordered_map<uint32_t, uint32_t>::iterator it = positions->find(session);
+        return it == positions->end() ? subscribers.size() : it->second;
+    }
+    uint32_t i = 0;
+    while (i < subscribers.size() && subscribers[i].session != session) {
+        i++;
+    }
+    return i;
+}
+
+void TopicNode::setSubscriber(uint32_t session, uint8_t qos) {
+    uint32_t i = findSubscriber(session);
+    if (i < subscribers.size()) {
+        subscribers[i].qos = qos;
+        return;
+    }
+    subscribers.push_back(Subscriber(session, qos));
+    if (positions != NULL) {
+        (*positions)[session] = i;
+    } else {
+        indexSubscribers();
+    }
+}
+
+void TopicNode::indexSubscribers() {
+    if (positions != NULL || subscribers.size() <= INDEXED_SUBSCRIBERS) {
+        return;
+    }
+    positions = new std::unordered_map<uint32_t, uint32_t>();
+    for (uint32_t n = 0; n < subscribers.size(); n++) {
+        (*positions)[subscribers[n].session] = n;
+    }
+}
+
+void TopicNode::removeSubscriber(uint32_t session) {
+    uint32_t i = findSubscriber(session);
+    if (i == subscribers.size()) {
+        return;
+    }
+    // order of delivery is not significant, swap with the tail to keep the array dense
+    subscribers[i] = subscribers.back();
+    subscribers.pop_back();
+    if (positions != NULL) {
+        positions->erase(session);
+        if (i < subscribers.size()) {
+            (*positions)[subscribers[i].session] = i;
+        }
+    }
+}
+
+void TopicNode::setSharedSubscriber(const std::string group, uint32_t session, uint8_t qos) {
+    std::map<std::string, SharedGroup*>::iterator it = sharedGroups.find(group);
+    if (it == sharedGroups.end()) {
+        it = sharedGroups.insert(std::make_pair(group, new SharedGroup(group))).first;
+    }
+    it->second->setMember(session, qos);
+}
+
+void TopicNode::removeSharedSubscriber(const std::string group, uint32_t session) {
+    std::map<std::string, SharedGroup*>::iterator it = sharedGroups.find(group);
+    if (it == sharedGroups.end()) {
+        return;
+    }
+    it->second->removeMember(session);
+    if (it->second->members.size() == 0) {
+        delete it->second;
+        sharedGroups.erase(it);
+    }
+}
+
+MQTT_ERROR TopicNode::applySubscriber(uint32_t session, const std::string topic, uint8_t qos, std::vector<SubackCode>* resp) {
     std::vector<TopicNode*> subNodes;
     MQTT_ERROR err = getTopicNode(topic, true, &subNodes);
     if (err != NO_ERROR) {
@@ -90,38 +183,38 @@ MQTT_ERROR TopicNode::applySubscriber(const std::string clientID, const std::str
     }
     for (std::vector<TopicNode*>::iterator it = subNodes.begin(); it != subNodes.end(); it++) {
         // TODO: the return qos should be managed by broker
-        (*it)->subscribers[clientID] = qos;
+        (*it)->setSubscriber(session, qos);
         resp->push_back((SubackCode)qos);
     }
     return err;
 }
 
-MQTT_ERROR TopicNode::deleteSubscriber(const std::string clientID, const std::string topic) {
+MQTT_ERROR TopicNode::deleteSubscriber(uint32_t session, const std::string topic) {
     std::vector<TopicNode*> subNodes;
     MQTT_ERROR err= getTopicNode(topic, false, &subNodes);
     if (err != NO_ERROR) {
         return err;
     }
     for (std::vector<TopicNode*>::iterator it = subNodes.begin(); it != subNodes.end(); it++) {
-        (*it)->subscribers.erase(clientID);
+        (*it)->removeSubscriber(session);
     }
     return err;
 }
 
-MQTT_ERROR TopicNode::applyRetain(const std::string topic, uint8_t qos, const std::string retain) {
-    std::vector<TopicNode*> retainNodes;
-    MQTT_ERROR err = getTopicNode(topic, true, &retainNodes);
+MQTT_ERROR TopicNode::deleteSharedSubscriber(uint32_t session, const std::string group, const std::string topic) {
+    std::vector<TopicNode*> subNodes;
+    MQTT_ERROR err= getTopicNode(topic, false, &subNodes);
     if (err != NO_ERROR) {
         return err;
     }
-    for (std::vector<TopicNode*>::iterator it = retainNodes.begin(); it != retainNodes.end(); it++) {
-        (*it)->retainMessage = retain;
-        (*it)->retainQoS = qos;
+    for (std::vector<TopicNode*>::iterator it = subNodes.begin(); it != subNodes.end(); it++) {
+        (*it)->removeSharedSubscriber(group, session);
     }
     return err;
 }
 
 std::vector<std::string> TopicNode::dumpTree() {
+    hydrate();
     std::vector<std::string> strs;
     if (nodes.size() == 0) {
         strs.push_back(this->name);
@@ -4,25 +4,45 @@
 #include "frame.h"
 #include "mqttError.h"
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <string>
 
+struct Subscriber {
+    Subscriber(uint32_t session, uint8_t qos) : session(session), qos(qos) {};
+    uint32_t session; // index into Broker::sessions
+    uint8_t qos;
+};
+
+class SharedGroup;
+class ShareStrategy;
+class TopicSnapshot;
+
 class TopicNode {
+    friend class TopicSnapshot;
     std::map<std::string, TopicNode*> nodes;
     std::string name;
-    std::string allTopicName[65536]; //only for root, for broker?
+    std::unordered_map<uint32_t, uint32_t>* positions; // session -> index in subscribers, only for busy nodes
+    const TopicSnapshot* snapshot;
+    const uint8_t* lazyChildren; // children are still in the snapshot when set
+    uint32_t findSubscriber(uint32_t session);
+    void indexSubscribers();
+    void hydrate();
     MQTT_ERROR getNodesByNumberSign(std::vector<TopicNode*>* resp);
 public:
-    std::map<std::string, uint8_t> subscribers;
+    std::vector<Subscriber> subscribers;
+    std::map<std::string, SharedGroup*> sharedGroups;
     std::string fullPath;
-    std::string retainMessage;
-    uint8_t retainQoS;
     TopicNode(std::string part, std::string fPath);
     ~TopicNode();
     MQTT_ERROR getTopicNode(const std::string topic, bool addNewNode, std::vector<TopicNode*>* resp);
-    MQTT_ERROR applySubscriber(const std::string clientID, const std::string topic, uint8_t qos, std::vector<SubackCode>* resp);
-    MQTT_ERROR deleteSubscriber(const std::string clientID, const std::string topic);
-    MQTT_ERROR applyRetain(const std::string topic, uint8_t qos, const std::string retain);
+    void setSubscriber(uint32_t session, uint8_t qos);
+    void removeSubscriber(uint32_t session);
+    void setSharedSubscriber(const std::string group, uint32_t session, uint8_t qos);
+    void removeSharedSubscriber(const std::string group, uint32_t session);
+    MQTT_ERROR applySubscriber(uint32_t session, const std::string topic, uint8_t qos, std::vector<SubackCode>* resp);
+    MQTT_ERROR deleteSubscriber(uint32_t session, const std::string topic);
+    MQTT_ERROR deleteSharedSubscriber(uint32_t session, const std::string group, const std::string topic);
     std::vector<std::string> dumpTree();
 };
 
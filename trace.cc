@@ -0,0 +1,251 @@
+#include "trace.h"
+#include "util.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string.h>
+#include <vector>
+
+uint32_t traceSampleEvery = 0;
+uint32_t traceRingSize = 256;
+
+static const char* const PointName[] = {
+    "read",
+    "received",
+    "matched",
+    "enqueued",
+    "written",
+    "acked",
+};
+
+struct TraceEvent {
+    uint64_t trace;
+    uint64_t ts; // us, monotonic
+    uint32_t session;
+    uint32_t value;
+    uint32_t thread;
+    uint8_t point;
+    char detail[43]; // topic or client id, cut short
+};
+
+// written by its thread, copied out by traceDump. The lock is only taken for
+// sampled messages, so it is never contended on the routing path.
+struct TraceRing {
+    TraceRing(uint32_t size, uint32_t thread) : events(size), next(0), thread(thread) {};
+    std::mutex mtx;
+    std::vector<TraceEvent> events;
+    uint64_t next; // events ever written, the oldest is at next % size once full
+    uint32_t thread;
+    void push(const TraceEvent& e) {
+        this->events[this->next % this->events.size()] = e;
+        this->next++;
+    };
+    void copy(std::vector<TraceEvent>* out) {
+        uint64_t n = std::min<uint64_t>(this->next, this->events.size());
+        for (uint64_t i = this->next - n; i < this->next; i++) {
+            out->push_back(this->events[i % this->events.size()]);
+        }
+    };
+};
+
+static std::mutex registryMtx;
+static std::vector<TraceRing*> live;
+static TraceRing* retired = NULL; // events of exited threads, acks often land on short lived ones
+static std::atomic<uint32_t> threads(0);
+static std::atomic<uint64_t> traces(0);
+
+struct RingSlot {
+    TraceRing* ring;
+    RingSlot() : ring(NULL) {};
+    ~RingSlot() {
+        if (this->ring == NULL) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(registryMtx);
+        live.erase(std::find(live.begin(), live.end(), this->ring));
+        if (retired == NULL) {
+            retired = new TraceRing(traceRingSize * 16, 0);
+        }
+        std::vector<TraceEvent> events;
+        this->ring->copy(&events);
+        for (size_t i = 0; i < events.size(); i++) {
+            retired->push(events[i]);
+        }
+        delete this->ring;
+    };
+};
+
+static thread_local RingSlot slot;
+static thread_local uint32_t reads = 0;
+static thread_local TraceTag current;
+
+void traceRead(bool publish) {
+    current = TraceTag();
+    if (!publish || traceSampleEvery == 0 || ++reads < traceSampleEvery) {
+        return;
+    }
+    reads = 0;
+    current.trace = ++traces;
+    tracePoint(TRACE_READ, current, "", 0);
+}
+
+TraceTag traceCurrent() {
+    return current;
+}
+
+void traceDelivering(uint32_t session) {
+    current.session = session;
+}
+
+void tracePoint(TracePoint point, TraceTag tag, const std::string& detail, uint32_t value) {
+    if (slot.ring == NULL) {
+        TraceRing* ring = new TraceRing(traceRingSize, ++threads);
+        std::lock_guard<std::mutex> lock(registryMtx);
+        live.push_back(ring);
+        slot.ring = ring;
+    }
+    TraceEvent e;
+    e.trace = tag.trace;
+    e.ts = monotonicMicros();
+    e.session = tag.session;
+    e.value = value;
+    e.thread = slot.ring->thread;
+    e.point = point;
+    size_t n = std::min(detail.size(), sizeof(e.detail) - 1);
+    // cut before a multibyte character that does not fit, never inside it
+    if (n < detail.size()) {
+        while (n > 0 && ((uint8_t)detail[n] & 0xc0) == 0x80) {
+            n--;
+        }
+    }
+    memcpy(e.detail, detail.data(), n);
+    e.detail[n] = '\0';
+    std::lock_guard<std::mutex> lock(slot.ring->mtx);
+    slot.ring->push(e);
+}
+
+static std::string jsonString(const char* s) {
+    std::stringstream out;
+    out << '"';
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            out << '\\' << *s;
+        } else if ((unsigned char)*s < 0x20) {
+            out << "\\u00" << "0123456789abcdef"[*s >> 4] << "0123456789abcdef"[*s & 0xf];
+        } else {
+            out << *s;
+        }
+    }
+    out << '"';
+    return out.str();
+}
+
+struct TraceSpan {
+    TraceSpan() : begin(0), end(0), thread(0), name("") {};
+    uint64_t begin;
+    uint64_t end;
+    uint32_t thread;
+    std::string name;
+    void extend(const TraceEvent& e) {
+        if (this->begin == 0 || e.ts < this->begin) {
+            this->begin = e.ts;
+            this->thread = e.thread;
+        }
+        if (e.ts > this->end) {
+            this->end = e.ts;
+        }
+    };
+};
+
+static void asyncEvent(std::stringstream& out, bool* first, const char* ph, const std::string& name, uint64_t trace, uint64_t ts, uint32_t thread, const std::string& args) {
+    out << (*first ? "\n" : ",\n");
+    *first = false;
+    out << "{\"name\":" << jsonString(name.c_str()) << ",\"cat\":\"mqtt\",\"ph\":\"" << ph << "\",\"id\":\"0x" << std::hex << trace << std::dec << "\",\"ts\":" << ts << ",\"pid\":1,\"tid\":" << thread;
+    if (args.size() > 0) {
+        out << ",\"args\":{" << args << "}";
+    }
+    out << "}";
+}
+
+std::string traceDump() {
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(registryMtx);
+        if (retired != NULL) {
+            retired->copy(&events);
+        }
+        for (size_t i = 0; i < live.size(); i++) {
+            std::lock_guard<std::mutex> ringLock(live[i]->mtx);
+            live[i]->copy(&events);
+        }
+    }
+
+    // a message is a span from its first to its last point, each subscriber's
+    // copy a span nested in it from enqueued to written or acked
+    std::map<uint64_t, TraceSpan> messages;
+    std::map<std::pair<uint64_t, uint32_t>, TraceSpan> deliveries;
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        TraceSpan& message = messages[e.trace];
+        message.extend(e);
+        if (e.point == TRACE_RECEIVED) {
+            message.name = std::string("publish ") + e.detail;
+        }
+        if (e.point >= TRACE_ENQUEUED) {
+            TraceSpan& delivery = deliveries[std::make_pair(e.trace, e.session)];
+            delivery.extend(e);
+            if (e.point == TRACE_ENQUEUED) {
+                delivery.name = std::string("deliver ") + e.detail;
+            }
+        }
+    }
+
+    std::stringstream out;
+    bool first = true;
+    out << "{\"traceEvents\":[";
+    for (std::map<uint64_t, TraceSpan>::iterator it = messages.begin(); it != messages.end(); it++) {
+        std::string name = it->second.name.size() > 0 ? it->second.name : "publish";
+        asyncEvent(out, &first, "b", name, it->first, it->second.begin, it->second.thread, "");
+        asyncEvent(out, &first, "e", name, it->first, it->second.end, it->second.thread, "");
+    }
+    for (std::map<std::pair<uint64_t, uint32_t>, TraceSpan>::iterator it = deliveries.begin(); it != deliveries.end(); it++) {
+        std::string name = it->second.name.size() > 0 ? it->second.name : "deliver";
+        asyncEvent(out, &first, "b", name, it->first.first, it->second.begin, it->second.thread, "");
+        asyncEvent(out, &first, "e", name, it->first.first, it->second.end, it->second.thread, "");
+    }
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        std::stringstream args;
+        switch (e.point) {
+        case TRACE_RECEIVED:
+            args << "\"topic\":" << jsonString(e.detail) << ",\"qos\":" << e.value;
+            break;
+        case TRACE_MATCHED:
+            args << "\"subscribers\":" << e.value;
+            break;
+        case TRACE_ENQUEUED:
+            args << "\"client\":" << jsonString(e.detail) << ",\"packetID\":" << e.value;
+            break;
+        case TRACE_WRITTEN:
+        case TRACE_ACKED:
+            args << "\"session\":" << e.session << ",\"packetID\":" << e.value;
+            break;
+        }
+        asyncEvent(out, &first, "n", PointName[e.point], e.trace, e.ts, e.thread, args.str());
+    }
+    out << "\n]}\n";
+    return out.str();
+}
+
+MQTT_ERROR traceDumpFile(const std::string path) {
+    std::ofstream f(path.c_str(), std::ios::out | std::ios::trunc);
+    if (!f) {
+        return STORE_IO_ERROR;
+    }
+    f << traceDump();
+    f.close();
+    return f.fail() ? STORE_IO_ERROR : NO_ERROR;
+}
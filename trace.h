@@ -0,0 +1,42 @@
+#ifndef MQTT_TRACE_H_
+#define MQTT_TRACE_H_
+
+#include "mqttError.h"
+#include <stdint.h>
+#include <string>
+
+enum TracePoint {
+    TRACE_READ, // PUBLISH read from the publisher's socket
+    TRACE_RECEIVED, // decoded, detail is the topic
+    TRACE_MATCHED, // subscribers looked up, value is how many
+    TRACE_ENQUEUED, // one subscriber's copy queued, detail is its client id
+    TRACE_WRITTEN, // that copy handed to the subscriber's socket
+    TRACE_ACKED, // that copy acknowledged
+};
+
+// what a frame or an inflight packet id remembers of the message it belongs to
+struct TraceTag {
+    TraceTag() : trace(0), session(0) {};
+    TraceTag(uint64_t trace, uint32_t session) : trace(trace), session(session) {};
+    uint64_t trace; // 0 when the message is not sampled
+    uint32_t session; // subscriber, for the points after TRACE_ENQUEUED
+};
+
+// one PUBLISH in this many is followed through the broker, 0 disables tracing
+extern uint32_t traceSampleEvery;
+// events kept per thread, older ones are overwritten
+extern uint32_t traceRingSize;
+
+// samples the packet the calling thread has just read, the points below are
+// only recorded while that PUBLISH is being routed
+void traceRead(bool publish);
+TraceTag traceCurrent();
+void traceDelivering(uint32_t session);
+void tracePoint(TracePoint point, TraceTag tag, const std::string& detail, uint32_t value);
+
+// every ring as Chrome trace JSON (chrome://tracing, ui.perfetto.dev): one
+// async track per message with a nested span per subscriber
+std::string traceDump();
+MQTT_ERROR traceDumpFile(const std::string path);
+
+#endif // MQTT_TRACE_H_
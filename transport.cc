@@ -14,6 +14,7 @@ Transport::Transport(int sock, struct sockaddr_in* target) {
     memset(this->writeBuff, 0, 65535);
     this->sock = sock;
     this->target = target;
+    this->outbox = NULL;
 }
 
 Transport::Transport(const std::string targetIP, const int targetPort) {
@@ -25,6 +26,7 @@ Transport::Transport(const std::string targetIP, const int targetPort) {
     this->target->sin_family = AF_INET;
     this->target->sin_port = htons(targetPort);
     this->target->sin_addr.s_addr = inet_addr(targetIP.c_str());
+    this->outbox = NULL;
 }
 
 void Transport::connectTarget() {
@@ -39,6 +41,9 @@ MQTT_ERROR Transport::sendMessage(Message* m) {
         // m->getWire can return MQTT error potentially
         return SEND_ERROR;
     }
+    if (this->outbox != NULL) {
+        return this->outbox->push(this->writeBuff, len, m->fh->type == PUBLISH_MESSAGE_TYPE && m->fh->qos == 0);
+    }
     int64_t status = write(this->sock, this->writeBuff, len);
     if (status == -1) {
         perror("Write");
@@ -47,6 +52,44 @@ MQTT_ERROR Transport::sendMessage(Message* m) {
     return NO_ERROR;
 }
 
+MQTT_ERROR Transport::sendMessages(std::vector<Message*>& ms) {
+    if (this->outbox != NULL) {
+        // the writer thread coalesces them
+        for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+            int64_t len = (*it)->getWire(this->writeBuff);
+            if (len == -1) {
+                return SEND_ERROR;
+            }
+            MQTT_ERROR err = this->outbox->push(this->writeBuff, len, (*it)->fh->type == PUBLISH_MESSAGE_TYPE && (*it)->fh->qos == 0);
+            if (err != NO_ERROR) {
+                return err;
+            }
+        }
+        return NO_ERROR;
+    }
+    // frames are packed into writeBuff and written with as few syscalls as possible
+    uint64_t used = 0;
+    for (std::vector<Message*>::iterator it = ms.begin(); it != ms.end(); it++) {
+        if (used + (*it)->fh->length + 5 > sizeof(this->writeBuff)) {
+            if (write(this->sock, this->writeBuff, used) == -1) {
+                perror("Write");
+                return SEND_ERROR;
+            }
+            used = 0;
+        }
+        int64_t len = (*it)->getWire(this->writeBuff + used);
+        if (len == -1) {
+            return SEND_ERROR;
+        }
+        used += len;
+    }
+    if (used > 0 && write(this->sock, this->writeBuff, used) == -1) {
+        perror("Write");
+        return SEND_ERROR;
+    }
+    return NO_ERROR;
+}
+
 MQTT_ERROR Transport::readMessage() {
      int64_t status = read(this->sock, this->readBuff, sizeof(this->readBuff));
     if (status == -1) {
@@ -54,10 +97,13 @@ MQTT_ERROR Transport::readMessage() {
         perror("Read");
         return READ_ERROR;
     } else if (status == 0) {
-        /* Peer closed the socket, finish the close */
-        close( this->sock );
-        /* Further processing... */
+        // the fd is closed by whoever runs the read loop, once it has returned
         return PEER_CLOSED;
     }
     return NO_ERROR;
 }
+
+// wakes a read loop blocked on the socket, the fd is closed by whoever runs it
+void Transport::shutdown() {
+    ::shutdown(this->sock, SHUT_RDWR);
+}
@@ -5,6 +5,7 @@
 #include <netinet/in.h>
 #include "frame.h"
 #include "mqttError.h"
+#include "outbox.h"
 
 class Transport {
     struct sockaddr_in* target;
@@ -12,12 +13,15 @@ public:
     uint8_t readBuff[65536];
     uint8_t writeBuff[65536];
     int sock;
+    Outbox* outbox; // owned, frames are queued here instead of written when set
     Transport(int sock, sockaddr_in* client);
     Transport(const std::string tragetIP, const int targetPort);
-    ~Transport() {};
+    virtual ~Transport() {delete this->outbox;};
     void connectTarget();
-    MQTT_ERROR sendMessage(Message* m);
-    MQTT_ERROR readMessage();
+    virtual MQTT_ERROR sendMessage(Message* m);
+    virtual MQTT_ERROR sendMessages(std::vector<Message*>& ms);
+    virtual MQTT_ERROR readMessage();
+    virtual void shutdown();
 };
 
 
@@ -2,6 +2,10 @@
 #include "mqttError.h"
 #include <string.h>
 #include <stdint.h>
+#include <chrono>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
 
 
 int32_t UTF8_encode(uint8_t* wire, std::string s) {
@@ -73,3 +77,29 @@ void emitError(MQTT_ERROR e) {
     std::cout << ErrorString[e] << std::endl;
     return;
 }
+
+MQTT_ERROR syncDirectory(const std::string& path) {
+    size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        perror("open");
+        return STORE_IO_ERROR;
+    }
+    int r = fsync(fd);
+    close(fd);
+    return r == 0 ? NO_ERROR : STORE_IO_ERROR;
+}
+
+// wraps after ~49 days, compare with differences only
+uint32_t monotonicMillis() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t monotonicMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t monotonicNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
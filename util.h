@@ -17,4 +17,11 @@ int split(std::string str, std::string sub, std::vector<std::string>* parts);
 
 void emitError(MQTT_ERROR e);
 
+// fsyncs the directory that holds path, so a file renamed there survives a crash
+MQTT_ERROR syncDirectory(const std::string& path);
+
+uint32_t monotonicMillis();
+uint64_t monotonicMicros();
+uint64_t monotonicNanos();
+
 #endif //MQTT_UTIL_H_